@@ -0,0 +1,170 @@
+/*
+ * Asynchronous file reads and writes.
+ *
+ * fs_read_async and fs_write_async queue a request and return at once.
+ * The I/O thread (io_thread() in th1.c) carries the requests out one
+ * at a time, in the order they came, and sends a struct fs_aio_done to
+ * the mailbox each request names when it is done. A process can so
+ * have several requests outstanding, and harvest them with mbox_recv.
+ *
+ * The thread runs in the kernel address space, where the buffer of the
+ * process cannot be reached through its own addresses. Its pages are
+ * pinned when the request is queued, and the thread copies to and from
+ * them through their physical addresses (physical memory is mapped 1:1
+ * in the kernel). The thread reads or writes the whole request with one
+ * file system call on a buffer of its own, so a request behaves just
+ * like fs_read or fs_write on the open file, offset included.
+ *
+ * The open file is held with a reference of its own (see fs_file_get()),
+ * so a request is done even if its descriptor is closed meanwhile.
+ */
+
+#include "aio.h"
+#include "common.h"
+#include "fs.h"
+#include "fs_error.h"
+#include "kernel.h"
+#include "mbox.h"
+#include "memory.h"
+#include "thread.h"
+#include "util.h"
+
+/* A queued request */
+typedef struct {
+	int write;                      /* TRUE for fs_write_async */
+	open_file_t *file;              /* the open file of aio.fd */
+	struct fs_aio aio;              /* the request, as the process made it */
+	int npieces;                    /* pages of the buffer */
+	uint32_t paddr[AIO_MAX_PAGES];  /* physical address of the buffer in each */
+	int len[AIO_MAX_PAGES];         /* bytes of the buffer in each */
+} aio_request_t;
+
+static int aio_submit(struct fs_aio *aio, int write);
+static void aio_unpin(aio_request_t *req, int dirty);
+
+/* The queue is a circular array, protected like a mailbox */
+static aio_request_t queue[AIO_QUEUE_SIZE];
+static int head;  /* next free slot */
+static int tail;  /* oldest request */
+static int count; /* requests in the queue */
+static lock_t aio_lock;
+static condition_t more_requests, more_space;
+
+/* Where the I/O thread reads and writes */
+static char aio_buffer[AIO_MAX_SIZE];
+
+void aio_init(void) {
+	head = tail = count = 0;
+	lock_init(&aio_lock);
+	condition_init(&more_requests);
+	condition_init(&more_space);
+}
+
+int aio_read(struct fs_aio *aio) {
+	return aio_submit(aio, FALSE);
+}
+
+int aio_write(struct fs_aio *aio) {
+	return aio_submit(aio, TRUE);
+}
+
+/*
+ * Queue a request of current_running. Waits if the queue is full,
+ * like mbox_send() does.
+ */
+static int aio_submit(struct fs_aio *aio, int write) {
+	aio_request_t req;
+	uint32_t vaddr;
+	int done, chunk;
+
+	req.write = write;
+	req.aio = *aio;
+	if ((req.aio.mbox < 0) || (req.aio.mbox >= MAX_MBOX))
+		return FSE_ERROR;
+	if ((req.aio.size < 0) || (req.aio.size > AIO_MAX_SIZE))
+		return FSE_ERROR;
+
+	req.file = fs_file_get(req.aio.fd);
+	if (req.file == NULL)
+		return FSE_INVALIDHANDLE;
+
+	/* pin the buffer, one page at a time (a read writes to it) */
+	req.npieces = 0;
+	vaddr = (uint32_t)req.aio.buffer;
+	for (done = 0; done < req.aio.size; done += chunk) {
+		chunk = PAGE_SIZE - ((vaddr + done) & PAGE_MASK);
+		if (chunk > req.aio.size - done)
+			chunk = req.aio.size - done;
+
+		req.paddr[req.npieces] = page_pin(vaddr + done, !write);
+		if (req.paddr[req.npieces] == 0) {
+			aio_unpin(&req, FALSE);
+			fs_file_put(req.file);
+			return FSE_ERROR;
+		}
+		req.len[req.npieces] = chunk;
+		req.npieces++;
+	}
+
+	lock_acquire(&aio_lock);
+	while (count == AIO_QUEUE_SIZE) {
+		condition_wait(&aio_lock, &more_space);
+	}
+	queue[head] = req;
+	head = (head + 1) % AIO_QUEUE_SIZE;
+	count++;
+	condition_signal(&more_requests);
+	lock_release(&aio_lock);
+
+	return FSE_OK;
+}
+
+/*
+ * Take the oldest request off the queue, do it, and send its
+ * completion. The I/O thread may wait for the mailbox to have room.
+ */
+void aio_serve(void) {
+	char space[MSG_T_HEADER_SIZE + sizeof(struct fs_aio_done)];
+	msg_t *m = (msg_t *)space;
+	struct fs_aio_done *done = (struct fs_aio_done *)m->body;
+	aio_request_t req;
+	int i, pos, n;
+
+	lock_acquire(&aio_lock);
+	while (count == 0) {
+		condition_wait(&aio_lock, &more_requests);
+	}
+	req = queue[tail];
+	tail = (tail + 1) % AIO_QUEUE_SIZE;
+	count--;
+	condition_signal(&more_space);
+	lock_release(&aio_lock);
+
+	if (req.write) {
+		for (i = 0, pos = 0; i < req.npieces; pos += req.len[i], i++)
+			bcopy((char *)req.paddr[i], &aio_buffer[pos], req.len[i]);
+		n = fs_file_write(req.file, aio_buffer, req.aio.size);
+	}
+	else {
+		n = fs_file_read(req.file, aio_buffer, req.aio.size);
+		for (i = 0, pos = 0; (i < req.npieces) && (pos < n); pos += req.len[i], i++)
+			bcopy(&aio_buffer[pos], (char *)req.paddr[i], (n - pos < req.len[i]) ? n - pos : req.len[i]);
+	}
+	aio_unpin(&req, !req.write);
+	fs_file_put(req.file);
+
+	m->size = sizeof(struct fs_aio_done);
+	done->fd = req.aio.fd;
+	done->bytes = (n < 0) ? 0 : n;
+	done->status = (n < 0) ? n : FSE_OK;
+	done->tag = req.aio.tag;
+	mbox_send(req.aio.mbox, m);
+}
+
+/* Unpin the pages of the buffer of req */
+static void aio_unpin(aio_request_t *req, int dirty) {
+	int i;
+
+	for (i = 0; i < req->npieces; i++)
+		page_unpin(req->paddr[i], dirty);
+}
@@ -0,0 +1,29 @@
+/* Header file for aio.c */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include "common.h"
+#include "memory.h"
+
+/* Largest buffer of one asynchronous read or write */
+#define AIO_MAX_SIZE PAGE_SIZE
+/* Pages such a buffer may span */
+#define AIO_MAX_PAGES 2
+/* Requests waiting for the I/O thread, in the whole system */
+#define AIO_QUEUE_SIZE 8
+
+void aio_init(void);
+
+/*
+ * The fs_read_async and fs_write_async system calls. Queue the request
+ * and return FSE_OK, or an error if it could not be queued. The result
+ * is sent to aio->mbox when the request is done.
+ */
+int aio_read(struct fs_aio *aio);
+int aio_write(struct fs_aio *aio);
+
+/* Wait for the next request and carry it out. Run by io_thread() */
+void aio_serve(void);
+
+#endif /* !AIO_H */
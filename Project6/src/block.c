@@ -3,96 +3,207 @@
 #include "fs.h"
 
 #include "common.h"
+#include "memory.h"
+#include "thread.h"
 #include "usb/scsi.h"
 #include "util.h"
 
 extern const int os_size;
 
+/*
+ * The file system blocks follow the boot block, the kernel and the
+ * process directory on the USB stick (see createimage.c), so block 0
+ * of the file system is sector os_size + 2. Each block is BLOCK_SECTORS
+ * sectors, so block b starts at BLOCK_SECTOR(b).
+ */
+#define FS_START_SECTOR (os_size + 2)
+#define BLOCK_SECTOR(b) (FS_START_SECTOR + (b) * BLOCK_SECTORS)
+
+/*
+ * The USB host controllers transfer data to the address they are
+ * given, so they only reach memory that is identity mapped, that is
+ * below MAX_PHYSICAL_MEMORY or in the buffer cache memory (see
+ * block.h). Reads into other memory, such as a
+ * process buffer handed to fs_read(), are bounced through this buffer.
+ * bounce_lock is held from the read into it until its data has been
+ * copied out. No other lock is taken while holding it.
+ */
+#define BOUNCE_BLOCKS (8 / BLOCK_SECTORS)
+static char bounce[BOUNCE_BLOCKS * BLOCK_SIZE];
+static lock_t bounce_lock;
+
+/*
+ * Requests through block_dev_read() (index SCSI_READ) and
+ * block_dev_write() (SCSI_WRITE), protected by iostat_lock. The SCSI
+ * layer keeps its own counters.
+ */
+static struct io_counts iostat[2];
+static int bounced;
+static int iostat_lock;
+
+static int dev_read(int block_num, int count, void *address);
+
 /*
  * block_init:
- * Initialize the block code. For USB access, no initialization is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Initialize the block code. For USB access, only the buffer cache
+ * needs to be set up. The function exists so that the interface is
+ * the same as for the block_sim code.
  *
  */
 void block_init(void) {
-	/* We assume that block_size == sector size */
-	ASSERT(BLOCK_SIZE == SECTOR_SIZE);
+	spinlock_init(&iostat_lock);
+	lock_init(&bounce_lock);
+	block_cache_init();
 }
 
 /*
  * block_destruct:
- * Cleanup for the block code. For USB access, no cleanup is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Cleanup for the block code. Writes back any dirty blocks held by
+ * the buffer cache.
  *
  */
 void block_destruct(void) {
-	/* Nothing to do */
+	block_cache_destruct();
 }
 
 /*
- * block_read:
- * Reads a disk block (512 bytes) from block_num
- * into the memory pointed to by address.
+ * block_dev_read:
+ * Reads count disk blocks starting at block_num into the memory
+ * pointed to by address, bypassing the buffer cache.
  */
-int block_read(int block_num, void *address)
+int block_dev_read(int block_num, int count, void *address)
 {
-	scsi_read(block_num, 1, address);
-	return 0;
+	uint64_t start = get_timer();
+	int rc = dev_read(block_num, count, address);
+
+	spinlock_acquire(&iostat_lock);
+	iostat_add(&iostat[SCSI_READ], count * BLOCK_SECTORS, count * BLOCK_SIZE, start, 0, rc == 0);
+	spinlock_release(&iostat_lock);
+	return rc;
+}
+
+/*
+ * block_dev_write:
+ * Writes count disk blocks starting at address to the disk blocks
+ * starting at block_num, bypassing the buffer cache.
+ */
+int block_dev_write(int block_num, int count, void *address)
+{
+	uint64_t start = get_timer();
+	int rc = scsi_write(BLOCK_SECTOR(block_num), count * BLOCK_SECTORS, address);
+
+	spinlock_acquire(&iostat_lock);
+	iostat_add(&iostat[SCSI_WRITE], count * BLOCK_SECTORS, count * BLOCK_SIZE, start, 0, rc == 0);
+	spinlock_release(&iostat_lock);
+	return rc;
 }
 
 /*
- * block_write:
- * Writes the 512 bytes starting at address to the disk block
- * block_num
+ * block_dev_sync:
+ * Nothing to do, since a USB write has reached the stick when
+ * block_dev_write() returns.
  */
-int block_write(int block_num, void *address)
+int block_dev_sync(void)
 {
-	scsi_write(block_num, 1, address);
 	return 0;
 }
 
 /*
- * block_modify:
- * Changes a part of a disk block. The block block_num is changed so
- * that the part of the block from offset until offset+data_size is
- * replaced with the first data_size bytes from data.
+ * block_dev_blocks:
+ * Returns the number of blocks reserved for the file system. It may
+ * use the rest of the USB stick, as found by scsi_read_capacity(),
+ * except for the process images that createimage placed after it
+ * (--fs=blocks decides how many blocks are left for it). The process
+ * directory, which follows the kernel, tells where those begin.
  */
-int block_modify(int block_num, int offset, void *data, int data_size) {
-	int rc;
-	char buf[BLOCK_SIZE];
+int block_dev_blocks(void)
+{
+	struct directory_t dir[SECTOR_SIZE / sizeof(struct directory_t)];
+	int sectors = scsi_get_capacity() - FS_START_SECTOR;
+	int i;
+
+	if (scsi_read(os_size + 1, 1, (char *)dir) == 0) {
+		for (i = 0; i < (int)(SECTOR_SIZE / sizeof(struct directory_t)) && dir[i].location != 0; i++) {
+			if (dir[i].location >= FS_START_SECTOR && dir[i].location - FS_START_SECTOR < sectors)
+				sectors = dir[i].location - FS_START_SECTOR;
+		}
+	}
+	return (sectors < 0) ? 0 : sectors / BLOCK_SECTORS;
+}
 
-	ASSERT((offset + data_size) <= BLOCK_SIZE);
+/*
+ * block_iostat:
+ * Copies the I/O statistics of the block layer and the SCSI layer
+ * into *st. This is the io_stat system call.
+ */
+int block_iostat(struct iostat *st)
+{
+	spinlock_acquire(&iostat_lock);
+	bcopy((char *)iostat, (char *)st->block, sizeof(iostat));
+	st->bounced = bounced;
+	spinlock_release(&iostat_lock);
 
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(data, &buf[offset], data_size);
-		rc = block_write(block_num, buf);
+	scsi_get_stat(st->scsi);
+	return 0;
+}
+
+/*
+ * iostat_add:
+ * Counts one request of sectors sectors (bytes bytes) in *c. The
+ * request started at time stamp start, and spent wait of its cycles
+ * waiting for the device. The caller protects *c.
+ */
+void iostat_add(struct io_counts *c, int sectors, int bytes, uint64_t start,
+                uint64_t wait, int ok)
+{
+	uint64_t cycles = get_timer() - start;
+	int b = 0;
+
+	c->ops++;
+	if (!ok)
+		c->errors++;
+	c->sectors += sectors;
+	c->bytes += bytes;
+	if (wait > 0) {
+		c->waits++;
+		c->wait_tsc += wait;
 	}
-	else
-		return -1;
+	c->tsc += cycles;
 
-	return rc;
+	while (b < IOSTAT_BUCKETS - 1 && (cycles >> (b + 1)) != 0)
+		b++;
+	c->hist[b]++;
 }
 
 /*
- * block_read_part:
- * Read a part of a disk block. The data from the disk block block_num
- * starting at offset until offset+bytes is read into the memory
- * starting at address.
+ * Does the work of block_dev_read(). Reads into memory the USB host
+ * controllers cannot reach are bounced.
  */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	int rc;
-	char buf[BLOCK_SIZE];
+static int dev_read(int block_num, int count, void *address)
+{
+	char *dst = address;
+	uint32_t start = (uint32_t)address, end = start + count * BLOCK_SIZE;
+	int n, rc = 0;
 
-	// ASSERT((offset + bytes) <= BLOCK_SIZE);
+	if (end <= MAX_PHYSICAL_MEMORY ||
+	    (start >= BCACHE_MEM_START && end <= BCACHE_MEM_START + BCACHE_MEM_SIZE))
+		return scsi_read(BLOCK_SECTOR(block_num), count * BLOCK_SECTORS, address);
 
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(&(buf[offset]), address, bytes);
-		return 0;
+	lock_acquire(&bounce_lock);
+	while (count > 0) {
+		n = (count < BOUNCE_BLOCKS) ? count : BOUNCE_BLOCKS;
+		if (scsi_read(BLOCK_SECTOR(block_num), n * BLOCK_SECTORS, bounce) < 0) {
+			rc = -1;
+			break;
+		}
+		bcopy(bounce, dst, n * BLOCK_SIZE);
+		spinlock_acquire(&iostat_lock);
+		bounced += n;
+		spinlock_release(&iostat_lock);
+		block_num += n;
+		dst += n * BLOCK_SIZE;
+		count -= n;
 	}
-
-	return -1;
+	lock_release(&bounce_lock);
+	return rc;
 }
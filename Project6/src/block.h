@@ -1,12 +1,76 @@
-/* Header file for block.c and blockFake.c */
+/* Header file for block.c, block_sim.c and block_cache.c */
 
 #ifndef BLOCK_H
 #define BLOCK_H
 
 #include "common.h"
 
-#define BLOCK_SIZE SECTOR_SIZE
-#define BLOCKS (SECTORS / (BLOCK_SIZE / SECTOR_SIZE))
+/*
+ * Sectors per file system block: 1, 2, 4 or 8, for blocks of 512 bytes
+ * to 4KB. Set when building (make BLOCK_SECTORS=8). A block is read or
+ * written with one SCSI command, so larger blocks mean fewer commands
+ * for the same data. The file system records the block size, and a
+ * kernel built with another one does not mount it (see fs_init()).
+ */
+#ifndef BLOCK_SECTORS
+#define BLOCK_SECTORS 1
+#endif
+#if BLOCK_SECTORS != 1 && BLOCK_SECTORS != 2 && BLOCK_SECTORS != 4 && BLOCK_SECTORS != 8
+#error BLOCK_SECTORS must be 1, 2, 4 or 8
+#endif
+
+#define BLOCK_SIZE (BLOCK_SECTORS * SECTOR_SIZE)
+#define BLOCKS (SECTORS / BLOCK_SECTORS)
+
+/*
+ * The blocks of the buffer cache and its staging areas (see
+ * block_cache.c) take at most BCACHE_MEM_SIZE bytes. In the kernel they
+ * are kept at BCACHE_MEM_START, above the pageable memory, rather than
+ * in the kernel image. init_memory() maps the region to itself, so the
+ * USB host controllers reach it too (see block.c).
+ */
+#define BCACHE_MEM_START 0x300000
+#define BCACHE_MEM_SIZE 0x80000
+#define BCACHE_SCALE(n) ((n) / BLOCK_SECTORS)
+
+/*
+ * Number of blocks kept in the buffer cache. Buffers in the running
+ * transaction, delayed buffers and those being prefetched cannot be
+ * thrown out, so there must be room for others besides them.
+ */
+#define BCACHE_BLOCKS ((BCACHE_SCALE(128) < 48) ? 48 : BCACHE_SCALE(128))
+/* Number of hash chains in the buffer cache (must be a power of two) */
+#define BCACHE_HASH 32
+/* Largest number of blocks read by one block_prefetch() */
+#define BCACHE_PREFETCH_MAX BCACHE_SCALE(16)
+/* Largest number of buffers holding data that has no block yet */
+#define BCACHE_DELAY_MAX BCACHE_SCALE(32)
+/* Largest number of blocks in one journal transaction */
+#define JOURNAL_TX_MAX 32
+/*
+ * Blocks reserved in the running transaction by each operation (see
+ * block_journal_begin()). One file system call changes at most this
+ * many metadata blocks in one operation.
+ */
+#define JOURNAL_OP_MAX 16
+/* Largest journal region, in blocks */
+#define JOURNAL_MAX_BLOCKS 64
+
+/* Buffer cache statistics, see block_cache_stat() */
+struct bcache_stat {
+	int hits;       /* block requests served from the cache */
+	int misses;     /* block requests that had to go to the device */
+	int dev_reads;  /* blocks read from the device */
+	int dev_writes; /* blocks written to the device */
+	int write_ops;  /* requests writing dirty blocks home, each of adjacent blocks */
+	int evictions;  /* blocks thrown out to make room for others */
+	int dirty;      /* blocks currently waiting to be written back */
+	int commits;    /* journal transactions committed */
+	int jblocks;    /* blocks written to the journal, descriptors included */
+	int checkpoints; /* times the journal was emptied */
+	int direct;     /* blocks read straight into the caller's memory */
+	int delayed;    /* buffers holding data that has no block yet */
+};
 
 void block_init(void);
 void block_destruct(void);
@@ -14,5 +78,72 @@ int block_read(int block_num, void *address);
 int block_write(int block_num, void *address);
 int block_modify(int block_num, int offset, void *data, int data_size);
 int block_read_part(int block_num, int offset, int bytes, void *address);
+int block_read_direct(int block_num, int count, void *address);
+int block_flush(void);
+int block_prefetch(int block_num, int count);
+void block_cache_stat(struct bcache_stat *stat);
+
+/*
+ * Metadata journal (block_cache.c). The file system changes metadata
+ * blocks with block_journal_modify(); the change is then written to
+ * the journal region by the next commit before it may reach its home
+ * block. The changes of one file system call are made between
+ * block_journal_begin() and block_journal_end() (an operation), and a
+ * transaction is only committed when no operation is in progress, so
+ * it never holds half a call. block_journal_commit() and block_flush()
+ * wait for the operations in progress to end, and must not be called
+ * in one. block_journal_lock() waits until no operation is in
+ * progress and keeps others from starting until block_journal_unlock();
+ * the caller may then commit between its own operations at any time.
+ */
+void block_journal_format(int start, int nblocks);
+int block_journal_replay(int start, int nblocks);
+int block_journal_begin(void);
+void block_journal_end(void);
+void block_journal_lock(void);
+void block_journal_unlock(void);
+int block_journal_modify(int block_num, int offset, void *data, int data_size);
+int block_journal_commit(void);
+
+/*
+ * Delayed allocation (block_cache.c). File data written where a file
+ * has no block yet is kept in a cache buffer named by a key (chosen by
+ * the file system) instead of a block number, until the file system
+ * picks its block with block_delay_assign(). Such buffers are never
+ * written to the device or thrown out of the cache.
+ */
+int block_delay_modify(int key, int offset, void *data, int data_size);
+int block_delay_read(int key, int offset, int bytes, void *address);
+int block_delay_assign(int key, int block_num);
+void block_delay_drop(int key);
+
+/*
+ * Buffer cache setup (block_cache.c). Called by block_init() and
+ * block_destruct() in block.c and block_sim.c.
+ */
+void block_cache_init(void);
+void block_cache_destruct(void);
+
+/*
+ * Block device statistics (block.c). block_iostat() is the io_stat
+ * system call. iostat_add() records one request, started at time
+ * stamp start, of which wait cycles were spent waiting for the device.
+ */
+int block_iostat(struct iostat *st);
+void iostat_add(struct io_counts *c, int sectors, int bytes, uint64_t start,
+                uint64_t wait, int ok);
+
+/*
+ * Uncached access to count consecutive blocks on the device. Only
+ * used by the buffer cache; the rest of the system goes through
+ * block_read() and friends. block_dev_sync() returns once the blocks
+ * written so far are stored on the device. block_dev_blocks() returns
+ * how many blocks the file system may use, and is called when it is
+ * made or mounted.
+ */
+int block_dev_read(int block_num, int count, void *address);
+int block_dev_write(int block_num, int count, void *address);
+int block_dev_sync(void);
+int block_dev_blocks(void);
 
 #endif /* !BLOCK_H */
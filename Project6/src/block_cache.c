@@ -0,0 +1,1188 @@
+/*
+ * Write-back buffer cache for file system blocks.
+ *
+ * Implements the block_read/block_write/block_modify/block_read_part
+ * interface from block.h on top of the uncached block_dev_read() and
+ * block_dev_write(), which are provided by block.c (USB stick) and
+ * block_sim.c (Linux file). The same code is therefore used both in
+ * the kernel and in the Linux simulator.
+ *
+ * Implementation notes:
+ *
+ * The cache is a fixed pool of BCACHE_BLOCKS buffers. A buffer is
+ * found through a hash table on the block number, and all buffers
+ * are kept on a doubly linked LRU list with the most recently used
+ * buffer first. When a block that is not cached is requested, the
+ * least recently used buffer is reused, and written back first if it
+ * is dirty.
+ *
+ * Writes only change the cached copy and mark it dirty. Dirty blocks
+ * reach the device when they are evicted or when block_flush() is
+ * called. Apart from evictions, dirty blocks are written in block
+ * number order, and each run of adjacent blocks goes to the device
+ * in one multi-block write (see cache_write_dirty()), since a USB
+ * request costs about the same for one block as for several.
+ *
+ * Metadata journal:
+ *
+ * Metadata blocks changed by the file system (block_journal_modify())
+ * belong to the running transaction and may not be written to their
+ * home location yet. block_journal_commit() writes all of them, with
+ * a descriptor block listing their home block numbers, to the journal
+ * region in one sequential multi-block write. Many file system calls
+ * share one commit (group commit). Before that, dirty file data is
+ * written back, so committed metadata never points to stale data.
+ *
+ * A file system call makes its changes in an operation, between
+ * block_journal_begin() and block_journal_end(), and jops counts the
+ * operations in progress. A transaction is only committed when jops is
+ * 0, so it holds whole calls: by the operation that cannot start for
+ * lack of room, by block_journal_commit() and block_flush(), which wait
+ * for the others to end and keep new ones from starting meanwhile
+ * (jwaiting), or by the holder of block_journal_lock(). Each operation
+ * reserves JOURNAL_OP_MAX blocks when it starts, so the transaction
+ * does not fill up under it. Buffers in the running transaction are
+ * never thrown out of the cache.
+ *
+ * Delayed allocation:
+ *
+ * A buffer holding file data that has no block yet (see block.h) is
+ * hashed under DELAY_BLOCK(key), which is never a block number, and
+ * marked delayed. It is not dirty, so nothing writes it to the
+ * device, and it is never reused for another block. Its contents are
+ * moved to a real block by block_delay_assign(). At most
+ * BCACHE_DELAY_MAX buffers are delayed at a time.
+ *
+ * Committed blocks stay dirty in the cache and are written home
+ * lazily, when evicted or when the journal is full (checkpoint). A
+ * block that has changed again in the running transaction is copied
+ * home from the log by a checkpoint instead.
+ * Since the log is replayed in order, a block that is in the log is
+ * logged again whenever it changes. A block in the log that is reused
+ * for file data is not, since file data does not count against what
+ * an operation reserves; the log is emptied first instead.
+ *
+ * On disk the region is a journal superblock followed by the log.
+ * The journal superblock gives the sequence number of the first
+ * transaction in the log. A transaction is valid if its descriptor
+ * has the expected sequence number and the checksum of its blocks
+ * matches. block_journal_replay() copies the valid transactions to
+ * their home blocks.
+ *
+ * Locking:
+ *
+ * All cache state is protected by bcache_lock, which callers never
+ * hold. It is not held while a block is read from the device: the
+ * buffer being filled is marked busy and stays in the hash table, so
+ * a process asking for the same block waits on bcache_io until the
+ * read completes, while requests for other blocks go ahead. Busy
+ * buffers are never reused. Writes to the device (write-back, journal
+ * commits and checkpoints) are done with the lock held, since they
+ * must not be interleaved with changes to the blocks being written.
+ * block_prefetch() reads into its own staging area, pfbuf, which
+ * prefetch_lock gives to one prefetch at a time.
+ */
+
+#ifdef LINUX_SIM
+#include <assert.h>
+#endif /* LINUX_SIM */
+
+#include "block.h"
+#include "common.h"
+#include "thread.h"
+#include "util.h"
+
+#define HASH(block_num) ((block_num) & (BCACHE_HASH - 1))
+/* Largest number of blocks in one write of adjacent dirty blocks */
+#define WRITE_RUN_MAX (JOURNAL_TX_MAX + 1)
+/* Name of the buffer holding delayed data with the given key */
+#define DELAY_BLOCK(key) (-2 - (key))
+
+#define JOURNAL_MAGIC 0x4a524e4c /* "JRNL" */
+#define JDESC_MAGIC 0x4a444553   /* "JDES" */
+
+/* Journal state of a buffer */
+enum {
+	J_NONE,      /* not in the running transaction */
+	J_RUNNING,   /* in the running transaction, must not be written home */
+	J_COMMITTED, /* in the journal, written home lazily */
+};
+
+/* First block of the journal region */
+struct journal_super {
+	int magic;
+	int seq;   /* sequence number of the first transaction in the log */
+};
+
+/* Written in front of the blocks of each transaction in the log */
+struct journal_desc {
+	int magic;
+	int seq;
+	int count;                   /* number of blocks that follow */
+	uint32_t checksum;           /* of the blocks that follow */
+	int blocks[JOURNAL_TX_MAX];  /* home block number of each */
+};
+
+typedef struct bcache_buf bcache_buf_t;
+struct bcache_buf {
+	int block_num;             /* block held by this buffer, -1 if unused */
+	char dirty;                /* TRUE if data differs from the device */
+	char jstate;               /* J_NONE, J_RUNNING or J_COMMITTED */
+	char busy;                 /* TRUE while being read from the device */
+	char delayed;              /* TRUE if holding data that has no block yet */
+	bcache_buf_t *hash_next;   /* next buffer in the same hash chain */
+	bcache_buf_t *lru_prev;    /* more recently used buffer */
+	bcache_buf_t *lru_next;    /* less recently used buffer */
+	char *data;                /* BLOCK_SIZE bytes in bcache_mem */
+};
+
+/*
+ * Memory for the data of the buffers, followed by iobuf and pfbuf. In
+ * the kernel it is the region at BCACHE_MEM_START (see block.h).
+ */
+#ifdef LINUX_SIM
+static char bcache_mem[BCACHE_MEM_SIZE];
+#else
+static char *const bcache_mem = (char *)BCACHE_MEM_START;
+#endif /* LINUX_SIM */
+
+static bcache_buf_t bufs[BCACHE_BLOCKS];
+static bcache_buf_t *hash_table[BCACHE_HASH];
+/*
+ * Head of the LRU list. lru.lru_next is the most recently used buffer
+ * and lru.lru_prev the least recently used one.
+ */
+static bcache_buf_t lru;
+static struct bcache_stat stat;
+
+static int jstart = -1;  /* first block of the journal region, -1 if none */
+static int jblocks;      /* blocks in the journal region */
+static int jhead;        /* next free log block, counted from jstart + 1 */
+static int jseq;         /* sequence number of the next transaction */
+static int jrunning;     /* buffers in the running transaction */
+static int jops;         /* operations in progress */
+static int jwaiting;     /* callers waiting to commit once jops is 0 */
+static int jlocked;      /* TRUE while block_journal_lock() is held */
+static pcb_t *jowner;    /* the process holding it */
+/* Home blocks logged since the last checkpoint */
+static int jlogged[JOURNAL_MAX_BLOCKS];
+/* Log block holding the latest copy of each, counted from jstart + 1 */
+static int jlogpos[JOURNAL_MAX_BLOCKS];
+static int jnlogged;
+/*
+ * Staging area for multi-block device transfers, JOURNAL_TX_MAX + 1
+ * blocks: one journal transaction as it is written to the log, or a
+ * run of adjacent dirty blocks being written home
+ */
+static char *iobuf;
+/*
+ * Staging area for block_prefetch(), BCACHE_PREFETCH_MAX blocks,
+ * filled without bcache_lock held
+ */
+static char *pfbuf;
+
+static lock_t bcache_lock;     /* protects everything above except pfbuf */
+static condition_t bcache_io;  /* signalled when busy buffers are filled */
+static condition_t journal_ops; /* signalled when operations end or commit */
+static lock_t prefetch_lock;   /* protects pfbuf, taken before bcache_lock */
+
+static bcache_buf_t *cache_lookup(int block_num);
+static bcache_buf_t *cache_get(int block_num, int read);
+static bcache_buf_t *cache_victim(void);
+static int cache_take(bcache_buf_t *b, int block_num);
+static void cache_unbusy(bcache_buf_t *b, int ok);
+static int cache_dirty(bcache_buf_t *b);
+static void cache_drop(bcache_buf_t *b);
+static void cache_forget(bcache_buf_t *b);
+static int cache_writeback(bcache_buf_t *b);
+static int cache_write_dirty(int committed);
+static int cache_write_run(bcache_buf_t **run, int count);
+static void hash_insert(bcache_buf_t *b);
+static void hash_remove(bcache_buf_t *b);
+static void lru_remove(bcache_buf_t *b);
+static void lru_push_front(bcache_buf_t *b);
+static int journal_add(bcache_buf_t *b);
+static int journal_room(void);
+static void journal_idle(void);
+static int journal_logged(int block_num);
+static int journal_commit(void);
+static int journal_checkpoint(void);
+static int journal_write_super(void);
+static uint32_t journal_checksum(char *data, int nblocks);
+
+/* Set up an empty cache. Called from block_init(). */
+void block_cache_init(void) {
+	int i;
+
+	ASSERT((BCACHE_BLOCKS + JOURNAL_TX_MAX + 1 + BCACHE_PREFETCH_MAX) * BLOCK_SIZE <= BCACHE_MEM_SIZE);
+	ASSERT(JOURNAL_TX_MAX + BCACHE_DELAY_MAX + BCACHE_PREFETCH_MAX < BCACHE_BLOCKS);
+	iobuf = &bcache_mem[BCACHE_BLOCKS * BLOCK_SIZE];
+	pfbuf = &iobuf[(JOURNAL_TX_MAX + 1) * BLOCK_SIZE];
+
+	lru.lru_next = &lru;
+	lru.lru_prev = &lru;
+
+	for (i = 0; i < BCACHE_HASH; i++)
+		hash_table[i] = NULL;
+
+	for (i = 0; i < BCACHE_BLOCKS; i++) {
+		bufs[i].block_num = -1;
+		bufs[i].data = &bcache_mem[i * BLOCK_SIZE];
+		bufs[i].dirty = FALSE;
+		bufs[i].jstate = J_NONE;
+		bufs[i].busy = FALSE;
+		bufs[i].delayed = FALSE;
+		bufs[i].hash_next = NULL;
+		lru_push_front(&bufs[i]);
+	}
+
+	bzero((char *)&stat, sizeof(stat));
+	jstart = -1;
+	jops = 0;
+	jwaiting = 0;
+	jlocked = FALSE;
+
+	lock_init(&bcache_lock);
+	condition_init(&bcache_io);
+	condition_init(&journal_ops);
+	lock_init(&prefetch_lock);
+}
+
+/* Write back everything. Called from block_destruct(). */
+void block_cache_destruct(void) {
+	block_flush();
+}
+
+/*
+ * block_read:
+ * Reads a disk block (BLOCK_SIZE bytes) from block_num into the
+ * memory pointed to by address.
+ */
+int block_read(int block_num, void *address) {
+	bcache_buf_t *b;
+
+	lock_acquire(&bcache_lock);
+	b = cache_get(block_num, TRUE);
+	if (b != NULL)
+		bcopy(b->data, address, BLOCK_SIZE);
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_write:
+ * Writes the BLOCK_SIZE bytes starting at address to the disk block
+ * block_num. The block is only written to the device when it is
+ * evicted or flushed.
+ */
+int block_write(int block_num, void *address) {
+	bcache_buf_t *b;
+
+	lock_acquire(&bcache_lock);
+	b = cache_get(block_num, FALSE);
+	if (b == NULL) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+
+	if (cache_dirty(b) < 0) {
+		/* A buffer that was not read holds nothing of the block */
+		if (!b->dirty)
+			cache_drop(b);
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	bcopy(address, b->data, BLOCK_SIZE);
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_modify:
+ * Changes a part of a disk block. The block block_num is changed so
+ * that the part of the block from offset until offset+data_size is
+ * replaced with the first data_size bytes from data.
+ */
+int block_modify(int block_num, int offset, void *data, int data_size) {
+	bcache_buf_t *b;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = cache_get(block_num, TRUE);
+	if (b == NULL) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+
+	if (cache_dirty(b) < 0) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	bcopy(data, &b->data[offset], data_size);
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_read_part:
+ * Read a part of a disk block. The data from the disk block block_num
+ * starting at offset until offset+bytes is read into the memory
+ * starting at address.
+ */
+int block_read_part(int block_num, int offset, int bytes, void *address) {
+	bcache_buf_t *b;
+
+	ASSERT((offset + bytes) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = cache_get(block_num, TRUE);
+	if (b != NULL)
+		bcopy(&b->data[offset], address, bytes);
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_read_direct:
+ * Read the count whole blocks starting at block_num into the memory
+ * starting at address, without going through cache buffers. Blocks
+ * that are cached are copied from the cache, since they may be newer
+ * than the disk. Each run of uncached blocks is read from the device
+ * with one request, straight into place. The blocks read from the
+ * device are not added to the cache, so a large read does not push
+ * out the metadata. Blocks that are busy being read into the cache
+ * are read from the device too. Returns 0 on success and -1 on error.
+ */
+int block_read_direct(int block_num, int count, void *address) {
+	char *dst = address;
+	bcache_buf_t *b;
+	int i = 0, run;
+
+	lock_acquire(&bcache_lock);
+	while (i < count) {
+		b = cache_lookup(block_num + i);
+		if (b != NULL && !b->busy) {
+			stat.hits++;
+			bcopy(b->data, &dst[i * BLOCK_SIZE], BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		for (run = 1; i + run < count; run++) {
+			b = cache_lookup(block_num + i + run);
+			if (b != NULL && !b->busy)
+				break;
+		}
+
+		/* The blocks go straight to the caller, nothing in the cache
+		 * changes while we wait for them */
+		lock_release(&bcache_lock);
+		if (block_dev_read(block_num + i, run, &dst[i * BLOCK_SIZE]) < 0)
+			return -1;
+		lock_acquire(&bcache_lock);
+
+		stat.misses += run;
+		stat.dev_reads += run;
+		stat.direct += run;
+		i += run;
+	}
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_delay_modify:
+ * Like block_modify(), but for the delayed data named by key. A new
+ * buffer starts out as zeros. Returns 1 if a new buffer was taken, 0 if
+ * there was one already, and -1 if BCACHE_DELAY_MAX buffers are in use.
+ */
+int block_delay_modify(int key, int offset, void *data, int data_size) {
+	bcache_buf_t *b;
+	int created = 0;
+
+	ASSERT(key >= 0 && (offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = cache_lookup(DELAY_BLOCK(key));
+	if (b == NULL) {
+		if (stat.delayed == BCACHE_DELAY_MAX ||
+		    (b = cache_get(DELAY_BLOCK(key), FALSE)) == NULL) {
+			lock_release(&bcache_lock);
+			return -1;
+		}
+		bzero(b->data, BLOCK_SIZE);
+		b->delayed = TRUE;
+		stat.delayed++;
+		created = 1;
+	}
+
+	bcopy(data, &b->data[offset], data_size);
+	lock_release(&bcache_lock);
+	return created;
+}
+
+/*
+ * block_delay_read:
+ * Like block_read_part(), but for the delayed data named by key.
+ * Returns -1 if there is no such data.
+ */
+int block_delay_read(int key, int offset, int bytes, void *address) {
+	bcache_buf_t *b;
+
+	ASSERT(key >= 0 && (offset + bytes) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = cache_lookup(DELAY_BLOCK(key));
+	if (b != NULL)
+		bcopy(&b->data[offset], address, bytes);
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_delay_assign:
+ * Makes the delayed data named by key the contents of block block_num,
+ * as if written there with block_write(). Returns -1 if there is no
+ * such data, or the block is in the log and it could not be emptied.
+ */
+int block_delay_assign(int key, int block_num) {
+	bcache_buf_t *d, *b;
+
+	lock_acquire(&bcache_lock);
+	d = cache_lookup(DELAY_BLOCK(key));
+	if (d == NULL || (b = cache_get(block_num, FALSE)) == NULL) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+
+	if (cache_dirty(b) < 0) {
+		if (!b->dirty)
+			cache_drop(b);
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	bcopy(d->data, b->data, BLOCK_SIZE);
+	cache_forget(d);
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_delay_drop:
+ * Throws away the delayed data named by key, if there is any.
+ */
+void block_delay_drop(int key) {
+	bcache_buf_t *b;
+
+	lock_acquire(&bcache_lock);
+	b = cache_lookup(DELAY_BLOCK(key));
+	if (b != NULL)
+		cache_forget(b);
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_flush:
+ * Write all dirty blocks back to the device. The running transaction
+ * is committed first, once the operations in progress have ended, and
+ * the journal is emptied afterwards. Then the device is asked to store
+ * what it was given. Returns 0 on success and -1 if any of the writes
+ * failed (the failed blocks stay dirty).
+ */
+int block_flush(void) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	journal_idle();
+	rc = journal_commit();
+	if (rc == 0)
+		rc = journal_checkpoint();
+	if (rc == 0)
+		rc = block_dev_sync();
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * block_prefetch:
+ * Brings the count blocks starting at block_num into the cache with a
+ * single device read. Blocks that are cached already are left alone.
+ * Returns 0 on success and -1 on error.
+ */
+int block_prefetch(int block_num, int count) {
+	bcache_buf_t *fill[BCACHE_PREFETCH_MAX];
+	int i, missing = 0, rc = 0;
+
+	ASSERT(count <= BCACHE_PREFETCH_MAX);
+
+	lock_acquire(&prefetch_lock);
+	lock_acquire(&bcache_lock);
+
+	/* Take busy buffers for the missing blocks, so nobody uses them
+	 * before they are filled. A block is looked up again after
+	 * waiting for a buffer, since someone may have brought it in */
+	for (i = 0; i < count; i++) {
+		fill[i] = NULL;
+		while (cache_lookup(block_num + i) == NULL &&
+		       (fill[i] = cache_victim()) == NULL)
+			;
+		if (fill[i] == NULL)
+			continue;
+		if (cache_take(fill[i], block_num + i) < 0) {
+			fill[i] = NULL;
+			rc = -1;
+			break;
+		}
+		fill[i]->busy = TRUE;
+		missing++;
+	}
+	count = i;
+
+	if (rc == 0 && missing > 0) {
+		lock_release(&bcache_lock);
+		rc = block_dev_read(block_num, count, pfbuf);
+		lock_acquire(&bcache_lock);
+		if (rc == 0)
+			stat.dev_reads += count;
+	}
+
+	/* On failure, do not leave buffers with garbage in the cache */
+	for (i = 0; i < count; i++) {
+		if (fill[i] == NULL)
+			continue;
+		if (rc == 0)
+			bcopy(&pfbuf[i * BLOCK_SIZE], fill[i]->data, BLOCK_SIZE);
+		cache_unbusy(fill[i], rc == 0);
+	}
+
+	lock_release(&bcache_lock);
+	lock_release(&prefetch_lock);
+	return rc;
+}
+
+/* Copy the cache statistics into *s */
+void block_cache_stat(struct bcache_stat *s) {
+	lock_acquire(&bcache_lock);
+	bcopy((char *)&stat, (char *)s, sizeof(stat));
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_journal_format:
+ * Sets up an empty journal in the nblocks blocks starting at start.
+ */
+void block_journal_format(int start, int nblocks) {
+	ASSERT(nblocks > JOURNAL_TX_MAX + 1 && nblocks <= JOURNAL_MAX_BLOCKS);
+
+	lock_acquire(&bcache_lock);
+	jstart = start;
+	jblocks = nblocks;
+	jhead = 0;
+	jseq = 1;
+	jrunning = 0;
+	jnlogged = 0;
+	journal_write_super();
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_journal_replay:
+ * Copies the committed transactions in the journal at start to their
+ * home blocks and empties the journal, which is then used for new
+ * transactions. Cached copies of the replayed blocks are updated, but
+ * they must not have been changed. Returns the number of transactions
+ * replayed, or -1 if there is no journal.
+ */
+int block_journal_replay(int start, int nblocks) {
+	struct journal_super *jsb = (struct journal_super *)iobuf;
+	struct journal_desc *desc = (struct journal_desc *)iobuf;
+	int pos = 0, n = 0, seq, i;
+
+	lock_acquire(&bcache_lock);
+	if (nblocks > JOURNAL_MAX_BLOCKS || block_dev_read(start, 1, iobuf) < 0 ||
+	    jsb->magic != JOURNAL_MAGIC) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	seq = jsb->seq;
+
+	while (pos + 1 < nblocks - 1) {
+		if (block_dev_read(start + 1 + pos, 1, iobuf) < 0)
+			break;
+		if (desc->magic != JDESC_MAGIC || desc->seq != seq ||
+		    desc->count <= 0 || desc->count > JOURNAL_TX_MAX ||
+		    pos + 1 + desc->count > nblocks - 1)
+			break;
+		if (block_dev_read(start + 2 + pos, desc->count, &iobuf[BLOCK_SIZE]) < 0)
+			break;
+		if (journal_checksum(&iobuf[BLOCK_SIZE], desc->count) != desc->checksum)
+			break; /* torn write, the transaction never committed */
+
+		for (i = 0; i < desc->count; i++) {
+			bcache_buf_t *b = cache_lookup(desc->blocks[i]);
+
+			block_dev_write(desc->blocks[i], 1, &iobuf[(i + 1) * BLOCK_SIZE]);
+			/* Keep a cached copy up to date */
+			if (b != NULL)
+				bcopy(&iobuf[(i + 1) * BLOCK_SIZE], b->data, BLOCK_SIZE);
+		}
+
+		pos += 1 + desc->count;
+		seq++;
+		n++;
+	}
+
+	jstart = start;
+	jblocks = nblocks;
+	jhead = 0;
+	jseq = seq;
+	jrunning = 0;
+	jnlogged = 0;
+	journal_write_super();
+	lock_release(&bcache_lock);
+	return n;
+}
+
+/*
+ * block_journal_begin:
+ * Starts an operation. Waits until the running transaction has room
+ * for the JOURNAL_OP_MAX blocks of this operation on top of those
+ * reserved by the operations in progress, committing it if there are
+ * none. Returns -1 if that commit failed.
+ */
+int block_journal_begin(void) {
+	lock_acquire(&bcache_lock);
+	for (;;) {
+		if (jlocked && jowner != current_running) {
+			condition_wait(&bcache_lock, &journal_ops);
+		} else if (!journal_room()) {
+			if (jops > 0) {
+				condition_wait(&bcache_lock, &journal_ops);
+			} else if (journal_commit() < 0) {
+				lock_release(&bcache_lock);
+				return -1;
+			}
+		} else if (jwaiting > 0 && !jlocked) {
+			/* Let a waiting commit go first */
+			condition_wait(&bcache_lock, &journal_ops);
+		} else {
+			break;
+		}
+	}
+	jops++;
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_journal_end:
+ * Ends an operation started by block_journal_begin(). Whoever waits for
+ * the operations to end is woken up when the last one does.
+ */
+void block_journal_end(void) {
+	lock_acquire(&bcache_lock);
+	ASSERT(jops > 0);
+	jops--;
+	if (jops == 0)
+		condition_broadcast(&journal_ops);
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_journal_lock:
+ * Waits until no operation is in progress, and keeps other processes
+ * from starting one until block_journal_unlock(). Used for changes
+ * that are too large for one operation, such as those of fs_fsck().
+ */
+void block_journal_lock(void) {
+	lock_acquire(&bcache_lock);
+	while (jops > 0 || jlocked)
+		condition_wait(&bcache_lock, &journal_ops);
+	jlocked = TRUE;
+	jowner = current_running;
+	lock_release(&bcache_lock);
+}
+
+/* block_journal_unlock: Lets other processes start operations again */
+void block_journal_unlock(void) {
+	lock_acquire(&bcache_lock);
+	jlocked = FALSE;
+	condition_broadcast(&journal_ops);
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_journal_modify:
+ * Like block_modify(), but the changed block is also added to the
+ * running transaction. Both are done while bcache_lock is held, so
+ * the block cannot be written home between the change and the
+ * journal. A change of the whole block does not read it first.
+ * Returns -1, leaving the block as it was, if the running transaction
+ * is full.
+ */
+int block_journal_modify(int block_num, int offset, void *data, int data_size) {
+	bcache_buf_t *b;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = cache_get(block_num, offset != 0 || data_size != BLOCK_SIZE);
+	if (b == NULL) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+
+	if ((b->jstate != J_RUNNING && journal_add(b) < 0) || cache_dirty(b) < 0) {
+		if (!b->dirty && offset == 0 && data_size == BLOCK_SIZE)
+			cache_drop(b);
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	bcopy(data, &b->data[offset], data_size);
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_journal_commit:
+ * Writes the running transaction to the journal, once the operations
+ * in progress have ended. File data that is dirty is written back
+ * first. Returns 0 on success and -1 on error.
+ */
+int block_journal_commit(void) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	journal_idle();
+	rc = journal_commit();
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * Helper functions
+ */
+
+/*
+ * block_journal_commit() with bcache_lock held, when no operation is in
+ * progress. The committed buffers may be thrown out of the cache again,
+ * and those waiting for a buffer or for room are woken up.
+ */
+static int journal_commit(void) {
+	struct journal_desc *desc = (struct journal_desc *)iobuf;
+	int i, j, n = 0;
+
+	if (jstart < 0 || jrunning == 0)
+		return 0;
+
+	/* Data first, so the new metadata never points to old data */
+	if (cache_write_dirty(FALSE) < 0)
+		return -1;
+
+	/* Make room in the log by writing the committed blocks home */
+	if (jhead + 1 + jrunning > jblocks - 1 ||
+	    jnlogged + jrunning > JOURNAL_MAX_BLOCKS) {
+		if (journal_checkpoint() < 0)
+			return -1;
+	}
+
+	bzero(iobuf, BLOCK_SIZE);
+	desc->magic = JDESC_MAGIC;
+	desc->seq = jseq;
+	for (i = 0; i < BCACHE_BLOCKS; i++) {
+		if (bufs[i].jstate != J_RUNNING)
+			continue;
+		desc->blocks[n] = bufs[i].block_num;
+		bcopy(bufs[i].data, &iobuf[(n + 1) * BLOCK_SIZE], BLOCK_SIZE);
+		n++;
+	}
+	desc->count = n;
+	desc->checksum = journal_checksum(&iobuf[BLOCK_SIZE], n);
+
+	if (block_dev_write(jstart + 1 + jhead, n + 1, iobuf) < 0)
+		return -1;
+
+	for (i = 0, n = 0; i < BCACHE_BLOCKS; i++) {
+		if (bufs[i].jstate != J_RUNNING)
+			continue;
+		bufs[i].jstate = J_COMMITTED;
+		if ((j = journal_logged(bufs[i].block_num)) < 0) {
+			j = jnlogged++;
+			jlogged[j] = bufs[i].block_num;
+		}
+		jlogpos[j] = jhead + 1 + n++;
+	}
+
+	jhead += n + 1;
+	jseq++;
+	jrunning = 0;
+	stat.commits++;
+	stat.jblocks += n + 1;
+	condition_broadcast(&bcache_io);
+	condition_broadcast(&journal_ops);
+	return 0;
+}
+
+/*
+ * Add a buffer to the running transaction. It is never committed here,
+ * since that is only done between operations. Returns -1, without
+ * adding it, if the transaction is full; the operations in progress
+ * changed more blocks than they reserved.
+ */
+static int journal_add(bcache_buf_t *b) {
+	if (jstart < 0)
+		return 0;
+	if (jrunning >= JOURNAL_TX_MAX)
+		return -1;
+
+	b->jstate = J_RUNNING;
+	jrunning++;
+	return 0;
+}
+
+/*
+ * Returns TRUE if the running transaction has room for one more
+ * operation. The holder of block_journal_lock() is alone, and only
+ * needs room for itself.
+ */
+static int journal_room(void) {
+	return jstart < 0 ||
+	       jrunning + (jops + 1) * JOURNAL_OP_MAX <= JOURNAL_TX_MAX;
+}
+
+/*
+ * Waits until no operation is in progress, other than between those of
+ * the holder of block_journal_lock(). New operations wait meanwhile.
+ * Called with bcache_lock held.
+ */
+static void journal_idle(void) {
+	jwaiting++;
+	while (jops > 0 || (jlocked && jowner != current_running))
+		condition_wait(&bcache_lock, &journal_ops);
+	jwaiting--;
+}
+
+/* Returns the index of block_num in jlogged, or -1 if it is not in the log */
+static int journal_logged(int block_num) {
+	int i;
+
+	for (i = 0; i < jnlogged; i++) {
+		if (jlogged[i] == block_num)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Write every dirty block that is not in the running transaction
+ * home, then empty the log. A block in the running transaction cannot
+ * be written home, so its last committed copy is copied home from the
+ * log instead (through iobuf, which is not in use here).
+ */
+static int journal_checkpoint(void) {
+	bcache_buf_t *b;
+	int i, rc;
+
+	rc = cache_write_dirty(TRUE);
+	if (rc < 0 || jstart < 0)
+		return rc;
+
+	for (i = 0; i < jnlogged; i++) {
+		b = cache_lookup(jlogged[i]);
+		if (b == NULL || b->jstate != J_RUNNING)
+			continue;
+		if (block_dev_read(jstart + 1 + jlogpos[i], 1, iobuf) < 0 ||
+		    block_dev_write(jlogged[i], 1, iobuf) < 0)
+			return -1;
+		stat.dev_reads++;
+		stat.dev_writes++;
+	}
+
+	jhead = 0;
+	jnlogged = 0;
+	stat.checkpoints++;
+	return journal_write_super();
+}
+
+/*
+ * Write the journal superblock; the log starts over at jseq. It is
+ * staged in iobuf, which is never in use when this is called.
+ */
+static int journal_write_super(void) {
+	struct journal_super *jsb = (struct journal_super *)iobuf;
+
+	bzero(iobuf, BLOCK_SIZE);
+	jsb->magic = JOURNAL_MAGIC;
+	jsb->seq = jseq;
+	return block_dev_write(jstart, 1, iobuf);
+}
+
+static uint32_t journal_checksum(char *data, int nblocks) {
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < nblocks * BLOCK_SIZE; i++)
+		sum = ((sum << 5) | (sum >> 27)) + (unsigned char)data[i];
+	return sum;
+}
+
+/* Returns the buffer holding block_num, or NULL if it is not cached */
+static bcache_buf_t *cache_lookup(int block_num) {
+	bcache_buf_t *b;
+
+	for (b = hash_table[HASH(block_num)]; b != NULL; b = b->hash_next) {
+		if (b->block_num == block_num)
+			return b;
+	}
+	return NULL;
+}
+
+/*
+ * Returns a buffer for block_num and marks it most recently used. If
+ * the block is not cached, the least recently used buffer is taken
+ * over, and the block is read from the device if read is TRUE (a
+ * caller that overwrites the whole block passes FALSE). Returns NULL
+ * on device errors. Called with bcache_lock held, which is let go
+ * while waiting for the device to read the block, or for a buffer.
+ */
+static bcache_buf_t *cache_get(int block_num, int read) {
+	bcache_buf_t *b;
+	int rc;
+
+	for (;;) {
+		/* Wait for a read of this block by someone else to complete */
+		while ((b = cache_lookup(block_num)) != NULL && b->busy)
+			condition_wait(&bcache_lock, &bcache_io);
+
+		if (b != NULL) {
+			stat.hits++;
+			lru_remove(b);
+			lru_push_front(b);
+			return b;
+		}
+
+		/* Someone may bring the block in while we wait for a
+		 * buffer, so it is looked up again after a wait */
+		if ((b = cache_victim()) != NULL)
+			break;
+	}
+
+	if (cache_take(b, block_num) < 0)
+		return NULL;
+
+	if (read) {
+		b->busy = TRUE;
+		lock_release(&bcache_lock);
+		rc = block_dev_read(block_num, 1, b->data);
+		lock_acquire(&bcache_lock);
+		cache_unbusy(b, rc == 0);
+		if (rc < 0)
+			return NULL;
+		stat.dev_reads++;
+	}
+	return b;
+}
+
+/*
+ * Returns the least recently used buffer that is neither busy, delayed
+ * nor in the running transaction. If there is none, waits until a busy
+ * buffer is filled or the transaction is committed and returns NULL,
+ * since the cache may have changed while bcache_lock was let go.
+ * Called with bcache_lock held.
+ */
+static bcache_buf_t *cache_victim(void) {
+	bcache_buf_t *b;
+
+	for (b = lru.lru_prev; b != &lru; b = b->lru_prev) {
+		if (!b->busy && !b->delayed && b->jstate != J_RUNNING)
+			return b;
+	}
+	condition_wait(&bcache_lock, &bcache_io);
+	return NULL;
+}
+
+/*
+ * Takes over buffer b, from cache_victim(), for block_num, which is not
+ * cached. What b held is written back first if it is dirty. The buffer
+ * is not filled. Returns -1 if the write-back failed. Called with
+ * bcache_lock held, which is not let go.
+ */
+static int cache_take(bcache_buf_t *b, int block_num) {
+	stat.misses++;
+	if (b->block_num >= 0) {
+		if (b->dirty && cache_writeback(b) < 0)
+			return -1;
+		hash_remove(b);
+		stat.evictions++;
+	}
+
+	b->block_num = block_num;
+	hash_insert(b);
+	lru_remove(b);
+	lru_push_front(b);
+	return 0;
+}
+
+/*
+ * A busy buffer has been filled (ok is TRUE) or could not be, in which
+ * case it is dropped from the cache. Wakes up those waiting for it.
+ */
+static void cache_unbusy(bcache_buf_t *b, int ok) {
+	b->busy = FALSE;
+	if (!ok) {
+		hash_remove(b);
+		b->block_num = -1;
+	}
+	condition_broadcast(&bcache_io);
+}
+
+/*
+ * Marks a buffer that is about to be changed dirty. If the block is in
+ * the log, and not in the running transaction, the log is emptied
+ * first, so it is not replayed over the new contents. Returns -1, and
+ * changes nothing, if that failed; the buffer must then be left as it
+ * is.
+ */
+static int cache_dirty(bcache_buf_t *b) {
+	if (b->jstate != J_RUNNING && journal_logged(b->block_num) >= 0 &&
+	    journal_checkpoint() < 0)
+		return -1;
+	if (!b->dirty) {
+		b->dirty = TRUE;
+		stat.dirty++;
+	}
+	return 0;
+}
+
+/*
+ * Drops a clean buffer from the cache, after it was taken for a block
+ * whose data then did not arrive.
+ */
+static void cache_drop(bcache_buf_t *b) {
+	hash_remove(b);
+	b->block_num = -1;
+}
+
+/*
+ * Drops a delayed buffer from the cache, and makes it the first to be
+ * reused.
+ */
+static void cache_forget(bcache_buf_t *b) {
+	hash_remove(b);
+	b->block_num = -1;
+	b->delayed = FALSE;
+	stat.delayed--;
+	lru_remove(b);
+	b->lru_next = &lru;
+	b->lru_prev = lru.lru_prev;
+	lru.lru_prev->lru_next = b;
+	lru.lru_prev = b;
+}
+
+/*
+ * Write a dirty buffer back to the device. It is not in the running
+ * transaction (see cache_victim()).
+ */
+static int cache_writeback(bcache_buf_t *b) {
+	ASSERT(b->jstate != J_RUNNING);
+	if (block_dev_write(b->block_num, 1, b->data) < 0)
+		return -1;
+
+	stat.dev_writes++;
+	stat.write_ops++;
+	stat.dirty--;
+	b->dirty = FALSE;
+	b->jstate = J_NONE;
+	return 0;
+}
+
+/*
+ * Write home every dirty buffer that is not in the running
+ * transaction, leaving out the committed ones unless committed is
+ * TRUE. The buffers are sorted by block number, and each run of
+ * adjacent blocks is written with one device request. Returns -1 if
+ * any write failed; those buffers stay dirty.
+ */
+static int cache_write_dirty(int committed) {
+	bcache_buf_t *list[BCACHE_BLOCKS];
+	bcache_buf_t *b;
+	int i, j, count, n = 0, rc = 0;
+
+	for (i = 0; i < BCACHE_BLOCKS; i++) {
+		b = &bufs[i];
+		if (!b->dirty || b->jstate == J_RUNNING ||
+		    (b->jstate == J_COMMITTED && !committed))
+			continue;
+
+		/* Insertion sort, there are few of them */
+		for (j = n; j > 0 && list[j - 1]->block_num > b->block_num; j--)
+			list[j] = list[j - 1];
+		list[j] = b;
+		n++;
+	}
+
+	for (i = 0; i < n; i += count) {
+		count = 1;
+		while (i + count < n && count < WRITE_RUN_MAX &&
+		       list[i + count]->block_num == list[i]->block_num + count)
+			count++;
+		if (cache_write_run(&list[i], count) < 0)
+			rc = -1;
+	}
+	return rc;
+}
+
+/* Write count buffers holding adjacent blocks with one device request */
+static int cache_write_run(bcache_buf_t **run, int count) {
+	char *data = run[0]->data;
+	int i;
+
+	if (count > 1) {
+		for (i = 0; i < count; i++)
+			bcopy(run[i]->data, &iobuf[i * BLOCK_SIZE], BLOCK_SIZE);
+		data = iobuf;
+	}
+	if (block_dev_write(run[0]->block_num, count, data) < 0)
+		return -1;
+
+	stat.dev_writes += count;
+	stat.write_ops++;
+	stat.dirty -= count;
+	for (i = 0; i < count; i++) {
+		run[i]->dirty = FALSE;
+		run[i]->jstate = J_NONE;
+	}
+	return 0;
+}
+
+static void hash_insert(bcache_buf_t *b) {
+	int h = HASH(b->block_num);
+
+	b->hash_next = hash_table[h];
+	hash_table[h] = b;
+}
+
+static void hash_remove(bcache_buf_t *b) {
+	bcache_buf_t **pp = &hash_table[HASH(b->block_num)];
+
+	while (*pp != b)
+		pp = &(*pp)->hash_next;
+	*pp = b->hash_next;
+	b->hash_next = NULL;
+}
+
+static void lru_remove(bcache_buf_t *b) {
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(bcache_buf_t *b) {
+	b->lru_next = lru.lru_next;
+	b->lru_prev = &lru;
+	lru.lru_next->lru_prev = b;
+	lru.lru_next = b;
+}
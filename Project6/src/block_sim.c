@@ -1,97 +1,149 @@
 /*
  * This simulates the operation of the filesystem on Linux.
  *
- * The block function read or writes a block of the file system.
+ * The block_dev functions read or write blocks of the file system
+ * in a Linux file. Caching is done on top of them by block_cache.c,
+ * just like in the kernel.
+ *
+ * By default image_sim is mapped into memory, so a device read or
+ * write is a memory copy, and the image is only synced to the file by
+ * block_dev_sync() (called by block_flush()) and block_destruct().
+ * This keeps large images fast. The image may be of any size.
+ *
+ * Two environment variables change this:
+ *   BLOCK_SIM_STDIO    if set, use fseek/fread/fwrite for every
+ *                      request instead, and flush after each write
+ *   BLOCK_SIM_LATENCY  microseconds to sleep per device request, to
+ *                      model a slow USB stick
  */
 
+#define _FILE_OFFSET_BITS 64 /* images over 2GB also in a 32-bit build */
+
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "block.h"
 #include "util.h"
 
-static FILE *fp; /* The file used to simulate a diskette */
+static FILE *fp;       /* The file used to simulate a diskette */
+static char *image;    /* The file mapped into memory, NULL if not mapped */
+static off_t image_size; /* Size of the file in bytes */
+static int latency;    /* Microseconds to wait per request */
 
 static void error(char *fmt, ...);
+static void check_range(int block_num, int count);
 
 /* Initialize the file */
 void block_init(void) {
+	struct stat st;
+	char *env;
+
 	if ((fp = fopen("image_sim", "r+")) == NULL) {
 		error("could not open image file:");
 	}
+	if (fstat(fileno(fp), &st) < 0) {
+		error("fstat error: ");
+	}
+	image_size = st.st_size;
+
+	if ((env = getenv("BLOCK_SIM_LATENCY")) != NULL)
+		latency = atoi(env);
+
+	image = NULL;
+	/* An image too large for the address space is read with stdio */
+	if (getenv("BLOCK_SIM_STDIO") == NULL && image_size > 0 && (off_t)(size_t)image_size == image_size) {
+		image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+		if (image == MAP_FAILED) {
+			error("mmap error: ");
+		}
+	}
+	block_cache_init();
 }
 
 void block_destruct(void) {
+	block_cache_destruct();
+	if (image != NULL) {
+		munmap(image, image_size);
+		image = NULL;
+	}
 	fclose(fp);
 }
 
-/* Read a block into memory[address] */
-int block_read(int block_num, void *address) {
-	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-		error("fseek error: ");
-	}
+/* Read count blocks into memory[address] */
+int block_dev_read(int block_num, int count, void *address) {
+	check_range(block_num, count);
+	if (latency > 0)
+		usleep(latency);
 
-	if (fread(address, BLOCK_SIZE, 1, fp) != 1) {
-		error("fread error: ");
+	if (image != NULL) {
+		bcopy(&image[(size_t)block_num * BLOCK_SIZE], address, count * BLOCK_SIZE);
+	}
+	else {
+		if (fseeko(fp, (off_t)block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+			error("fseek error: ");
+		}
+		if (fread(address, BLOCK_SIZE, count, fp) != (size_t)count) {
+			error("fread error: ");
+		}
 	}
 #ifndef NDEBUG
-	printf("block %d read\n", block_num);
+	printf("block %d read (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
-	return 1;
+	return 0;
 }
 
-/* Wrtie from memory['address'] into block 'block' in the file */
-int block_write(int block_num, void *address) {
-	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-		error("fseek error: ");
-	}
+/* Write count blocks from memory['address'] into block 'block' in the file */
+int block_dev_write(int block_num, int count, void *address) {
+	check_range(block_num, count);
+	if (latency > 0)
+		usleep(latency);
 
-	if (fwrite(address, BLOCK_SIZE, 1, fp) != 1) {
-		error("write error: ");
+	if (image != NULL) {
+		bcopy(address, &image[(size_t)block_num * BLOCK_SIZE], count * BLOCK_SIZE);
+	}
+	else {
+		if (fseeko(fp, (off_t)block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+			error("fseek error: ");
+		}
+		if (fwrite(address, BLOCK_SIZE, count, fp) != (size_t)count) {
+			error("write error: ");
+		}
+		fflush(fp);
 	}
 #ifndef NDEBUG
-	printf("block %d written\n", block_num);
+	printf("block %d written (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
-	fflush(fp);
-	return 1;
+	return 0;
 }
 
-/* Modify a block */
-int block_modify(int block_num, int offset, void *data, int data_size) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + data_size) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(data, &buf[offset], data_size);
-	block_write(block_num, buf);
-
-#ifndef NDEBUG
-	printf("block %d modified (%d bytes)\n", block_num, data_size);
-#endif /* NDEBUG */
-
-	return 1;
+/* Make sure everything written so far is in the file */
+int block_dev_sync(void) {
+	if (image != NULL && msync(image, image_size, MS_SYNC) < 0) {
+		error("msync error: ");
+	}
+	return 0;
 }
 
-/* Read part of a block */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + bytes) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(&(buf[offset]), address, bytes);
-
-#ifndef NDEBUG
-	printf("block %d read from %d (%d bytes)\n", block_num, offset, bytes);
-#endif /* NDEBUG */
+/* The file system may use the whole image */
+int block_dev_blocks(void) {
+	return image_size / BLOCK_SIZE;
+}
 
-	return 1;
+/* Exit if a request reaches past the end of the image */
+static void check_range(int block_num, int count) {
+	if (block_num < 0 || ((off_t)block_num + count) * BLOCK_SIZE > image_size) {
+		errno = 0;
+		error("blocks %d-%d are outside image_sim (%ld blocks)\n",
+		      block_num, block_num + count - 1, (long)(image_size / BLOCK_SIZE));
+	}
 }
 
 /* print an error message and exit */
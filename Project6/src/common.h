@@ -13,7 +13,7 @@
 
 /* Function alias */
 #define FUNCTION_ALIAS(alias_name, name) \
-  void alias_name(void) __attribute__ ((alias (#name)))
+  void alias_name() __attribute__ ((alias (#name)))
 
 /* Unique integers for each system call  */
 enum {
@@ -44,6 +44,18 @@ enum {
         SYSCALL_FS_MKDIR,
         SYSCALL_FS_CHDIR,       /* 25 */
         SYSCALL_FS_RMDIR,
+        SYSCALL_FS_READV,
+        SYSCALL_FS_WRITEV,
+        SYSCALL_FS_PREAD,
+        SYSCALL_FS_PWRITE,      /* 30 */
+        SYSCALL_IOSTAT,
+        SYSCALL_FS_SYNC,
+        SYSCALL_FS_STATFS,
+        SYSCALL_FS_GETDENTS,
+        SYSCALL_FS_MMAP,        /* 35 */
+        SYSCALL_FS_MSYNC,
+        SYSCALL_FS_READ_ASYNC,
+        SYSCALL_FS_WRITE_ASYNC,
    SYSCALL_COUNT
 };
 
@@ -124,6 +136,90 @@ struct directory_t {
   int size;    /* Size in number of sectors */
 };
 
+/*
+ * One buffer of a vectored file system call (fs_readv and fs_writev),
+ * or the buffer of fs_pread and fs_pwrite.
+ */
+struct fs_iovec {
+  char *base;    /* Start of the buffer */
+  int len;    /* Size of the buffer in bytes */
+};
+
+/*
+ * An asynchronous read or write (fs_read_async and fs_write_async),
+ * which needs more arguments than a system call passes.
+ */
+struct fs_aio {
+  int fd;       /* File descriptor */
+  char *buffer; /* Start of the buffer */
+  int size;     /* Size of the buffer in bytes */
+  int mbox;     /* Mailbox the completion is sent to */
+  int tag;      /* Passed back in the completion, chosen by the caller */
+};
+
+/*
+ * Completion of an asynchronous read or write, sent as the body of a
+ * message to the mailbox of the request.
+ */
+struct fs_aio_done {
+  int fd;     /* File descriptor of the request */
+  int bytes;  /* Bytes read or written */
+  int status; /* FSE_OK, or the error of the request */
+  int tag;    /* Tag of the request */
+};
+
+/* What fs_fsck found */
+struct fsck_stat {
+  int inodes;       /* inodes in use */
+  int blocks;       /* blocks in use, metadata included */
+  int bad_entries;  /* directory entries referring to free inodes */
+  int bad_sizes;    /* directories whose size does not match their entries */
+  int bad_links;    /* inodes with the wrong nlinks */
+  int orphans;      /* inodes in use that no directory refers to */
+  int bad_pointers; /* block pointers outside the file system or used twice */
+  int bad_ibmap;    /* wrong bits in the inode bitmap */
+  int bad_dbmap;    /* wrong bits in the data block bitmap */
+  int bad_counts;   /* wrong free counts in the superblock */
+  int repaired;     /* TRUE if the problems were repaired */
+  uint64_t tsc;     /* time stamp counter cycles the check took */
+};
+
+/* What fs_statfs returns */
+struct fs_statfs {
+  int block_size;   /* bytes in a block */
+  int blocks;       /* blocks in the file system, metadata included */
+  int free_blocks;  /* blocks not in use */
+  int inodes;       /* inodes in the file system */
+  int free_inodes;  /* inodes not in use */
+  int groups;       /* allocation groups */
+  int group_blocks; /* blocks in each allocation group */
+};
+
+/*
+ * Latency histogram buckets of struct io_counts. Bucket i counts the
+ * requests that took from 2^i to 2^(i+1)-1 time stamp counter cycles.
+ */
+#define IOSTAT_BUCKETS 32
+
+/* I/O done by one layer of the block device in one direction */
+struct io_counts {
+  int ops;           /* requests */
+  int sectors;       /* sectors transferred */
+  int bytes;         /* bytes transferred */
+  int errors;        /* requests that failed */
+  int waits;         /* requests that waited for another to finish */
+  uint64_t wait_tsc; /* cycles spent waiting */
+  uint64_t tsc;      /* cycles spent in requests, waits included */
+  int hist[IOSTAT_BUCKETS]; /* requests by log2 of their cycles */
+};
+
+/* What io_stat returns. Index 0 of each array is reads, 1 writes. */
+struct iostat {
+  struct io_counts block[2]; /* block_dev_read and block_dev_write */
+  struct io_counts scsi[2];  /* SCSI READ(10) and WRITE(10) commands */
+  int bounced;               /* blocks copied through the bounce buffer */
+};
+
 extern const int os_size; /* size of os in disk blocks */
 
 #endif /* !COMMON_H */
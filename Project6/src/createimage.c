@@ -8,12 +8,14 @@
 
 #define IMAGE_FILE "./image"
 #define ARGS "[--extended] [--vm]" \
-" [--fs] [--kernel] <bootblock> <executable-file> ..."
+" [--fs[=blocks]] [--kernel] <bootblock> <executable-file> ..."
 
 #define SECTOR_SIZE 512
 #define OS_SIZE_LOC 2
 #define BOOT_MEM_LOC 0x7c00
 #define OS_MEM_LOC 0x8000
+/* blocks reserved for the file system by a plain --fs */
+#define FS_DEFAULT_BLOCKS (512 + 2)
 
 /* to align down to a page boundary, just mask off the last 12 bits */
 #define ALIGN_PAGE_DOWN(addr) ((addr)&0xfffff000)
@@ -27,6 +29,7 @@ static struct {
 	int extended;
 	int kernel;
 	int fs;
+	int fs_blocks;
 } options;
 
 /* process directory entry */
@@ -86,6 +89,13 @@ int main(int argc, char **argv) {
 		}
 		else if (strcmp(option, "fs") == 0) {
 			options.fs = 1;
+			options.fs_blocks = FS_DEFAULT_BLOCKS;
+		}
+		else if (strncmp(option, "fs=", 3) == 0) {
+			options.fs = 1;
+			options.fs_blocks = atoi(&option[3]);
+			if (options.fs_blocks <= 0)
+				error("%s: invalid file system size %s\n", progname, &option[3]);
 		}
 		else {
 			error("%s: invalid option\nusage: %s %s\n", progname, progname, ARGS);
@@ -131,7 +141,7 @@ static void create_images(int nfiles, char *files[]) {
 
 	if (options.fs == 1) {
 		/* reserve some blocks for the filesystem. */
-		reserve_fs_blocks(&image, 512 + 2);
+		reserve_fs_blocks(&image, options.fs_blocks);
 	}
 
 	while (nfiles > 0) {
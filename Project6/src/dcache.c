@@ -0,0 +1,228 @@
+/*
+ * Directory entry (dentry) cache used by name2inode() in fs.c.
+ *
+ * Caches the result of looking up one path component: the pair
+ * (parent directory inode, name) maps to the inode the name refers
+ * to. A lookup that did not find the name is cached too, as a
+ * negative entry with inode -1, so repeated opens of a file that is
+ * about to be created do not read the directory again.
+ *
+ * Implementation notes:
+ *
+ * The cache is a fixed pool of DCACHE_ENTRIES entries, found through
+ * a hash table on (parent, name) and kept on an LRU list with the
+ * most recently used entry first. When a new entry is needed the
+ * least recently used one is reused.
+ *
+ * The cache holds no dirty state, so it is always safe to throw
+ * entries away. fs.c drops the entries affected by unlink, rmdir,
+ * link and file/directory creation.
+ *
+ * Every process looks names up, so the cache is protected by
+ * dcache_lock. It is never held for long, since the cache does no I/O.
+ */
+
+#include "common.h"
+#include "dcache.h"
+#include "thread.h"
+#include "util.h"
+
+typedef struct dentry dentry_t;
+struct dentry {
+	inode_t parent;            /* directory holding the name, -1 if unused */
+	inode_t ino;               /* inode the name refers to, -1 if none */
+	char name[MAX_FILENAME_LEN];
+	dentry_t *hash_next;       /* next entry in the same hash chain */
+	dentry_t *lru_prev;        /* more recently used entry */
+	dentry_t *lru_next;        /* less recently used entry */
+};
+
+static dentry_t dentries[DCACHE_ENTRIES];
+static dentry_t *hash_table[DCACHE_HASH];
+/*
+ * Head of the LRU list. lru.lru_next is the most recently used entry
+ * and lru.lru_prev the least recently used one.
+ */
+static dentry_t lru;
+static struct dcache_stat stat;
+static lock_t dcache_lock;
+
+static int hash(inode_t parent, const char *name);
+static dentry_t *dentry_find(inode_t parent, const char *name);
+static void dentry_drop(dentry_t *d);
+static void hash_insert(dentry_t *d);
+static void hash_remove(dentry_t *d);
+static void lru_remove(dentry_t *d);
+static void lru_push_front(dentry_t *d);
+
+/* Set up an empty cache. Called when a file system is made or loaded. */
+void dcache_init(void) {
+	int i;
+
+	lock_init(&dcache_lock);
+	lru.lru_next = &lru;
+	lru.lru_prev = &lru;
+
+	for (i = 0; i < DCACHE_HASH; i++)
+		hash_table[i] = NULL;
+
+	for (i = 0; i < DCACHE_ENTRIES; i++) {
+		dentries[i].parent = -1;
+		dentries[i].hash_next = NULL;
+		lru_push_front(&dentries[i]);
+	}
+
+	bzero((char *)&stat, sizeof(stat));
+}
+
+/*
+ * Looks up name in directory parent. Returns TRUE and stores the
+ * cached inode (-1 if the name is known not to exist) in *ino, or
+ * FALSE if the cache knows nothing about the name.
+ */
+int dcache_lookup(inode_t parent, const char *name, inode_t *ino) {
+	dentry_t *d;
+
+	lock_acquire(&dcache_lock);
+	d = dentry_find(parent, name);
+	if (d == NULL) {
+		stat.misses++;
+		lock_release(&dcache_lock);
+		return FALSE;
+	}
+
+	stat.hits++;
+	if (d->ino < 0)
+		stat.neg_hits++;
+
+	lru_remove(d);
+	lru_push_front(d);
+	*ino = d->ino;
+	lock_release(&dcache_lock);
+	return TRUE;
+}
+
+/*
+ * Records that name in directory parent refers to ino. Pass -1 as ino
+ * to record that the name does not exist.
+ */
+void dcache_insert(inode_t parent, const char *name, inode_t ino) {
+	dentry_t *d;
+
+	if (strlen(name) >= MAX_FILENAME_LEN)
+		return;
+
+	lock_acquire(&dcache_lock);
+	d = dentry_find(parent, name);
+	if (d == NULL) {
+		/* Reuse the least recently used entry */
+		d = lru.lru_prev;
+		if (d->parent >= 0)
+			hash_remove(d);
+
+		d->parent = parent;
+		strcpy(d->name, (char *)name);
+		hash_insert(d);
+	}
+
+	d->ino = ino;
+	lru_remove(d);
+	lru_push_front(d);
+	lock_release(&dcache_lock);
+}
+
+/* Forgets what is known about name in directory parent */
+void dcache_invalidate(inode_t parent, const char *name) {
+	dentry_t *d;
+
+	lock_acquire(&dcache_lock);
+	d = dentry_find(parent, name);
+	if (d != NULL)
+		dentry_drop(d);
+	lock_release(&dcache_lock);
+}
+
+/*
+ * Forgets every entry that refers to ino or lives in directory ino.
+ * Used when an inode is freed, since its number may be reused.
+ */
+void dcache_invalidate_inode(inode_t ino) {
+	int i;
+
+	lock_acquire(&dcache_lock);
+	for (i = 0; i < DCACHE_ENTRIES; i++) {
+		if (dentries[i].parent >= 0 &&
+		    (dentries[i].parent == ino || dentries[i].ino == ino))
+			dentry_drop(&dentries[i]);
+	}
+	lock_release(&dcache_lock);
+}
+
+/* Copy the cache statistics into *s */
+void dcache_stat(struct dcache_stat *s) {
+	lock_acquire(&dcache_lock);
+	bcopy((char *)&stat, (char *)s, sizeof(stat));
+	lock_release(&dcache_lock);
+}
+
+/*
+ * Helper functions
+ */
+
+static int hash(inode_t parent, const char *name) {
+	unsigned int h = parent;
+
+	while (*name != '\0')
+		h = h * 31 + *name++;
+	return h & (DCACHE_HASH - 1);
+}
+
+/* Returns the entry for (parent, name), or NULL if it is not cached */
+static dentry_t *dentry_find(inode_t parent, const char *name) {
+	dentry_t *d;
+
+	for (d = hash_table[hash(parent, name)]; d != NULL; d = d->hash_next) {
+		if (d->parent == parent && same_string(d->name, (char *)name))
+			return d;
+	}
+	return NULL;
+}
+
+/* Unhash an entry and make it the first to be reused */
+static void dentry_drop(dentry_t *d) {
+	hash_remove(d);
+	d->parent = -1;
+	lru_remove(d);
+	d->lru_next = &lru;
+	d->lru_prev = lru.lru_prev;
+	lru.lru_prev->lru_next = d;
+	lru.lru_prev = d;
+}
+
+static void hash_insert(dentry_t *d) {
+	int h = hash(d->parent, d->name);
+
+	d->hash_next = hash_table[h];
+	hash_table[h] = d;
+}
+
+static void hash_remove(dentry_t *d) {
+	dentry_t **pp = &hash_table[hash(d->parent, d->name)];
+
+	while (*pp != d)
+		pp = &(*pp)->hash_next;
+	*pp = d->hash_next;
+	d->hash_next = NULL;
+}
+
+static void lru_remove(dentry_t *d) {
+	d->lru_prev->lru_next = d->lru_next;
+	d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_push_front(dentry_t *d) {
+	d->lru_next = lru.lru_next;
+	d->lru_prev = &lru;
+	lru.lru_next->lru_prev = d;
+	lru.lru_next = d;
+}
@@ -0,0 +1,27 @@
+/* Header file for dcache.c */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "fs.h"
+
+/* Number of directory entries kept in the dentry cache */
+#define DCACHE_ENTRIES 64
+/* Number of hash chains in the dentry cache (must be a power of two) */
+#define DCACHE_HASH 32
+
+/* Dentry cache statistics, see dcache_stat() */
+struct dcache_stat {
+	int hits;     /* lookups answered by the cache (including negative) */
+	int neg_hits; /* hits on entries recording that a name does not exist */
+	int misses;   /* lookups that had to read the directory */
+};
+
+void dcache_init(void);
+int dcache_lookup(inode_t parent, const char *name, inode_t *ino);
+void dcache_insert(inode_t parent, const char *name, inode_t ino);
+void dcache_invalidate(inode_t parent, const char *name);
+void dcache_invalidate_inode(inode_t ino);
+void dcache_stat(struct dcache_stat *s);
+
+#endif /* !DCACHE_H */
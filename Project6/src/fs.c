@@ -8,6 +8,7 @@
 
 #include "block.h"
 #include "common.h"
+#include "dcache.h"
 #include "fs_error.h"
 #include "inode.h"
 #include "kernel.h"
@@ -15,837 +16,2976 @@
 #include "thread.h"
 #include "util.h"
 
-#define BITMAP_ENTRIES 256
-#define INODE_TABLE_ENTRIES 20
+#ifndef LINUX_SIM
+#include "memory.h"
+#define MAPPED(buf, size) map_overlap((uint32_t)(buf), (size))	//Buffers in mapped files are refused, see memory.c
+#define MESSAGE_END ""		//Messages get a screen line of their own (FS_MESSAGE_LINE)
+#else
+#define MAPPED(buf, size) FALSE
+#define MESSAGE_END "\n"
+#endif /* LINUX_SIM */
+
+#define DBMAP_BITS (BLOCK_SIZE * 8)	//Blocks covered by one block of the data block bitmap
+#define NINODES (superblock->d_super.ninodes)	//Decided by fs_mkfs(), see fs.h
+#define INODE_BMAP_WORDS (FS_MAX_INODES / 32)
+#define FS_MIN_GROUPS 4		//Allocation groups of a small file system, which get fewer blocks each
+#define BMAP_CHUNK 4096		//Data block bitmap bits searched or checked at a time, within one bitmap block
+#define INODE_CACHE_ENTRIES 32
+#define FS_MESSAGE_LINE 24	//Screen line of the messages of fs_init()
+#define RA_MIN_WINDOW 2		//Read-ahead window when a stream is first detected
+#define OPEN_FILE_ENTRIES 32	//Open files in the whole system
+#define DELAY_KEY(inode, index) ((inode)->inode_num * INODE_MAX_BLOCKS + (index))	//Names delayed data in the buffer cache
+#define WRITE_OP_BLOCKS BCACHE_DELAY_MAX	//File blocks written in one operation (see write_ops())
+#define FREE_STEP (JOURNAL_OP_MAX - 2)	//Blocks freed in one operation, each may change a bitmap block of its own
 
 
 //Allocate space for structures
 mem_superblock_t superblock[SUPERBLK_SIZE];
 int superblock_datablock;
-mem_inode_t inode_table[BLOCK_SIZE/sizeof(disk_inode_t)];	//Inode table containing 18 entries. Is written to disk as well
-char inode_bmap[BITMAP_ENTRIES];
-char dblk_bmap[BITMAP_ENTRIES];
-char bitmap[BITMAP_ENTRIES*2];	//Contains both inode and data block bitmap
-fd_entry_t file_descriptor_table[MAX_OPEN_FILES];	//Table keeping track of open files
-
-static int get_free_entry(unsigned char *bitmap);
-static int free_bitmap_entry(int entry, unsigned char *bitmap);
-static inode_t name2inode(char *name);
+mem_inode_t inode_table[INODE_CACHE_ENTRIES];	//Cache of inodes, loaded from the inode area when first used
+int inode_clock;	//Counts inode lookups, gives the cache its LRU order
+uint32_t inode_bmap[INODE_BMAP_WORDS];	//The data block bitmap is on disk only, see superblock.h
+int dblk_rotor;		//Where data block searches start when there is no better goal
+open_file_t open_file_table[OPEN_FILE_ENTRIES];	//Open files, referred to from the descriptor tables of the processes
+
+//Locks. fs.c is called from every process, and a system call can be
+//preempted, also while it waits for the disk. Each inode has a lock of
+//its own (see ilock()), so calls on different files do not wait for
+//each other. fsck_lock is taken first, then inode locks, then any of
+//the other locks below. A directory is locked before the inodes it
+//holds, or in inode number order when that is not known (see ilock2()).
+//None of the other locks below is held while an inode lock is taken,
+//or while taking another of them
+//
+//A call that changes metadata does so in one operation of the journal
+//(block_journal_begin() to block_journal_end(), see block.h), so that a
+//commit never holds half of it. The operation is started before any
+//inode lock is taken, since it may wait for the others to end
+lock_t icache_lock;	//Protects inode_table (except what inode locks protect) and inode_clock
+lock_t alloc_lock;	//Protects the bitmaps (on disk too), the free counts in the superblock, dblk_rotor and superblock->dirty
+lock_t fd_lock;		//Protects open_file_table and the descriptor tables
+lock_t fsck_lock;	//Only one fs_fsck at a time, since it uses the tables below. Taken before inode locks
+int fs_mounted;		//TRUE once a file system is mounted or made. Until then file system calls fail with FSE_NOTMOUNTED
+char zero_block[BLOCK_SIZE];	//Always zero, written to clear blocks (kept off the stack, since a block may be 4KB)
+dir_block_t empty_dir_block;	//Dirent block with no entries in use, written to make new directory blocks
+
+//What fs_fsck finds, kept as small as possible, and in the kernel
+//out of the kernel image (see fs.h)
+#ifdef LINUX_SIM
+char fsck_mem[FSCK_MEM_SIZE];
+#define FSCK_MEM fsck_mem
+#else
+#define FSCK_MEM ((char*)FSCK_MEM_START)
+#endif /* LINUX_SIM */
+short *const fsck_links = (short*)FSCK_MEM;	//Directory entries (other than "." and "..") referring to each inode
+char *const fsck_type = FSCK_MEM + FS_MAX_INODES * sizeof(short);	//Type of each inode, 0 if it is free
+uint32_t *const fsck_dblk = (uint32_t*)(FSCK_MEM + FS_MAX_INODES * FSCK_INODE_BYTES);	//Blocks found in use, a bit for each block of the file system
+
+static int get_free_entry(uint32_t *bitmap, int nentries, int goal);
+static int free_bitmap_entry(int entry, uint32_t *bitmap, int nentries);
+static int alloc_extent(uint32_t *bitmap, int nentries, int goal, int want, extent_t *extent);
+static int alloc_data_blocks(int goal, int want, extent_t *extent);
+static int free_data_block(blknum_t block);
+static void count_blocks(blknum_t block, int count, int delta);
+static int emptiest_group(void);
+static int inode_alloc_range(mem_inode_t *inode, int first, int last);
+static int inode_flush(mem_inode_t *inode);
+static int in_delayed(mem_inode_t *inode, int index);
+static void delayed_drop(mem_inode_t *inode);
+static int inline_promote(mem_inode_t *inode);
+static int set_blk(mem_inode_t *inode, int index, blknum_t block);
+static blknum_t map_block(mem_inode_t *inode, int index, int *slot);
+static int map_end(int index);
+static int map_alloc(mem_inode_t *inode, int index, int *goal);
+static int free_map_blocks(blknum_t map, int depth, int *count);
+static inode_t name2inode(const char *name);
+static inode_t dir_lookup(inode_t dir, char *name);
+static unsigned int dir_hash(char *name);
+static int dir_init(inode_t dir, inode_t parent);
+static inode_t dir_find(inode_t dir, char *name, blknum_t *block, int *slot);
+static int dir_add(inode_t dir, char *name, inode_t ino);
+static int dir_blocks(mem_inode_t *inode, int *first);
+static int dir_bucket(mem_inode_t *inode, unsigned int hash);
+static int dir_grow(mem_inode_t *inode, int index, unsigned int hash);
+static int dir_split(mem_inode_t *inode, int index, int block_depth, int depth);
+static int dir_to_table(mem_inode_t *inode);
+static int dir_new_block(mem_inode_t *inode, int next, int depth);
+static inode_t dir_remove(inode_t dir, char *name);
+static int dir_readdir(inode_t dir, int *pos, dirent_t *dirent);
+static int dir_getdents(mem_inode_t *inode, dirent_t *dirents, int max, int *pos);
+static inode_t alloc_inode(inode_t goal);
+static void free_inode(inode_t ino);
 static blknum_t ino2blk(inode_t ino);
-static blknum_t idx2blk(int index);
+static mem_inode_t *iget(inode_t ino);
+static mem_inode_t *icache_get(inode_t ino);
+static mem_inode_t *ilock(inode_t ino);
+static void iunlock(mem_inode_t *inode);
+static int ilock2(inode_t a, inode_t b, mem_inode_t **pa, mem_inode_t **pb);
+static void iunlock2(mem_inode_t *a, mem_inode_t *b);
+static void icache_reset(void);
+static void iupdate(mem_inode_t *inode);
+static blknum_t idx2blk(mem_inode_t *inode, int index, int alloc);
+static int read_extent(mem_inode_t *inode, int index, blknum_t block, int max);
+static void read_ahead(open_file_t *f, mem_inode_t *inode, int size);
+static open_file_t *fd2file(int fd);
+static int file_read(open_file_t *f, mem_inode_t *inode, char *buffer, int size);
+static int write_ops(open_file_t *f, char *buffer, int size);
+static int file_write(open_file_t *f, mem_inode_t *inode, char *buffer, int size);
+static int file_write_block(mem_inode_t *inode, int index, int offset, char *data, int size);
+static inode_t file_create(inode_t dir, char *name);
+static inode_t lock_entry(inode_t dir, char *name, mem_inode_t **pdir, mem_inode_t **pino);
+static void open_file_init(open_file_t *f, inode_t ino, int mode);
+static void reset_open_files(void);
+static void clear_block_pointers(disk_inode_t *d_inode);
+static void free_inode_blocks(mem_inode_t *inode, disk_inode_t *freed);
+static void free_detached(disk_inode_t *freed);
+static int free_blocks(disk_inode_t *d_inode, int *count);
+static int free_step(int *count);
+static int meta_write(blknum_t block, void *data);
+static int meta_modify(blknum_t block, int offset, void *data, int size);
+static void bitmap_update(void);
+static void fs_mount(void);
+static int super_fits(disk_superblock_t *sb);
+static int fsck_dirs(int repair, struct fsck_stat *st);
+static void fsck_mark_blocks(mem_inode_t *inode, int repair, struct fsck_stat *st);
+static void fsck_mark_map(blknum_t map, int depth, int repair, struct fsck_stat *st);
+static void fsck_step(int repair);
+static int fsck_claim(blknum_t block, struct fsck_stat *st);
+static int fsck_group(int group, int repair, struct fsck_stat *st);
+static int fsck_dbmap(blknum_t first, int n, int repair, struct fsck_stat *st);
+static int bit_count(uint32_t word);
 
 /*
  * Exported functions.
  */
 void fs_init(void)
 {
+	lock_init(&icache_lock);
+	lock_init(&alloc_lock);
+	lock_init(&fd_lock);
+	lock_init(&fsck_lock);
+
+	for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+		empty_dir_block.entries[i].inode = -1;
+		strcpy(empty_dir_block.entries[i].name, "empty");
+	}
+
 	//Initialize blocks
 	block_init();
 
-	//If the file system has not been initialized before
-	if(superblock->d_super.signature != 1){
-		// create new filesystem
+	//Superblock, inode bitmap and root inode come in with one device read
+	block_prefetch(SUPER_BLOCK, MOUNT_BLOCKS);
+
+	disk_superblock_t on_disk;
+	block_read_part(SUPER_BLOCK, 0, sizeof(disk_superblock_t), &on_disk);
+
+	//A device without a file system gets a new one. A file system that
+	//this kernel can not use is left as it is, and nothing is mounted
+	//until fs_mkfs() is called
+	if(on_disk.signature != FS_SIGNATURE){
 		fs_mkfs();
 	}
-	//If file system has been created before, load it
-	else{
-		//Load existing file-system
+	else if(super_fits(&on_disk)){
+		fs_mount();
+		fs_mounted = TRUE;
+	}
+}
+
+/*Returns TRUE if the file system with superblock sb was made with the
+ *layout and block size of this kernel, and fits on the device.
+ *Otherwise shows what differs, and returns FALSE*/
+static int super_fits(disk_superblock_t *sb)
+{
+	char *what = NULL;
+	char *bound = "at most ";
+	int found = 0, wanted = 0;
+
+	if(sb->block_size != BLOCK_SIZE){
+		what = "block size";
+		bound = "";
+		found = sb->block_size;
+		wanted = BLOCK_SIZE;
+	}
+	else if(sb->journal_blocks != FS_JOURNAL_BLOCKS){
+		what = "journal size";
+		bound = "";
+		found = sb->journal_blocks;
+		wanted = FS_JOURNAL_BLOCKS;
+	}
+	else if(sb->ninodes < 1 || sb->ninodes > FS_MAX_INODES || sb->ninodes > sb->inode_blocks * INODES_PER_BLK){
+		what = "number of inodes";
+		found = sb->ninodes;
+		wanted = (sb->inode_blocks * INODES_PER_BLK < FS_MAX_INODES) ? sb->inode_blocks * INODES_PER_BLK : FS_MAX_INODES;
+	}
+	else if(sb->ngroups < 1 || sb->ngroups > FS_MAX_GROUPS){
+		what = "number of allocation groups";
+		found = sb->ngroups;
+		wanted = FS_MAX_GROUPS;
 	}
+	else if(sb->nblocks > block_dev_blocks() || sb->nblocks > FSCK_MAX_BLOCKS){
+		what = "number of blocks";
+		found = sb->nblocks;
+		wanted = (block_dev_blocks() < FSCK_MAX_BLOCKS) ? block_dev_blocks() : FSCK_MAX_BLOCKS;
+	}
+	if(what == NULL){
+		return TRUE;
+	}
+	scrprintf(FS_MESSAGE_LINE, 0, "fs: not mounted, %s is %d, this kernel needs %s%d. mkfs makes a new one" MESSAGE_END,
+	          what, found, bound, wanted);
+	return FALSE;
 }
 
 /*Creates a new file system.
  *Argument: kernel size*/
 void fs_mkfs(void)
 {
-	// int os = get_free_entry((unsigned char*)dblk_bmap);
-	// int kernel = get_free_entry((unsigned char*)dblk_bmap);
+	disk_superblock_t *sb = &superblock->d_super;
 
-	////printf("\n..........FS_MKFS..........\n");
-	//Get datablock entry for superblock
-	superblock_datablock = get_free_entry((unsigned char*)dblk_bmap);
-	////printf("superblock->datablock_num = %d\n", superblock_datablock);
+	//Get rid of changes to the old file system before writing over it.
+	//Nobody else changes anything until the new one is made
+	block_journal_lock();
+	block_flush();
+
+	dblk_rotor = 0;
+	dcache_init();
+	bzero((char*)inode_bmap, sizeof(inode_bmap));
+	bzero((char*)sb, sizeof(disk_superblock_t));
+	ASSERT(sizeof(disk_superblock_t) <= SECTOR_SIZE);
+	ASSERT(sizeof(inode_bmap) <= BLOCK_SIZE);
 
+	////printf("\n..........FS_MKFS..........\n");
+	//The file system gets all the room the device has, up to what
+	//fs_fsck() can check
+	sb->nblocks = block_dev_blocks();
+	if(sb->nblocks > FSCK_MAX_BLOCKS){
+		sb->nblocks = FSCK_MAX_BLOCKS;
+	}
+	//A large file system gets larger groups, so the superblock can count
+	//them, and a small one smaller groups, so there are still a few
+	sb->group_blocks = GROUP_BLOCKS;
+	while((sb->nblocks + sb->group_blocks - 1) / sb->group_blocks > FS_MAX_GROUPS){
+		sb->group_blocks *= 2;
+	}
+	while(sb->group_blocks > 32 && (sb->nblocks + sb->group_blocks - 1) / sb->group_blocks < FS_MIN_GROUPS){
+		sb->group_blocks /= 2;
+	}
+	sb->ngroups = (sb->nblocks + sb->group_blocks - 1) / sb->group_blocks;
+
+	//The superblock and the inode bitmap block come first, then the
+	//inode area, the journal and the data block bitmap
+	superblock_datablock = SUPER_BLOCK;
+	sb->bitmap_block = BITMAP_BLOCK;
+	sb->inode_start = INODE_START;
+	//An inode for every FS_INODE_RATIO bytes, in whole inode blocks
+	sb->inode_blocks = sb->nblocks / (FS_INODE_RATIO / BLOCK_SIZE) / INODES_PER_BLK;
+	if(sb->inode_blocks < FS_MIN_INODE_BLOCKS){
+		sb->inode_blocks = FS_MIN_INODE_BLOCKS;
+	}
+	if(sb->inode_blocks > FS_MAX_INODES / INODES_PER_BLK){
+		sb->inode_blocks = FS_MAX_INODES / INODES_PER_BLK;
+	}
+	sb->ninodes = sb->inode_blocks * INODES_PER_BLK;
+	sb->journal_start = sb->inode_start + sb->inode_blocks;
+	sb->journal_blocks = FS_JOURNAL_BLOCKS;
+	sb->dbmap_start = sb->journal_start + FS_JOURNAL_BLOCKS;
+	sb->dbmap_blocks = (sb->nblocks + DBMAP_BITS - 1) / DBMAP_BITS;
+	blknum_t data_start = sb->dbmap_start + sb->dbmap_blocks;
+	ASSERT(data_start < sb->nblocks);
 
 	//Set disk superblock entries
-	superblock->d_super.ninodes = 0;
-	superblock->d_super.ndata_blks = 0;
-	superblock->d_super.root_inode = get_free_entry((unsigned char*)dblk_bmap);
+	//Inode 0 is the root directory
+	sb->root_inode = sb->inode_start;
 	//Initialize superblock signature for future loading of file system
-	superblock->d_super.signature = 1;
-	//printf("Inode_table datablock_num = %d\n", superblock->d_super.root_inode);
+	sb->signature = FS_SIGNATURE;
+	sb->block_size = BLOCK_SIZE;
+	//File offsets are ints, which large blocks could otherwise overflow
+	sb->max_filesize = (INODE_MAX_BLOCKS > FS_MAX_FILESIZE / BLOCK_SIZE) ? FS_MAX_FILESIZE : BLOCK_SIZE * INODE_MAX_BLOCKS;
+
+	//Everything is free until the allocations below
+	sb->free_inodes = NINODES;
+	sb->free_blks = sb->nblocks;
+	for(int group=0; group<sb->ngroups; group++){
+		int first = group * sb->group_blocks;
+		sb->group_free[group] = (sb->nblocks - first < sb->group_blocks) ? sb->nblocks - first : sb->group_blocks;
+	}
 
-	superblock->d_super.max_filesize = BLOCK_SIZE * 8;
-	
 	//Set superblock entries
 	superblock->ibmap = &inode_bmap;
-	superblock->dbmap = &dblk_bmap;
-	superblock->dirty = FALSE;
-
-	//Write superblock->disk_superblock to disk 
-	block_write(superblock_datablock, &superblock->d_super);
+	superblock->dirty = TRUE;
 
-	//Initialize inode table
-	for(int i=0; i<BLOCK_SIZE/sizeof(disk_inode_t); i++){
-		inode_table[i].d_inode.type = 0; //Not specified file type yet
-		inode_table[i].d_inode.size = 0;
-		inode_table[i].d_inode.nlinks = 0;
-		//Dont need to allocate data blocks yet
+	//Initialize inode cache
+	icache_reset();
 
-		//mem_inode variables
-		inode_table[i].open_count = 0;
-		inode_table[i].pos = 0;
-		inode_table[i].write_pos = 0;
-		inode_table[i].inode_num = -1; //Marked as free by negative number, since a new inode will have values from 0 to 18
-		inode_table[i].dirty = FALSE;
+	//Write an empty data block bitmap. Its last block has bits for
+	//blocks past the end, which are set so they are never allocated
+	for(int i=0; i<sb->dbmap_blocks; i++){
+		block_write(sb->dbmap_start + i, zero_block);
+	}
+	for(int bit=sb->nblocks % DBMAP_BITS; bit>0 && bit<DBMAP_BITS; bit=(bit / 32 + 1) * 32){
+		uint32_t word = ~0u << (bit % 32);
+		block_modify(sb->dbmap_start + sb->dbmap_blocks - 1, bit / 32 * sizeof(uint32_t), &word, sizeof(uint32_t));
 	}
 
+	//Write empty inode area to disk
+	for(int i=0; i<sb->inode_blocks; i++){
+		block_write(sb->inode_start + i, zero_block);
+	}
 
-	//Write inode table to disk
-	block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-
-	//Place inode bitmap&datablock bitmap in one block and write it do disk
-	bcopy((const char*)inode_bmap, bitmap, 256);
-	bcopy((const char*)dblk_bmap, bitmap, 256);
-	int bitmap_pos = get_free_entry((unsigned char*)dblk_bmap);
-	//printf("Bitmap->datablock_num = %d\n", bitmap_pos);
-
-	block_write(bitmap_pos, &bitmap);
-
-
-	//Create root inode
-	mem_inode_t root_inode;
-	root_inode.d_inode.type = INTYPE_DIR;
-	root_inode.d_inode.size = (sizeof(dirent_t) * 2);
-	root_inode.d_inode.nlinks = 0;
-	root_inode.d_inode.direct[0] = get_free_entry((unsigned char*)dblk_bmap);	//Datablock number
-	//printf("Root_inode->datablock_num = %d\n", root_inode.d_inode.direct[0]);
-
-
-	root_inode.open_count = 0;
-	root_inode.pos = 0;
-	root_inode.write_pos = 0;
-	root_inode.inode_num = get_free_entry((unsigned char*)inode_bmap);
-	//printf("Root_inode->inode_num = %d\n", root_inode.inode_num);
-
-	root_inode.dirty = FALSE;
-	
-	//Create array of dirents to insert in root_directory->datablock
-	dirent_t root_dirents[DIRENTS_PER_BLK];
+	//Start with an empty journal, before any metadata is changed
+	block_journal_format(sb->journal_start, FS_JOURNAL_BLOCKS);
+	block_journal_begin();
 
-	//Set all entries in root directory->datablock to available
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		root_dirents[i].inode = -1;
-		strcpy(root_dirents[i].name, "empty");
+	//The blocks in front of the data area are in use
+	extent_t extent;
+	for(blknum_t b=0; b<data_start; b+=extent.count){
+		alloc_data_blocks(b, data_start - b, &extent);
+		ASSERT(extent.start == b);
 	}
 
-	//Set parent and child directory in root_directory->datablock to itself
-	strcpy(root_dirents[0].name, ".");
-	strcpy(root_dirents[1].name, "..");
-	root_dirents[0].inode = 0;
-	root_dirents[1].inode = 0;
-
-	
-	//Write root_directory->datablock to disk
-	block_write(root_inode.d_inode.direct[0], &root_dirents);
+	//Create root inode, and the root directory whose parent and child
+	//entries both point to itself
+	inode_t root = alloc_inode(0);
+	mem_inode_t *root_inode = iget(root);
+	root_inode->d_inode.type = INTYPE_DIR;
+	root_inode->d_inode.size = 0;
+	root_inode->d_inode.nlinks = 0;
+	clear_block_pointers(&root_inode->d_inode);
+	dir_init(root, root);
+	iupdate(root_inode);
 
-	//Place root_inode in inode_table
-	inode_table[0] = root_inode;
 
 
+	//No files are open
+	reset_open_files();
 
-	//Set file_descriptor_table entries to available
-	for(int i=0; i<MAX_OPEN_FILES; i++){
-		file_descriptor_table[i].idx = -1;
-	}
 
+	//Write superblock->disk_superblock and the inode bitmap to disk
+	block_write(superblock_datablock, zero_block);
+	block_modify(superblock_datablock, 0, sb, sizeof(disk_superblock_t));
+	bitmap_update();
+	block_journal_end();
 
-	//Inode table and bitmap has been changed, so write them to disk again
-	block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-	
-	bcopy((const char*)inode_bmap, bitmap, 256);
-	bcopy((const char*)dblk_bmap, bitmap, 256);
-	block_write(bitmap_pos, &bitmap);
+	//Start out with everything on disk and the journal empty
+	block_flush();
+	fs_mounted = TRUE;
+	block_journal_unlock();
 	//printf("Current_running->cwd = %d\n", current_running->cwd);
 	//printf("..........FS_MKFS END..........\n\n");
 }
 
-/*Opens a directory file by placing current_running->inode number in file_descriptor_table
- *Returns the file_descriptor_table index where open directory file is placed*/
+/*Opens "filename", creating it as a file if it does not exist.
+ *Every open gets a new open file with its own offset, installed in
+ *current_running's descriptor table.
+ *Returns the descriptor table index where the open file is placed*/
 int fs_open(const char *filename, int mode)
 {
-	inode_t inode = name2inode(filename);
-
-	//If "filename" exists
-	if(inode >= 0){
-		//Loop through file_descriptor_table
-		for(int i=0; i<MAX_OPEN_FILES; i++){
-			//If there is space in file_descriptor_table
-			if(file_descriptor_table[i].idx == -1){
-				//Place current_running->inode in file_descriptor_table
-				// file_descriptor_table[i].idx = inode_table[current_running->cwd].inode_num;
-				file_descriptor_table[i].idx = inode_table[inode].inode_num;
-
-				file_descriptor_table[i].mode = mode;
+	if(MAPPED(filename, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
 
-				//Increment inode->open_count
-				// inode_table[current_running->cwd].open_count++;
-				inode_table[inode].open_count++;
+	inode_t inode = name2inode(filename);
+	int opened = FALSE;	//TRUE when creating the file opened it
 
+	if(inode == FSE_INODETABLEFULL){
+		return inode;
+	}
 
-				//Return file_descriptor_table index where file is placed
-				return i;
-			}
+	//Check if there is space in the descriptor table for the file
+	lock_acquire(&fd_lock);
+	int fd;
+	for(fd=0; fd<MAX_OPEN_FILES; fd++){
+		if(current_running->filedes[fd].idx == -1){
+			break;
+		}
+	}
+	//And a free open file to go with it, which is taken right away
+	int of;
+	for(of=0; of<OPEN_FILE_ENTRIES; of++){
+		if(open_file_table[of].refcount == 0){
+			break;
 		}
-		//printf("ERROR: Could not open file, no more space in file_descriptor_table\n");
+	}
+	if(fd == MAX_OPEN_FILES || of == OPEN_FILE_ENTRIES){
+		lock_release(&fd_lock);
+		//printf("ERROR: Could not open file, no more space in file descriptor table\n");
 		return FSE_NOMOREFDTE;
 	}
+	open_file_table[of].refcount = 1;
+	lock_release(&fd_lock);
+
+	//Creating or truncating the file is one operation
+	int op = (inode < 0 || (mode & MODE_TRUNC));
+	disk_inode_t freed;	//Blocks of a truncated file, freed after the operation
+	bzero((char*)&freed, sizeof(disk_inode_t));
+	if(op && block_journal_begin() < 0){
+		op = FALSE;
+		inode = FSE_ERROR;
+	}
+
 	//If "filename" does NOT exist, create new file of type "FILE"
-	else{
-		//Check if there is space in inode_table for new file
-		for(int i=0; i<BLOCK_SIZE/sizeof(disk_inode_t); i++){
-			if(inode_table[i].inode_num == -1){
-				//Check if there is space in file_descriptor_table for new file
-				for(int j=0; j<MAX_OPEN_FILES; j++){
-					if(file_descriptor_table[j].idx == -1){
-						//Check if there is space in current_running->datablock for new entry
-						dirent_t curr_run_datablock[DIRENTS_PER_BLK];
-						block_read(inode_table[current_running->cwd].d_inode.direct[0], &curr_run_datablock);
-						for(int k=0; k<DIRENTS_PER_BLK; k++){
-							if(curr_run_datablock[k].inode == -1){
-								//Create new inode
-								mem_inode_t new_inode;
-								new_inode.d_inode.type = INTYPE_FILE;
-								new_inode.d_inode.size = 0;
-								new_inode.d_inode.nlinks = 0;
-								new_inode.d_inode.direct[0] = get_free_entry((unsigned char*)dblk_bmap);
-								new_inode.open_count = 1;
-								new_inode.pos = 0;
-								new_inode.write_pos = 0;
-								new_inode.inode_num = get_free_entry((unsigned char*)inode_bmap);
-								new_inode.dirty = FALSE;
-
-								//Place new_inode in inode_table
-								inode_table[i] = new_inode;
-
-								//Increment current_running->d_inode.size
-								inode_table[current_running->cwd].d_inode.size += sizeof(dirent_t);
-								
-								//Update inode_table to disk
-								block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-
-								//Place new_inode in current_running->datablock
-								curr_run_datablock[k].inode = new_inode.inode_num;
-								strcpy(curr_run_datablock[k].name, filename);
-
-
-								//Update current_running->datablock to disk
-								block_write(inode_table[current_running->cwd].d_inode.direct[0], &curr_run_datablock);
-
-								//Place inode in file_descriptor_table
-								file_descriptor_table[j].idx = new_inode.inode_num;
-								file_descriptor_table[j].mode = mode;
-
-								return j;
-
-							}
-							if(k == DIRENTS_PER_BLK){
-								//printf("ERROR: No space in current_running->datablock for new entry\n");
-								return FSE_ADDDIR;
-							}
-						}
-					}
-					if(j == MAX_OPEN_FILES){
-						//printf("ERROR: No space in file_descriptor_table for new file\n");
-						return FSE_NOMOREFDTE;
-					}
-				}
+	if(inode < 0 && op){
+		inode_t cwd = current_running->cwd;
+		mem_inode_t *dir = ilock(cwd);
+
+		if(dir == NULL){
+			inode = FSE_INODETABLEFULL;
+		}
+		else{
+			//Someone may have created it since it was looked up
+			inode = dir_lookup(cwd, (char*)filename);
+			if(inode < 0){
+				inode = file_create(cwd, (char*)filename);
+				opened = (inode >= 0);
 			}
-			if(i == BLOCK_SIZE/sizeof(disk_inode_t)){
-				//printf("ERROR: No more space in inode_table for new file\n");
-				return FSE_NOMOREINODES;
+			iunlock(dir);
+		}
+	}
+	//If "filename" exists
+	if(inode >= 0 && !opened){
+		mem_inode_t *file = ilock(inode);
+
+		if(file == NULL){
+			inode = FSE_INODETABLEFULL;
+		}
+		//It may have been removed since it was looked up
+		else if(file->d_inode.type == 0){
+			inode = FSE_NOTEXIST;
+			iunlock(file);
+		}
+		else{
+			//Throw away old contents of a file opened with MODE_TRUNC
+			if((mode & MODE_TRUNC) && file->d_inode.type == INTYPE_FILE){
+				free_inode_blocks(file, &freed);
+				file->d_inode.flags = INODE_INLINE;
+				file->d_inode.size = 0;
+				file->dirty = TRUE;
+
+				//Update inode and bitmaps to disk
+				iupdate(file);
+				bitmap_update();
 			}
+
+			//Increment inode->open_count
+			file->open_count++;
+			iunlock(file);
 		}
 	}
+	if(op){
+		block_journal_end();
+	}
+	free_detached(&freed);
+
+	lock_acquire(&fd_lock);
+	if(inode < 0){
+		open_file_table[of].refcount = 0;
+	}
+	else{
+		//Place the new open file in the descriptor table
+		open_file_init(&open_file_table[of], inode, mode);
+		current_running->filedes[fd].idx = of;
+	}
+	lock_release(&fd_lock);
+
+	return (inode < 0) ? inode : fd;
 }
 
-/*Removes an inode at index "fd" in file_descriptor_table*/
+/*Removes descriptor "fd" from current_running's descriptor table. The
+ *open file goes away with the last descriptor or other reference to
+ *it (see fs_file_get())*/
 int fs_close(int fd)
 {
-	//Decrement inode->open_count at position "fd" in FD_table
-	inode_t inode = file_descriptor_table[fd].idx;
-	inode_table[inode].open_count--;
-	
-	//Remove inode from file_descriptor_table
-	file_descriptor_table[fd].idx = -1;
-	file_descriptor_table[fd].mode = MODE_UNUSED;
+	lock_acquire(&fd_lock);
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		lock_release(&fd_lock);
+		return FSE_INVALIDHANDLE;
+	}
+	current_running->filedes[fd].idx = -1;
+	lock_release(&fd_lock);
 
-	return FSE_OK;	
+	fs_file_put(f);
+	return FSE_OK;
 }
 
-/*Reads "size" number of bytes from position "inode.pos" from file "fd" into "buffer"*/
-int fs_read(int fd, char *buffer, int size)
+/*Returns the open file behind descriptor "fd" with a reference of its
+ *own, so that it stays open after fd is closed, until fs_file_put().
+ *Used by the I/O thread (see aio.c), which has no descriptors of the
+ *process. Returns NULL if fd is not an open descriptor*/
+open_file_t *fs_file_get(int fd)
 {
-	// //printf("\n..........FS_READ..........\n");
-	//Find out which inode we should read, from open files
-	inode_t inode_num = file_descriptor_table[fd].idx;
-
-	//Find out which type the inode is
-	int inode_type = inode_table[inode_num].d_inode.type;
-
-	//If inode is of type "DIRECTORY", read out dirents
-	if(inode_type == INTYPE_DIR){
-		//Read "size" number of bytes from inode->datablock into "buffer"
-		while(inode_table[inode_num].pos <= inode_table[inode_num].d_inode.size - sizeof(dirent_t)){ //BLOCK_SIZE - sizeof(dirent_t)){
-			block_read_part(inode_table[inode_num].d_inode.direct[0], inode_table[inode_num].pos, size, buffer);
-			inode_table[inode_num].pos += size;
-
-			return inode_table[inode_num].pos;
-		}
+	lock_acquire(&fd_lock);
+	open_file_t *f = fd2file(fd);
+	if(f != NULL){
+		f->refcount++;
+	}
+	lock_release(&fd_lock);
+	return f;
+}
 
-		//Reached end of file, reset inode->pos and return
-		inode_table[inode_num].pos = 0;
-		return FSE_OK;
+/*Lets go of a reference to open file "f". The open file goes away
+ *with the last reference*/
+void fs_file_put(open_file_t *f)
+{
+	lock_acquire(&fd_lock);
+	inode_t inode = f->ino;
+	int last = (--f->refcount == 0);
+	if(last){
+		f->mode = MODE_UNUSED;
+	}
+	lock_release(&fd_lock);
+	if(!last){
+		return;
 	}
-	if(inode_type == INTYPE_FILE){
-		//Read inode->datablock into memory
-		while(inode_table[inode_num].pos <= BLOCK_SIZE){
-			block_read_part(inode_table[inode_num].d_inode.direct[0], inode_table[inode_num].pos, size, buffer);
-			inode_table[inode_num].pos += size;
-			
-			return inode_table[inode_num].pos;
-		}
 
-		//Reached end of file, reset inode->pos and return
-		inode_table[inode_num].pos = 0;
-		return FSE_OK;
+	//Decrement inode->open_count of the file, give data written while
+	//it was open its blocks, and write back the inode if the file changed
+	int op = (block_journal_begin() == 0);
+	mem_inode_t *file = ilock(inode);
+	file->open_count--;
+	inode_flush(file);
+	iupdate(file);
+	iunlock(file);
+	bitmap_update();
+	if(op){
+		block_journal_end();
 	}
 
+	//Commit the metadata changed since the last commit to the journal,
+	//once the operations of other processes have ended. Many calls share
+	//one commit, and the changed blocks are written to their place on
+	//disk later
+	block_journal_commit();
 }
 
-/*Write "buffer" into "fd"->datablock*/
-int fs_write(int fd, char *buffer, int size)
+/*Reads "size" number of bytes from the offset of open file "fd" into "buffer"*/
+int fs_read(int fd, char *buffer, int size)
 {
-	//Find out which inode we should write to, from open files
-	inode_t inode = file_descriptor_table[fd].idx;
-
-	//Check if inode is of type "FILE"
-	if(inode_table[inode].d_inode.type == INTYPE_FILE){
-		if(inode_table[inode].d_inode.size <= (512*8) - size){
-
-			block_modify(inode_table[inode].d_inode.direct[0], inode_table[inode].write_pos, buffer, size);
-			inode_table[inode].write_pos += size;
-
-			//Increase inode->size
-			inode_table[inode].d_inode.size += size;
+	// //printf("\n..........FS_READ..........\n");
+	//Find out which inode we should read, from open files
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	if(MAPPED(buffer, size)){
+		return FSE_MAPPEDBUFFER;
+	}
+	return fs_file_read(f, buffer, size);
+}
 
-			//Update inode_table to disk
-			block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-			return FSE_OK;
+/*The part of fs_read() that reads from open file "f"*/
+int fs_file_read(open_file_t *f, char *buffer, int size)
+{
+	inode_t inode_num = f->ino;
+	mem_inode_t *inode = ilock(inode_num);
+	int ret = FSE_INVALIDINODE;
+
+	//If inode is of type "DIRECTORY", read out the next entry in use
+	if(inode->d_inode.type == INTYPE_DIR){
+		if(size < (int)sizeof(dirent_t)){
+			ret = FSE_ERROR;
+		}
+		else if(dir_readdir(inode_num, &f->pos, (dirent_t*)buffer)){
+			ret = sizeof(dirent_t);
 		}
 		else{
-			//printf("ERROR: No more space in file to write to\n");
-			return FSE_FULL;
+			//Reached end of directory, reset the offset and return
+			f->pos = 0;
+			ret = FSE_OK;
 		}
 	}
-	//If inode is of type "DIRECTORY", return error
-	else{
-		//printf("ERROR: Can not write to file of type: DIRECTORY\n");
-		return FSE_INVALIDMODE;
+	else if(inode->d_inode.type == INTYPE_FILE){
+		ret = file_read(f, inode, buffer, size);
 	}
+
+	iunlock(inode);
+	return ret;
 }
 
-/*This function is really incorrectly named, since neither its offset
- *argument or its return value are longs (or off_t's)*/
-int fs_lseek(int fd, int offset, int whence)
+/*Write "buffer" into "fd"->datablock*/
+int fs_write(int fd, char *buffer, int size)
 {
 	//Find out which inode we should write to, from open files
-	inode_t inode = file_descriptor_table[fd].idx;
-	
-	switch(whence){
-		case SEEK_SET:
-			inode_table[inode].pos = 0+offset;
-			break;
-	
-		case SEEK_CUR:
-			inode_table[inode].pos += offset;
-			break;
-		
-		case SEEK_END:
-			inode_table[inode].pos = superblock->d_super.max_filesize + offset;
-			break;
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
 	}
-	
-	return FSE_OK;
+	if(MAPPED(buffer, size)){
+		return FSE_MAPPEDBUFFER;
+	}
+	return fs_file_write(f, buffer, size);
 }
 
-/*Create new directory*/
-int fs_mkdir(char *dirname)
+/*The part of fs_write() that writes to open file "f"*/
+int fs_file_write(open_file_t *f, char *buffer, int size)
 {
-	//Create new inode
-	mem_inode_t new_inode;
-	new_inode.d_inode.type = INTYPE_DIR;
-	new_inode.d_inode.size = (sizeof(dirent_t) * 2);
-	new_inode.d_inode.nlinks = 0;
-	new_inode.d_inode.direct[0] = get_free_entry((unsigned char*)dblk_bmap);
-	new_inode.open_count = 0;
-	new_inode.pos = 0;
-	new_inode.write_pos = 0;
-	new_inode.inode_num = get_free_entry((unsigned char*)inode_bmap);
-	new_inode.dirty = FALSE;
-
-	//Loop through inode_table
-	for(int i=0; i<BLOCK_SIZE/sizeof(disk_inode_t); i++){
-		//If space in inode_table, place inode		
-		if(inode_table[i].inode_num == -1){
-			inode_table[i] = new_inode;
-			break;
-		}
-		//No space in inode_table, return error
-		if(i == BLOCK_SIZE/sizeof(disk_inode_t)){
-			//printf("ERROR: inode_table full\n");
-			return FSE_INODETABLEFULL;
-		}
-	}
-
-
-	//Update inode_table to disk
-	block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-
-
-
-	//Create array of dirents to put in new_inode->datablock
-	dirent_t new_dirents[DIRENTS_PER_BLK];
+	return write_ops(f, buffer, size);
+}
 
-	//Set all entries in dirents to available
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		new_dirents[i].inode = -1;
-		strcpy(new_dirents[i].name, "empty");
+/*Reads "size" bytes at "offset" in file "fd" into "buffer", without
+ *using or moving the offset of the open file. The read goes through a
+ *copy of the open file, so its read-ahead state is left alone too*/
+int fs_pread(int fd, char *buffer, int size, int offset)
+{
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	if(offset < 0 || offset > superblock->d_super.max_filesize){
+		return FSE_INVALIDOFFSET;
+	}
+	if(MAPPED(buffer, size)){
+		return FSE_MAPPEDBUFFER;
 	}
 
-	//Make dirents[0] point to root directory and dirents[1] point to current_running_cwd (parent directory)
-	strcpy(new_dirents[0].name, ".");
-	strcpy(new_dirents[1].name, "..");
-	new_dirents[0].inode = new_inode.inode_num;		//Points to itself 
-	new_dirents[1].inode = current_running->cwd;	//Point to parent directory
-
-	//Write dirents to new_inode->datablock
-	block_write(new_inode.d_inode.direct[0], &new_dirents);
+	mem_inode_t *inode = ilock(f->ino);
+	open_file_t copy;
+	int ret = FSE_INVALIDMODE;
 
+	if(inode->d_inode.type == INTYPE_FILE){
+		open_file_init(&copy, f->ino, f->mode);
+		copy.pos = offset;
+		ret = file_read(&copy, inode, buffer, size);
+	}
 
+	iunlock(inode);
+	return ret;
+}
 
+/*Writes "size" bytes from "buffer" at "offset" in file "fd", without
+ *using or moving the offset of the open file*/
+int fs_pwrite(int fd, char *buffer, int size, int offset)
+{
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	if(offset < 0 || offset > superblock->d_super.max_filesize){
+		return FSE_INVALIDOFFSET;
+	}
+	if(MAPPED(buffer, size)){
+		return FSE_MAPPEDBUFFER;
+	}
 
+	open_file_t copy;
 
-	//Increment number of inodes in superblock
-	superblock->d_super.ninodes++;
-	superblock->d_super.ndata_blks++;
-	//Update superblock to disk
-	block_write(superblock_datablock, &superblock->d_super);
+	open_file_init(&copy, f->ino, f->mode);
+	copy.pos = offset;
+	return write_ops(&copy, buffer, size);
+}
 
+/*System call entry points of fs_pread and fs_pwrite, which take one
+ *argument more than a trap passes. The buffer and its size come in iov*/
+int fs_pread_iov(int fd, struct fs_iovec *iov, int offset)
+{
+	return fs_pread(fd, iov->base, iov->len, offset);
+}
 
+int fs_pwrite_iov(int fd, struct fs_iovec *iov, int offset)
+{
+	return fs_pwrite(fd, iov->base, iov->len, offset);
+}
 
-	//Write current_running->datablock into memory
-	dirent_t curr_run_dirents[DIRENTS_PER_BLK];
-	int pos = 0;
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		block_read_part(inode_table[current_running->cwd].d_inode.direct[0], pos, sizeof(dirent_t), &curr_run_dirents[i]);
-		pos += sizeof(dirent_t);
+/*Reads the entries in use of directory "fd" into "buffer", as many
+ *whole dirent_t as fit in "size" bytes, starting at the entry slot in
+ **cookie (0 the first time). The entries all come from one dirent
+ *block, which is read with one cache access, and *cookie is moved to
+ *where the next call goes on. The offset of the open file is not used.
+ *Returns the number of bytes stored, 0 at the end of the directory*/
+int fs_getdents(int fd, char *buffer, int size, int *cookie)
+{
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
 	}
-	
-	//Check if current_running->datablock already has an identical filename
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-	 	if(same_string(curr_run_dirents[i].name, dirname) == 1){
-			//printf("ERROR: file already exists\n");
-			return FSE_EXIST;
-	 	}
+	if(size < (int)sizeof(dirent_t)){
+		return FSE_ERROR;
+	}
+	if(MAPPED(buffer, size) || MAPPED(cookie, sizeof(int))){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(*cookie < 0){
+		return FSE_INVALIDOFFSET;
 	}
-	
-
-
 
-	//IDENTICAL FILENAME DOES NOT EXIST
-	
-	//Loop through current_running->datablock
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		//If available space in datablock
-	 	if(curr_run_dirents[i].inode == -1){
-			//Place new_directory
-			curr_run_dirents[i].inode = new_inode.inode_num;
-			strcpy(curr_run_dirents[i].name, dirname);
+	mem_inode_t *inode = ilock(f->ino);
+	int ret = FSE_INVALIDMODE;
 
-			//Write curr_run_dirents back to current_running->datablock
-			block_write(inode_table[current_running->cwd].d_inode.direct[0], &curr_run_dirents);
+	if(inode->d_inode.type == INTYPE_DIR){
+		ret = dir_getdents(inode, (dirent_t*)buffer, size / sizeof(dirent_t), cookie) * sizeof(dirent_t);
+	}
 
-			//Increment current_running->d_inode.size
-			inode_table[current_running->cwd].d_inode.size += sizeof(dirent_t);
+	iunlock(inode);
+	return ret;
+}
 
-			//Update inode_table to disk
-			block_write(superblock->d_super.root_inode, &inode_table->d_inode);
+/*System call entry point of fs_getdents, with the buffer and its size
+ *in iov*/
+int fs_getdents_iov(int fd, struct fs_iovec *iov, int *cookie)
+{
+	return fs_getdents(fd, iov->base, iov->len, cookie);
+}
 
-			return FSE_OK;
-	 	}
+/*Writes everything the file system keeps in memory to the disk: data
+ *waiting for blocks, changed inodes and bitmaps, and all dirty blocks
+ *of the buffer cache, which are written in block order with adjacent
+ *blocks merged into one write. Called by the flush thread now and then*/
+int fs_sync(void)
+{
+	if(!fs_mounted){
+		return FSE_OK;
 	}
 
-	//Could not write new_directory to current_running->datablock
-	//printf("ERROR: could not add directory entry\n");
-	
-	return FSE_ADDDIR;
-}
+	for(int i=0; i<INODE_CACHE_ENTRIES; i++){
+		lock_acquire(&icache_lock);
+		inode_t ino = inode_table[i].inode_num;
+		lock_release(&icache_lock);
+		if(ino < 0){
+			continue;
+		}
 
-/*Changes current_running->cwd to another inode*/
-int fs_chdir(char *path)
-{	
-	//Read current_running->datablock into memory
-	dirent_t curr_run_dirents[DIRENTS_PER_BLK];
-	int pos = 0;
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		block_read_part(inode_table[current_running->cwd].d_inode.direct[0], pos, sizeof(dirent_t), &curr_run_dirents[i]);
-		
-		//Check if a dirent in current_running->dirents matches "path"
-		if(same_string(curr_run_dirents[i].name, path) == 1){
-			//Check if dirent is of type "DIRECTORY"
-			if(inode_table[curr_run_dirents[i].inode].d_inode.type == INTYPE_DIR){
-				current_running->cwd = curr_run_dirents[i].inode;
-				return FSE_OK;
-			}
-			else{
-				//printf("ERROR: Can not change directory to an inode of type 'FILE'\n");
-				return FSE_DIRISFILE;
+		//The inode may have been replaced or freed meanwhile, which is
+		//harmless. Each inode is flushed in an operation of its own
+		if(block_journal_begin() < 0){
+			return FSE_ERROR;
+		}
+		mem_inode_t *inode = ilock(ino);
+		if(inode != NULL){
+			if(inode->d_inode.type != 0){
+				inode_flush(inode);
+				iupdate(inode);
 			}
+			iunlock(inode);
 		}
-
-		pos += sizeof(dirent_t);
+		bitmap_update();
+		block_journal_end();
 	}
 
-	//COULD NOT CHANGE PATH
-	//printf("ERROR: could not change directory\n");
-	return FSE_INVALIDNAME;
+	return (block_flush() < 0) ? FSE_ERROR : FSE_OK;
 }
 
-/*Removes a directory entry from current_running->datablocks*/
-int fs_rmdir(char *path)
+/* Reports the size of the file system and how much of it is free. The
+ * free counts are kept in the superblock, so this does not look at the
+ * bitmaps.*/
+int fs_statfs(struct fs_statfs *st)
 {
-	//If user tries to remove directory entry "." or ".."
-	if((same_string(path, ".") == 1) | (same_string(path, "..") == 1)){
-		//printf("ERROR: Can not remove '.' and '..' directories\n");
-		return FSE_ERROR;
-	}
+	disk_superblock_t *sb = &superblock->d_super;
 
-	//Copy current_running->datablock into memory
-	dirent_t curr_run_datablock[DIRENTS_PER_BLK];
-	int pos = 0;
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		block_read_part(inode_table[current_running->cwd].d_inode.direct[0], pos, sizeof(dirent_t), &curr_run_datablock[i]);
-		pos += sizeof(dirent_t);
+	if(MAPPED(st, sizeof(struct fs_statfs))){
+		return FSE_MAPPEDBUFFER;
 	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+	lock_acquire(&alloc_lock);
+	st->block_size = BLOCK_SIZE;
+	st->blocks = sb->nblocks;
+	st->free_blocks = sb->free_blks;
+	st->inodes = NINODES;
+	st->free_inodes = sb->free_inodes;
+	st->groups = sb->ngroups;
+	st->group_blocks = sb->group_blocks;
+	lock_release(&alloc_lock);
+	return FSE_OK;
+}
 
-	
-	//Loop through current_running->datablock
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		//If matching filename is found in datablock
-		if(same_string(curr_run_datablock[i].name, path) == 1){
-			//if chosen directory is NOT empty, return error
-			if(inode_table[curr_run_datablock[i].inode].d_inode.size > sizeof(dirent_t) * 2){
-				//printf("ERROR: Can not remove directory that is not empty\n");
-				return FSE_DNOTEMPTY;
-			}
-
-			//If there are any links to the chosen directory
-			if(inode_table[curr_run_datablock[i].inode].d_inode.nlinks > 0){
-				//printf("ERROR: Can not remove directory. It has links to it\n");
-				return FSE_ERROR;
-			}
-
-			//If chosen directory is open
-			if(inode_table[curr_run_datablock[i].inode].open_count > 0){
-				//printf("ERROR: Can not remove directory that is open\n");
-				return FSE_FILEOPEN;
-			}
-
-			//If chosen inode is not of type directory, return error
-			if(inode_table[curr_run_datablock[i].inode].d_inode.type != INTYPE_DIR){
-				//printf("ERROR: Can not remove directory. It is of type: file\n");
-				return FSE_DIRISFILE;
-			}
+/*Closes every file current_running has open. Called when a process exits*/
+void fs_exit(void)
+{
+	for(int fd=0; fd<MAX_OPEN_FILES; fd++){
+		if(fd2file(fd) != NULL){
+			fs_close(fd);
+		}
+	}
+}
 
-			//PASSED ALL CHECKS, REMOVE DIRECTORY
+/*Returns the file behind descriptor "fd" for fs_mmap() in memory.c, and
+ *keeps it open for the mapping until fs_map_put(), also after fd is
+ *closed. *writable tells if fd was opened for writing*/
+inode_t fs_map_get(int fd, int *writable)
+{
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	mem_inode_t *inode = ilock(f->ino);
+	inode_t ret = f->ino;
 
-			//Free datablock used by the directory_entry->inode
-			free_bitmap_entry(inode_table[curr_run_datablock[i].inode].d_inode.direct[0], (unsigned char*)dblk_bmap);
-			free_bitmap_entry(inode_table[curr_run_datablock[i].inode].inode_num, (unsigned char*)inode_bmap);
+	//Only files can be mapped
+	if(inode->d_inode.type != INTYPE_FILE){
+		ret = FSE_INVALIDMODE;
+	}
+	else{
+		inode->open_count++;
+		*writable = ((f->mode & (MODE_WRONLY | MODE_RDWR)) != 0);
+	}
 
-			//Remove directory entry from datablock
-			curr_run_datablock[i].inode = -1;
-			strcpy(curr_run_datablock[i].name, "empty");
+	iunlock(inode);
+	return ret;
+}
 
+/*Lets go of a file kept open by fs_map_get(), like fs_close() does
+ *with the last descriptor of a file*/
+void fs_map_put(inode_t ino)
+{
+	int op = (block_journal_begin() == 0);
+	mem_inode_t *file = ilock(ino);
+	file->open_count--;
+	inode_flush(file);
+	iupdate(file);
+	iunlock(file);
+	bitmap_update();
+	if(op){
+		block_journal_end();
+	}
+	block_journal_commit();
+}
 
-			//Decrease size of parent directory
-			inode_table[curr_run_datablock[i].inode].d_inode.size -= sizeof(dirent_t);
-			if(inode_table[curr_run_datablock[i].inode].d_inode.size < 0){
-				inode_table[curr_run_datablock[i].inode].d_inode.size = 0;
-			}
+/*Reads "size" bytes at "offset" in mapped file "ino" into "buffer", a
+ *page of memory. Nothing is stored past end of file.
+ *Returns the number of bytes read*/
+int fs_map_read(inode_t ino, int offset, char *buffer, int size)
+{
+	mem_inode_t *inode = ilock(ino);
+	open_file_t f;
+	int ret = FSE_NOTEXIST;
+
+	if(inode->d_inode.type == INTYPE_FILE){
+		open_file_init(&f, ino, MODE_RDONLY);
+		f.pos = offset;
+		ret = file_read(&f, inode, buffer, size);
+	}
 
+	iunlock(inode);
+	return ret;
+}
 
-			//Write current_running->datablock back to disk
-			block_write(inode_table[current_running->cwd].d_inode.direct[0], &curr_run_datablock);
+/*Writes a changed page of mapped file "ino" back to the file, through
+ *the buffer cache like fs_write(). Only the part before end of file is
+ *written, since a mapping does not make the file grow.
+ *Returns the number of bytes written*/
+int fs_map_write(inode_t ino, int offset, char *buffer, int size)
+{
+	if(block_journal_begin() < 0){
+		return FSE_ERROR;
+	}
+	mem_inode_t *inode = ilock(ino);
+	open_file_t f;
+	int ret = FSE_NOTEXIST;
 
-			return FSE_OK;
+	if(inode->d_inode.type == INTYPE_FILE){
+		if(size > inode->d_inode.size - offset){
+			size = inode->d_inode.size - offset;
 		}
+		open_file_init(&f, ino, MODE_RDWR);
+		f.pos = offset;
+		ret = file_write(&f, inode, buffer, size);
+		iupdate(inode);
 	}
 
-	//printf("ERROR: Can not remove directory that does no exist\n");
-	return FSE_NOTEXIST;
+	iunlock(inode);
+	block_journal_end();
+	return ret;
 }
 
-/*Makes a copy with name "filename" and set its inode to the same inode as "linkname"*/
-int fs_link(char *linkname, char *filename)
+/*Reads from "fd" into the iovcnt buffers in "iov", filling each one
+ *before moving on to the next, like one fs_read into a buffer made of
+ *the pieces. Stops early at end of file.
+ *Returns the number of bytes read, or an error if nothing was read*/
+int fs_readv(int fd, struct fs_iovec *iov, int iovcnt)
 {
-	int linkname_inode = name2inode(linkname);
-	int filename_inode = name2inode(filename);
-
-	//If file "linkname" exists
-	if(linkname_inode >= 0){
-		//If "filename" does NOT exist
-		if(filename_inode == -1){
-			
-			dirent_t dirent;
-			int pos = 0;
-			for(int i=0; i<DIRENTS_PER_BLK; i++){
-				block_read_part(inode_table[current_running->cwd].d_inode.direct[0], pos, sizeof(dirent_t), &dirent);
-
-				//If there is space in datablock for new entry
-				if(dirent.inode == -1){
-					//Set new filename but same inode
-					strcpy(dirent.name, filename);
-					dirent.inode = linkname_inode;
+	int total = 0;
 
-					//Update "linkname"->link_count
-					inode_table[linkname_inode].d_inode.nlinks++;
-
-					//Update inode_table to disk
-					block_write(superblock->d_super.root_inode, &inode_table->d_inode);
-
-					//Update parent_directory->size
-					inode_table[current_running->cwd].d_inode.size += (sizeof(dirent_t));
-
-					//Update linkname->datablock to disk
-					block_modify(inode_table[current_running->cwd].d_inode.direct[0], pos, &dirent, sizeof(dirent_t));
-		
-					return FSE_OK;
-				}
-			
-				pos += sizeof(dirent_t);
-			}
+	for(int i=0; i<iovcnt; i++){
+		int n = fs_read(fd, iov[i].base, iov[i].len);
+		if(n < 0){
+			return (total > 0) ? total : n;
 		}
-		else{
-			//printf("ERROR: Can not link a file to another file that already exists.\n");
-			return FSE_EXIST;
+		total += n;
+		if(n < iov[i].len){
+			break;
 		}
 	}
-	else{
-		//printf("ERROR: Can not link to a file that does not exist.\n");
-		return FSE_NOTEXIST;
-	}
+	return total;
 }
 
-/*Removes a link or deletes a file if linkcount == 0*/
-int fs_unlink(char *linkname) {
-	//printf("\n..........FS_UNLINK..........\n");
+/*Writes the iovcnt buffers in "iov" to "fd", one after the other.
+ *Returns the number of bytes written, or an error if nothing was written*/
+int fs_writev(int fd, struct fs_iovec *iov, int iovcnt)
+{
+	int total = 0;
 
-	//If user tries to remove/unlink directory entry "." or ".."
-	if((same_string(linkname, ".") == 1) | (same_string(linkname, "..") == 1)){
-		//printf("ERROR: Can not remove '.' and '..' directories\n");
-		return FSE_ERROR;
+	for(int i=0; i<iovcnt; i++){
+		int n = fs_write(fd, iov[i].base, iov[i].len);
+		if(n < 0){
+			return (total > 0) ? total : n;
+		}
+		total += n;
+	}
+	return total;
+}
+
+/*This function is really incorrectly named, since neither its offset
+ *argument or its return value are longs (or off_t's)*/
+int fs_lseek(int fd, int offset, int whence)
+{
+	//Find out which open file to move the offset of
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	
+	switch(whence){
+		case SEEK_SET:
+			f->pos = 0+offset;
+			break;
+	
+		case SEEK_CUR:
+			f->pos += offset;
+			break;
+		
+		case SEEK_END:{
+			mem_inode_t *inode = ilock(f->ino);
+			f->pos = inode->d_inode.size + offset;
+			iunlock(inode);
+			break;
+		}
+	}
+
+	if(f->pos < 0 || f->pos > superblock->d_super.max_filesize){
+		f->pos = 0;
+		return FSE_INVALIDOFFSET;
+	}
+
+	//A seek ends any stream, read-ahead starts over from the new position
+	f->ra_pos = f->pos;
+	f->ra_next = 0;
+	f->ra_end = 0;
+	f->ra_window = 0;
+	
+	return FSE_OK;
+}
+
+/*Create new directory*/
+int fs_mkdir(char *dirname)
+{
+	inode_t parent = current_running->cwd;
+
+	if(MAPPED(dirname, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+	if(strlen(dirname) >= MAX_FILENAME_LEN){
+		return FSE_NAMETOLONG;
+	}
+
+	if(block_journal_begin() < 0){
+		return FSE_ERROR;
+	}
+
+	//Check if current directory already has an identical filename
+	mem_inode_t *dir = ilock(parent);
+	if(dir == NULL){
+		block_journal_end();
+		return FSE_INODETABLEFULL;
+	}
+	if(dir_lookup(parent, dirname) >= 0){
+		iunlock(dir);
+		block_journal_end();
+		//printf("ERROR: file already exists\n");
+		return FSE_EXIST;
+	}
+
+	//Spread directories over the allocation groups, with the inode and
+	//the first block of each in the group with the most free blocks
+	int group = emptiest_group();
+	inode_t ino = alloc_inode(group * NINODES / superblock->d_super.ngroups);
+	if(ino < 0){
+		iunlock(dir);
+		block_journal_end();
+		//printf("ERROR: inode_table full\n");
+		return FSE_INODETABLEFULL;
+	}
+
+	//Create new inode
+	mem_inode_t *new_inode = ilock(ino);
+	if(new_inode == NULL){
+		free_bitmap_entry(ino, inode_bmap, NINODES);
+		iunlock(dir);
+		block_journal_end();
+		return FSE_INODETABLEFULL;
+	}
+	new_inode->d_inode.type = INTYPE_DIR;
+	new_inode->d_inode.size = 0;
+	new_inode->d_inode.nlinks = 0;
+	clear_block_pointers(&new_inode->d_inode);
+	new_inode->open_count = 0;
+	new_inode->dirty = TRUE;
+
+	//Place the directory block in the same group. Block 0 of group 0 is
+	//the super block, so the search starts past it (a goal of 0 means
+	//no goal)
+	extent_t extent;
+	int ev = FSE_FULL;
+	if(alloc_data_blocks(group * superblock->d_super.group_blocks + 1, 1, &extent) > 0){
+		new_inode->d_inode.direct[0] = extent.start;
+
+		//Create the directory with entries "." pointing to itself and ".." pointing to parent directory
+		ev = dir_init(ino, parent);
+	}
+	//Place new directory in parent directory
+	if(ev >= 0){
+		ev = dir_add(parent, dirname, ino);
+	}
+
+	if(ev < 0){
+		//printf("ERROR: could not add directory entry\n");
+		free_inode_blocks(new_inode, NULL);
+		free_inode(ino);
+	}
+	else{
+		dcache_invalidate(parent, dirname);
+
+		//Update the new directory and parent directory inodes to disk
+		iupdate(new_inode);
+		iupdate(dir);
+	}
+	iunlock(new_inode);
+	iunlock(dir);
+	bitmap_update();
+	block_journal_end();
+
+	return (ev < 0) ? ev : FSE_OK;
+}
+
+/*Changes current_running->cwd to another inode*/
+int fs_chdir(char *path)
+{
+	if(MAPPED(path, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+	inode_t inode = name2inode(path);
+
+	if(inode < 0){
+		//printf("ERROR: could not change directory\n");
+		return (inode == FSE_INODETABLEFULL) ? inode : FSE_INVALIDNAME;
+	}
+
+	//Check if inode is of type "DIRECTORY"
+	mem_inode_t *dir = ilock(inode);
+	if(dir == NULL){
+		return FSE_INODETABLEFULL;
+	}
+	int type = dir->d_inode.type;
+	iunlock(dir);
+	if(type != INTYPE_DIR){
+		//printf("ERROR: Can not change directory to an inode of type 'FILE'\n");
+		return FSE_DIRISFILE;
+	}
+
+	current_running->cwd = inode;
+	return FSE_OK;
+}
+
+/*Removes a directory entry from current_running->datablocks*/
+int fs_rmdir(char *path)
+{
+	inode_t cwd = current_running->cwd;
+	mem_inode_t *dir, *child;
+	int ev = FSE_OK;
+
+	if(MAPPED(path, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+
+	//If user tries to remove directory entry "." or ".."
+	if((same_string(path, ".") == 1) | (same_string(path, "..") == 1)){
+		//printf("ERROR: Can not remove '.' and '..' directories\n");
+		return FSE_ERROR;
+	}
+
+	disk_inode_t freed;	//Blocks of the directory, freed after the operation
+	bzero((char*)&freed, sizeof(disk_inode_t));
+	if(block_journal_begin() < 0){
+		return FSE_ERROR;
+	}
+	inode_t inode = lock_entry(cwd, path, &dir, &child);
+	if(inode < 0){
+		block_journal_end();
+		//printf("ERROR: Can not remove directory that does no exist\n");
+		return (inode == FSE_INODETABLEFULL) ? inode : FSE_NOTEXIST;
+	}
+
+	//If chosen inode is not of type directory, return error
+	if(child->d_inode.type != INTYPE_DIR){
+		//printf("ERROR: Can not remove directory. It is of type: file\n");
+		ev = FSE_DIRISFILE;
+	}
+	//if chosen directory is NOT empty, return error
+	else if(child->d_inode.size > (int)sizeof(dirent_t) * 2){
+		//printf("ERROR: Can not remove directory that is not empty\n");
+		ev = FSE_DNOTEMPTY;
+	}
+	//If there are any links to the chosen directory
+	else if(child->d_inode.nlinks > 0){
+		//printf("ERROR: Can not remove directory. It has links to it\n");
+		ev = FSE_ERROR;
+	}
+	//If chosen directory is open
+	else if(child->open_count > 0){
+		//printf("ERROR: Can not remove directory that is open\n");
+		ev = FSE_FILEOPEN;
+	}
+	//PASSED ALL CHECKS, REMOVE DIRECTORY
+	else{
+		//Remove directory entry from parent directory
+		dir_remove(cwd, path);
+		dcache_invalidate(cwd, path);
+
+		//Free datablocks and inode used by the directory
+		free_inode_blocks(child, &freed);
+		free_inode(inode);
+
+		//Update parent directory inode to disk
+		iupdate(dir);
+	}
+	iunlock2(dir, child);
+
+	//Update bitmaps to disk
+	if(ev == FSE_OK){
+		bitmap_update();
+	}
+	block_journal_end();
+	free_detached(&freed);
+	return ev;
+}
+
+/*Makes a copy with name "filename" and set its inode to the same inode as "linkname"*/
+int fs_link(char *linkname, char *filename)
+{
+	if(MAPPED(linkname, MAX_PATH_LEN) || MAPPED(filename, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+	inode_t cwd = current_running->cwd;
+	int linkname_inode = name2inode(linkname);
+	int filename_inode = name2inode(filename);
+
+	if(linkname_inode == FSE_INODETABLEFULL || filename_inode == FSE_INODETABLEFULL){
+		return FSE_INODETABLEFULL;
+	}
+
+	//If file "linkname" does not exist
+	if(linkname_inode < 0){
+		//printf("ERROR: Can not link to a file that does not exist.\n");
+		return FSE_NOTEXIST;
+	}
+
+	//If "filename" already exists
+	if(filename_inode >= 0){
+		//printf("ERROR: Can not link a file to another file that already exists.\n");
+		return FSE_EXIST;
+	}
+
+	//"linkname" may be a parent of the current directory
+	mem_inode_t *dir, *file;
+	if(block_journal_begin() < 0){
+		return FSE_ERROR;
+	}
+	if(ilock2(cwd, linkname_inode, &dir, &file) < 0){
+		block_journal_end();
+		return FSE_INODETABLEFULL;
+	}
+
+	//Both names may have changed since they were looked up
+	int ev;
+	if(file->d_inode.type == 0){
+		ev = FSE_NOTEXIST;
+	}
+	else if(dir_lookup(cwd, filename) >= 0){
+		ev = FSE_EXIST;
+	}
+	//Set new filename but same inode
+	else{
+		ev = dir_add(cwd, filename, linkname_inode);
+	}
+
+	if(ev == FSE_OK){
+		dcache_invalidate(cwd, filename);
+
+		//Update "linkname"->link_count
+		file->d_inode.nlinks++;
+		file->dirty = TRUE;
+
+		//Update the inodes to disk
+		iupdate(file);
+		iupdate(dir);
+	}
+	iunlock2(dir, file);
+
+	//Update the bitmaps to disk (dir_add may have needed a new
+	//directory block)
+	bitmap_update();
+	block_journal_end();
+
+	return ev;
+}
+
+/*Removes a link or deletes a file if linkcount == 0. An open file is
+ *not deleted, FSE_FILEOPEN is returned like fs_rmdir() does*/
+int fs_unlink(char *linkname) {
+	inode_t cwd = current_running->cwd;
+	mem_inode_t *dir, *file;
+
+	if(MAPPED(linkname, MAX_PATH_LEN)){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+
+	//If user tries to remove/unlink directory entry "." or ".."
+	if((same_string(linkname, ".") == 1) | (same_string(linkname, "..") == 1)){
+		//printf("ERROR: Can not remove '.' and '..' directories\n");
+		return FSE_ERROR;
 	}
 	
-	//Check if "linkname" exists
-	inode_t inode = name2inode(linkname);
-	//printf("	Name2inode found inode num: %d\n", inode);
-
-	if(inode >= 0){
-			//Loop through current_running->datablock
-		dirent_t dirent;
-		int pos = 0;
-		for(int i=0; i<DIRENTS_PER_BLK; i++){
-			block_read_part(inode_table[current_running->cwd].d_inode.direct[0], pos, sizeof(dirent_t), &dirent);
-
-			//Delete directory entry and inode if linkname is found
-			if(same_string(dirent.name, linkname) == 1){
-				//printf("Found matching dirent\n");
-				strcpy(dirent.name, "empty");
-				dirent.inode = -1;
-
-				//Modify current_running->datablock on disk
-				block_modify(inode_table[current_running->cwd].d_inode.direct[0], pos, &dirent, sizeof(dirent_t));
-
-				//If inode->nlinks == 0, delete inode and datablock for linkname
-				if(inode_table[inode].d_inode.nlinks == 0){
-					//printf("Links to inode is ZERO\n");
-
-					//Delete linkname->inode and datablock
-					free_bitmap_entry(inode_table[inode].d_inode.direct[0], (unsigned char*)dblk_bmap);
-					free_bitmap_entry(inode_table[inode].inode_num, (unsigned char*)inode_bmap);
+	disk_inode_t freed;	//Blocks of the file, freed after the operation
+	bzero((char*)&freed, sizeof(disk_inode_t));
+	if(block_journal_begin() < 0){
+		return FSE_ERROR;
+	}
+	inode_t inode = lock_entry(cwd, linkname, &dir, &file);
+	if(inode < 0){
+		block_journal_end();
+		//printf("ERROR: unlink name does not exist.\n");
+		return (inode == FSE_INODETABLEFULL) ? inode : FSE_DENOTFOUND;
+	}
+
+	//The last link of an open file can not be removed, since the open
+	//file still uses the inode and its blocks
+	if(file->d_inode.nlinks == 0 && file->open_count > 0){
+		iunlock2(dir, file);
+		block_journal_end();
+		return FSE_FILEOPEN;
+	}
+
+	//Delete directory entry for linkname from current directory
+	dir_remove(cwd, linkname);
+	dcache_invalidate(cwd, linkname);
+
+	//If inode->nlinks == 0, delete inode and datablocks for linkname
+	if(file->d_inode.nlinks == 0){
+		free_inode_blocks(file, &freed);
+		free_inode(inode);
+	}
+	//If linkname has some links to it, decrement linkname->nlinks
+	else{
+		file->d_inode.nlinks--;
+		file->dirty = TRUE;
+		iupdate(file);
+	}
+
+	//Update current directory inode and bitmaps to disk
+	iupdate(dir);
+	iunlock2(dir, file);
+	bitmap_update();
+	block_journal_end();
+	free_detached(&freed);
+
+	return FSE_OK;
+}
+
+/*Prints a files: filename, type, nlinks and size, followed by the
+ *dentry cache hits and misses*/
+int fs_stat(int fd, char *buffer)
+{
+	//Find inode number of open file "fd"
+	open_file_t *f = fd2file(fd);
+	if(f == NULL){
+		return FSE_INVALIDHANDLE;
+	}
+	if(MAPPED(buffer, STAT_SIZE)){
+		return FSE_MAPPEDBUFFER;
+	}
+	mem_inode_t *inode = ilock(f->ino);
+
+	//Load contents of inode into buffer
+	buffer[0] = inode->d_inode.type;
+	buffer[1] = inode->d_inode.nlinks;
+	int size = inode->d_inode.size;
+	bcopy((char*)&size, &buffer[2], sizeof(int));
+	iunlock(inode);
+
+	//Followed by the dentry cache hit and miss counters
+	struct dcache_stat dstat;
+	dcache_stat(&dstat);
+	bcopy((char*)&dstat.hits, &buffer[6], sizeof(int));
+	bcopy((char*)&dstat.misses, &buffer[10], sizeof(int));
+
+	//And the read-ahead window and hits of this open file
+	bcopy((char*)&f->ra_window, &buffer[14], sizeof(int));
+	bcopy((char*)&f->ra_hits, &buffer[18], sizeof(int));
+
+	return FSE_OK;
+}
+
+/*Checks the consistency of the file system, and repairs it if
+ *"repair" is TRUE. The inode area is read with large sequential reads,
+ *and every directory is read once. What is found is kept in compact
+ *tables (fsck_links, fsck_type, fsck_dblk) which are then compared
+ *with nlinks, directory sizes and the bitmaps, so the time taken grows
+ *with the metadata in use. The block pointers of every inode are
+ *followed once, marking the blocks in use in fsck_dblk, which has a
+ *bit for every block. Inodes are locked one at a time, so changes
+ *made by other processes while it runs may be reported.
+ *Fills in "st" and returns the number of problems found*/
+int fs_fsck(int repair, struct fsck_stat *st)
+{
+	uint64_t start = get_timer();
+	disk_superblock_t *sb = &superblock->d_super;
+
+	if(MAPPED(st, sizeof(struct fsck_stat))){
+		return FSE_MAPPEDBUFFER;
+	}
+	if(!fs_mounted){
+		return FSE_NOTMOUNTED;
+	}
+	lock_acquire(&fsck_lock);
+	bzero((char*)st, sizeof(struct fsck_stat));
+	bzero((char*)fsck_links, sb->ninodes * sizeof(short));
+
+	//Repairs can be more than one operation holds. They are made with
+	//the journal to fs_fsck alone, and committed as they go (fsck_step())
+	if(repair){
+		block_journal_lock();
+	}
+
+	//Check what is on disk, so write back inodes changed in memory first
+	for(int i=0; i<INODE_CACHE_ENTRIES; i++){
+		inode_t ino = inode_table[i].inode_num;
+		if(ino >= 0 && block_journal_begin() == 0){
+			//An inode that was thrown out meanwhile has been written back
+			mem_inode_t *inode = ilock(ino);
+			if(inode != NULL){
+				iupdate(inode);
+				iunlock(inode);
+			}
+			block_journal_end();
+		}
+	}
+
+	//Read the inode area, BCACHE_PREFETCH_MAX blocks per device read, and
+	//note the type of every inode
+	for(int b=0; b<sb->inode_blocks; b+=BCACHE_PREFETCH_MAX){
+		int n = sb->inode_blocks - b;
+		block_prefetch(sb->inode_start + b, (n < BCACHE_PREFETCH_MAX) ? n : BCACHE_PREFETCH_MAX);
+	}
+	for(int b=0; b<sb->inode_blocks; b++){
+		for(int i=0; i<INODES_PER_BLK && b * INODES_PER_BLK + i < NINODES; i++){
+			disk_inode_t d_inode;
+
+			block_read_part(sb->inode_start + b, i * sizeof(disk_inode_t), sizeof(disk_inode_t), &d_inode);
+			int type = d_inode.type;
+			fsck_type[b * INODES_PER_BLK + i] = (type == INTYPE_FILE || type == INTYPE_DIR) ? type : 0;
+		}
+	}
+
+	//Count the directory entries referring to each inode. The check
+	//stops if an inode can not be cached
+	if(fsck_dirs(repair, st) < 0){
+		if(repair){
+			block_journal_unlock();
+		}
+		lock_release(&fsck_lock);
+		return FSE_INODETABLEFULL;
+	}
+
+	//The superblock, bitmap blocks, inode area and journal are in use
+	bzero((char*)fsck_dblk, (sb->nblocks + 31) / 32 * sizeof(uint32_t));
+	for(blknum_t b=0; b<sb->dbmap_start + sb->dbmap_blocks; b++){
+		fsck_claim(b, st);
+	}
+
+	//Check the link count of every inode in use, and mark its blocks
+	for(inode_t ino=0; ino<NINODES; ino++){
+		if(fsck_type[ino] == 0){
+			continue;
+		}
+		mem_inode_t *inode = ilock(ino);
+		if(inode == NULL){
+			if(repair){
+				block_journal_unlock();
+			}
+			lock_release(&fsck_lock);
+			return FSE_INODETABLEFULL;
+		}
+
+		//The root directory has no entry in a parent directory
+		int links = fsck_links[ino] + ((ino == 0) ? 1 : 0);
+		if(links == 0){
+			st->orphans++;
+			if(repair && inode->open_count == 0){
+				disk_inode_t freed;
+				bzero((char*)&freed, sizeof(disk_inode_t));
+				free_inode_blocks(inode, &freed);
+				free_inode(ino);
+				iunlock(inode);
+				fsck_step(repair);
+				free_detached(&freed);
+				fsck_type[ino] = 0;
+				continue;
+			}
+		}
+		else if(inode->d_inode.nlinks != links - 1){
+			st->bad_links++;
+			if(repair){
+				inode->d_inode.nlinks = links - 1;
+				inode->dirty = TRUE;
+			}
+		}
+
+		st->inodes++;
+		//A small file has data, not block pointers, in the inode
+		if((inode->d_inode.flags & INODE_INLINE) && inode->d_inode.size > INODE_INLINE_MAX){
+			st->bad_sizes++;
+			if(repair){
+				inode->d_inode.size = INODE_INLINE_MAX;
+				inode->dirty = TRUE;
+				iupdate(inode);
+			}
+		}
+		if(!(inode->d_inode.flags & INODE_INLINE)){
+			fsck_mark_blocks(inode, repair, st);
+		}
+		iunlock(inode);
+		fsck_step(repair);
+	}
+
+	//Compare the blocks found in use with the data block bitmap, and
+	//the free blocks in each allocation group with the superblock
+	blknum_t free_blks = 0;
+	for(int group=0; group<sb->ngroups; group++){
+		free_blks += fsck_group(group, repair, st);
+		fsck_step(repair);
+	}
+
+	//Compare with the inode bitmap, and the free counts in the superblock
+	lock_acquire(&alloc_lock);
+	int free_inodes = 0;
+	for(inode_t ino=0; ino<NINODES; ino++){
+		int used = (inode_bmap[ino / 32] & MASK(ino % 32)) != 0;
+		if(used != (fsck_type[ino] != 0)){
+			st->bad_ibmap++;
+			if(repair){
+				inode_bmap[ino / 32] ^= MASK(ino % 32);
+				used = !used;
+				superblock->dirty = TRUE;
+			}
+		}
+		free_inodes += !used;
+	}
+	if(sb->free_inodes != free_inodes){
+		st->bad_counts++;
+	}
+	if(sb->free_blks != free_blks){
+		st->bad_counts++;
+	}
+	if(repair && (sb->free_inodes != free_inodes || sb->free_blks != free_blks)){
+		sb->free_inodes = free_inodes;
+		sb->free_blks = free_blks;
+		superblock->dirty = TRUE;
+	}
+	lock_release(&alloc_lock);
+
+	int problems = st->bad_entries + st->bad_sizes + st->bad_links + st->orphans +
+	               st->bad_pointers + st->bad_ibmap + st->bad_dbmap + st->bad_counts;
+	if(repair && problems > 0){
+		bitmap_update();
+		block_journal_commit();
+		st->repaired = TRUE;
+	}
+	if(repair){
+		block_journal_unlock();
+	}
+	lock_release(&fsck_lock);
+
+	st->tsc = get_timer() - start;
+	return problems;
+}
+
+/*
+ * Helper functions for the system calls
+ */
+
+/* Returns the index of the least significant set bit in word, which
+ * must not be 0. Uses the bit scan instruction, so a whole word of
+ * bitmap entries is examined at once.*/
+static inline int bit_scan_forward(uint32_t word) {
+	int bit;
+
+	asm("bsfl %1, %0" : "=r"(bit) : "rm"(word));
+	return bit;
+}
+
+/* Search the given bitmap for the first zero bit at or after goal
+ * (wrapping around the end).  If an entry is found it is set to one
+ * and the entry number is returned.  Returns -1 if all entrys in the
+ * bitmap are set.
+ *
+ * Entry n is bit n % 32 of word n / 32 in the bitmap.
+*/
+static int get_free_entry(uint32_t *bitmap, int nentries, int goal) {
+	extent_t extent;
+	int count;
+
+	lock_acquire(&alloc_lock);
+	count = alloc_extent(bitmap, nentries, goal, 1, &extent);
+	if (count > 0 && bitmap == inode_bmap)
+		superblock->d_super.free_inodes--;
+	lock_release(&alloc_lock);
+
+	if (count == 0)
+		return -1;
+	return extent.start;
+}
+
+/* Free a bitmap entry, if the entry is not found -1 is returned, otherwise zero.
+ * Note that this function does not check if the bitmap entry was used (freeing
+ * an unused entry has no effect).
+ */
+static int free_bitmap_entry(int entry, uint32_t *bitmap, int nentries) {
+	if (entry < 0 || entry >= nentries)
+		return -1;
+
+	lock_acquire(&alloc_lock);
+	if (bitmap[entry / 32] & (1u << (entry % 32))) {
+		bitmap[entry / 32] &= ~(1u << (entry % 32));
+		if (bitmap == inode_bmap)
+			superblock->d_super.free_inodes++;
+		superblock->dirty = TRUE;
+	}
+	lock_release(&alloc_lock);
+	return 0;
+}
+
+/* Returns the number of free entries in the run starting at entry,
+ * counting at most max of them. Whole free words are skipped 32
+ * entries at a time.*/
+static int free_run_length(uint32_t *bitmap, int nentries, int entry, int max) {
+	int len = 0;
+
+	while (len < max && entry + len < nentries) {
+		int e = entry + len;
+		uint32_t used = bitmap[e / 32] >> (e % 32);
+
+		if (used != 0) {
+			/* The run ends at the first used entry in this word */
+			len += bit_scan_forward(used);
+			break;
+		}
+		len += 32 - (e % 32);
+	}
+
+	if (len > max)
+		len = max;
+	if (len > nentries - entry)
+		len = nentries - entry;
+	return len;
+}
+
+/* Allocates a run of up to want contiguous entries in bitmap. The
+ * search starts at goal and wraps around the end of the bitmap. The
+ * first run of want free entries is taken; if there is none, the
+ * longest run found is taken instead. The allocated run is stored in
+ * *extent and its length is returned (0 if the bitmap is full).
+ * Called with alloc_lock held.*/
+static int alloc_extent(uint32_t *bitmap, int nentries, int goal, int want, extent_t *extent) {
+	int best_start = -1, best_len = 0;
+	int entry, scanned;
+
+	if (goal < 0 || goal >= nentries)
+		goal = 0;
+	if (want < 1)
+		want = 1;
+
+	entry = goal;
+	scanned = 0;
+	while (scanned < nentries) {
+		/* Free entries in this word, at or after entry */
+		uint32_t free = ~bitmap[entry / 32] & (~0u << (entry % 32));
+		int start, len;
+
+		if (free == 0) {
+			/* Rest of the word is taken, move on to the next word */
+			scanned += 32 - (entry % 32);
+			entry = (entry & ~31) + 32;
+			if (entry >= nentries)
+				entry = 0;
+			continue;
+		}
+
+		start = (entry & ~31) + bit_scan_forward(free);
+		if (start >= nentries) {
+			/* Only bits past the end of the bitmap are left */
+			scanned += nentries - entry;
+			entry = 0;
+			continue;
+		}
+		len = free_run_length(bitmap, nentries, start, want);
+		if (len > best_len) {
+			best_start = start;
+			best_len = len;
+			if (len == want)
+				break;
+		}
+
+		scanned += (start - entry) + len;
+		entry = start + len;
+		if (entry >= nentries)
+			entry = 0;
+	}
+
+	if (best_len == 0)
+		return 0;
+
+	for (entry = best_start; entry < best_start + best_len; entry++)
+		bitmap[entry / 32] |= 1u << (entry % 32);
+	superblock->dirty = TRUE;
+
+	extent->start = best_start;
+	extent->count = best_len;
+	return best_len;
+}
+
+/* Allocates up to want contiguous data blocks, preferably starting at
+ * block goal. With no goal (goal <= 0) the search continues where the
+ * previous allocation ended. The blocks come from the allocation group
+ * of goal if it has any free, otherwise from the next group that has,
+ * so the extent never crosses a group. Groups without free blocks are
+ * skipped by their count alone. A group is searched BMAP_CHUNK blocks
+ * at a time, starting with the part holding goal, so an extent never
+ * crosses a chunk either. Returns the number of blocks allocated.*/
+static int alloc_data_blocks(int goal, int want, extent_t *extent) {
+	disk_superblock_t *sb = &superblock->d_super;
+	uint32_t words[BMAP_CHUNK / 32];
+	int chunk = (sb->group_blocks < BMAP_CHUNK) ? sb->group_blocks : BMAP_CHUNK;
+	int nchunks = sb->group_blocks / chunk;
+	int count = 0;
+
+	lock_acquire(&alloc_lock);
+	if (goal <= 0 || goal >= sb->nblocks)
+		goal = dblk_rotor % sb->nblocks;
+
+	for (int i = 0; i < sb->ngroups && count == 0; i++) {
+		int group = (goal / sb->group_blocks + i) % sb->ngroups;
+		int goal_chunk = (i == 0) ? goal % sb->group_blocks / chunk : 0;
+
+		if (sb->group_free[group] == 0)
+			continue;
+		for (int c = 0; c < nchunks && count == 0; c++) {
+			int first = group * sb->group_blocks + (goal_chunk + c) % nchunks * chunk;
+			blknum_t block = sb->dbmap_start + first / DBMAP_BITS;
+			int offset = (first % DBMAP_BITS) / 8;
+
+			/* The last group may end before its last chunks */
+			if (first >= sb->nblocks)
+				continue;
+			/* Search the chunk's slice of the bitmap, from goal in its
+			 * own chunk, and write back the words that changed */
+			block_read_part(block, offset, chunk / 8, words);
+			count = alloc_extent(words, chunk, (i == 0 && c == 0) ? goal - first : 0, want, extent);
+			if (count > 0) {
+				int w = extent->start / 32;
+				meta_modify(block, offset + w * sizeof(uint32_t), &words[w],
+				            ((extent->start + count - 1) / 32 - w + 1) * sizeof(uint32_t));
+				extent->start += first;
+			}
+		}
+	}
+
+	if (count > 0) {
+		count_blocks(extent->start, count, -1);
+		dblk_rotor = extent->start + extent->count;
+	}
+	lock_release(&alloc_lock);
+	return count;
+}
+
+/* Frees data block block. Freeing a free block has no effect. Returns
+ * -1 if block is outside the file system, otherwise zero.*/
+static int free_data_block(blknum_t block) {
+	disk_superblock_t *sb = &superblock->d_super;
+	blknum_t bitmap_block = sb->dbmap_start + block / DBMAP_BITS;
+	int offset = (block % DBMAP_BITS) / 32 * sizeof(uint32_t);
+	uint32_t word;
+
+	if (block <= 0 || block >= sb->nblocks)
+		return -1;
+
+	lock_acquire(&alloc_lock);
+	block_read_part(bitmap_block, offset, sizeof(uint32_t), &word);
+	if (word & (1u << (block % 32))) {
+		word &= ~(1u << (block % 32));
+		meta_modify(bitmap_block, offset, &word, sizeof(uint32_t));
+		count_blocks(block, 1, 1);
+	}
+	lock_release(&alloc_lock);
+	return 0;
+}
+
+/* Updates the free counts in the superblock after count blocks of one
+ * group, from block on, were taken (delta -1) or freed (delta 1).
+ * Called with alloc_lock held.*/
+static void count_blocks(blknum_t block, int count, int delta) {
+	disk_superblock_t *sb = &superblock->d_super;
+
+	sb->free_blks += delta * count;
+	sb->group_free[block / sb->group_blocks] += delta * count;
+	superblock->dirty = TRUE;
+}
+
+/* Returns the allocation group with the most free blocks, the first of
+ * them if several have as many.*/
+static int emptiest_group(void) {
+	disk_superblock_t *sb = &superblock->d_super;
+	int best = 0;
+
+	lock_acquire(&alloc_lock);
+	for (int group = 1; group < sb->ngroups; group++) {
+		if (sb->group_free[group] > sb->group_free[best])
+			best = group;
+	}
+	lock_release(&alloc_lock);
+	return best;
+}
+
+/* Returns the filesystem block (block number relative to the super
+ * block) corresponding to the inode number passed.*/
+static blknum_t ino2blk(inode_t ino) {
+	if(ino < 0 || ino >= superblock->d_super.ninodes){
+		return (blknum_t)-1;
+	}
+	return superblock->d_super.inode_start + ino / INODES_PER_BLK;
+}
+
+/* Returns the cached copy of inode ino, reading it from the inode area
+ * if it is not cached. The inode must be locked by the caller (see
+ * ilock()) for the pointer to stay valid and for its contents to be
+ * used, except for fields that do not change while it is in use.*/
+static mem_inode_t *iget(inode_t ino) {
+	lock_acquire(&icache_lock);
+	mem_inode_t *inode = icache_get(ino);
+	lock_release(&icache_lock);
+	return inode;
+}
+
+/* iget() with icache_lock held. When the cache is full, the least
+ * recently used inode that is neither open nor pinned is thrown out,
+ * and written back first if it is dirty. Returns NULL if every inode
+ * in the cache is open or pinned.*/
+static mem_inode_t *icache_get(inode_t ino) {
+	mem_inode_t *victim = NULL;
+
+	ASSERT(ino >= 0 && ino < NINODES);
+	inode_clock++;
+
+	for(int i=0; i<INODE_CACHE_ENTRIES; i++){
+		mem_inode_t *inode = &inode_table[i];
+
+		if(inode->inode_num == ino){
+			inode->last_used = inode_clock;
+			return inode;
+		}
+
+		//Open and pinned inodes must stay in the cache, prefer unused entries
+		if(inode->open_count > 0 || inode->pins > 0){
+			continue;
+		}
+		if(victim == NULL || (victim->inode_num != -1 &&
+		   (inode->inode_num == -1 || inode->last_used < victim->last_used))){
+			victim = inode;
+		}
+	}
+	if(victim == NULL){
+		return NULL;
+	}
+
+	if(victim->inode_num != -1){
+		iupdate(victim);
+	}
+
+	bzero((char*)victim, sizeof(mem_inode_t));
+	lock_init(&victim->lock);
+	block_read_part(ino2blk(ino), (ino % INODES_PER_BLK) * sizeof(disk_inode_t), sizeof(disk_inode_t), &victim->d_inode);
+	victim->inode_num = ino;
+	victim->last_used = inode_clock;
+	return victim;
+}
+
+/* Locks inode ino and returns its cached copy, which stays in the
+ * cache until iunlock(). The inode is pinned before its lock is taken,
+ * so it is not thrown out while we wait. If it was freed meanwhile, it
+ * is read again, and the caller finds it with type 0. Returns NULL if
+ * the inode is not cached and there is no room for it (see
+ * icache_get()). Inodes of open files and inodes the caller has locked
+ * already are always cached, so locking those does not fail.*/
+static mem_inode_t *ilock(inode_t ino) {
+	while(1){
+		lock_acquire(&icache_lock);
+		mem_inode_t *inode = icache_get(ino);
+		if(inode == NULL){
+			lock_release(&icache_lock);
+			return NULL;
+		}
+		inode->pins++;
+		lock_release(&icache_lock);
+
+		lock_acquire(&inode->lock);
+		if(inode->inode_num == ino){
+			return inode;
+		}
+		iunlock(inode);
+	}
+}
+
+/* Unlocks an inode locked by ilock() */
+static void iunlock(mem_inode_t *inode) {
+	lock_release(&inode->lock);
+	lock_acquire(&icache_lock);
+	inode->pins--;
+	lock_release(&icache_lock);
+}
+
+/* Locks inodes a and b, which may be the same inode, lowest inode
+ * number first. Used when neither is known to be the directory holding
+ * the other, since a directory may have entries for its parents.
+ * Returns FSE_INODETABLEFULL with nothing locked if either can not be
+ * cached.*/
+static int ilock2(inode_t a, inode_t b, mem_inode_t **pa, mem_inode_t **pb) {
+	if(a > b){
+		return ilock2(b, a, pb, pa);
+	}
+	*pa = ilock(a);
+	if(*pa == NULL){
+		return FSE_INODETABLEFULL;
+	}
+	*pb = (a == b) ? *pa : ilock(b);
+	if(*pb == NULL){
+		iunlock(*pa);
+		return FSE_INODETABLEFULL;
+	}
+	return FSE_OK;
+}
+
+/* Unlocks inodes locked by ilock2() */
+static void iunlock2(mem_inode_t *a, mem_inode_t *b) {
+	if(b != a){
+		iunlock(b);
+	}
+	iunlock(a);
+}
+
+/* Empties the inode cache, when a file system is made or loaded */
+static void icache_reset(void) {
+	for(int i=0; i<INODE_CACHE_ENTRIES; i++){
+		inode_table[i].open_count = 0;
+		inode_table[i].inode_num = -1; //Marked as unused by negative number
+		inode_table[i].dirty = FALSE;
+		inode_table[i].last_used = 0;
+		inode_table[i].pins = 0;
+		lock_init(&inode_table[i].lock);
+	}
+	inode_clock = 0;
+}
+
+/* Writes a cached inode back to its place in the inode area if it is
+ * dirty. Only the block holding this inode is changed.*/
+static void iupdate(mem_inode_t *inode) {
+	inode_t ino = inode->inode_num;
+
+	if(!inode->dirty || ino < 0){
+		return;
+	}
+	meta_modify(ino2blk(ino), (ino % INODES_PER_BLK) * sizeof(disk_inode_t), &inode->d_inode, sizeof(disk_inode_t));
+	inode->dirty = FALSE;
+}
+
+/* Returns the filesystem block (block number relative to the super
+ * block) corresponding to the data block index passed.
+ *
+ * The first INODE_NDIRECT blocks are found in inode->direct, the rest
+ * through the indirect blocks (see map_block()). Returns 0 if the block
+ * is not allocated and
+ * -1 if index is out of range. If alloc is TRUE, a missing block is
+ * allocated and zeroed, and -1 is returned if the disk is full.*/
+static blknum_t idx2blk(mem_inode_t *inode, int index, int alloc) {
+	disk_inode_t *d_inode = &inode->d_inode;
+	blknum_t block = 0;
+
+	if(index < 0 || index >= INODE_MAX_BLOCKS){
+		return -1;
+	}
+
+	if(d_inode->flags & INODE_INLINE){
+		return 0;
+	}
+	if(index < INODE_NDIRECT){
+		block = d_inode->direct[index];
+	}
+	else{
+		int slot;
+		blknum_t map = map_block(inode, index, &slot);
+		if(map != 0){
+			block_read_part(map, slot * sizeof(blknum_t), sizeof(blknum_t), &block);
+		}
+	}
+
+	if(block == 0 && alloc){
+		if(inode_alloc_range(inode, index, index) < 0){
+			return -1;
+		}
+		return idx2blk(inode, index, FALSE);
+	}
+	return block;
+}
+
+/* Returns the indirect block holding the pointer to file block index,
+ * which is past the direct blocks, and stores the position of the
+ * pointer in it in *slot. The next INODE_NINDIRECT blocks are listed in
+ * the indirect block, the rest in the indirect blocks listed in the
+ * double indirect block. Returns 0 if the indirect block is missing.*/
+static blknum_t map_block(mem_inode_t *inode, int index, int *slot) {
+	disk_inode_t *d_inode = &inode->d_inode;
+	blknum_t map = 0;
+
+	index -= INODE_NDIRECT;
+	if(index < INODE_NINDIRECT){
+		*slot = index;
+		return d_inode->indirect;
+	}
 
-					return FSE_OK;
+	index -= INODE_NINDIRECT;
+	*slot = index % INODE_NINDIRECT;
+	if(d_inode->dindirect != 0){
+		block_read_part(d_inode->dindirect, (index / INODE_NINDIRECT) * sizeof(blknum_t), sizeof(blknum_t), &map);
+	}
+	return map;
+}
+
+/* Returns the first file block past index whose pointer is kept in
+ * another block than the pointer to index (the inode counts as one).*/
+static int map_end(int index) {
+	if(index < INODE_NDIRECT){
+		return INODE_NDIRECT;
+	}
+	return INODE_NDIRECT + ((index - INODE_NDIRECT) / INODE_NINDIRECT + 1) * INODE_NINDIRECT;
+}
+
+/* Allocates the indirect blocks the pointer to file block index is
+ * kept in, if they are missing. They are placed at *goal, which is
+ * moved past them. Returns FSE_OK, or FSE_FULL if the disk is full.*/
+static int map_alloc(mem_inode_t *inode, int index, int *goal) {
+	disk_inode_t *d_inode = &inode->d_inode;
+	extent_t extent;
+
+	if(index < INODE_NDIRECT){
+		return FSE_OK;
+	}
+
+	blknum_t *top = (index < INODE_NDIRECT + INODE_NINDIRECT) ? &d_inode->indirect : &d_inode->dindirect;
+	if(*top == 0){
+		if(alloc_data_blocks(*goal, 1, &extent) == 0){
+			return FSE_FULL;
+		}
+		meta_write(extent.start, zero_block);
+		*top = extent.start;
+		inode->dirty = TRUE;
+		*goal = extent.start + 1;
+	}
+
+	//Past the indirect block, the double indirect block lists indirect blocks
+	int slot;
+	if(top == &d_inode->dindirect && map_block(inode, index, &slot) == 0){
+		if(alloc_data_blocks(*goal, 1, &extent) == 0){
+			return FSE_FULL;
+		}
+		meta_write(extent.start, zero_block);
+		slot = (index - INODE_NDIRECT - INODE_NINDIRECT) / INODE_NINDIRECT;
+		meta_modify(*top, slot * sizeof(blknum_t), &extent.start, sizeof(blknum_t));
+		*goal = extent.start + 1;
+	}
+	return FSE_OK;
+}
+
+/* Returns how many of the (at most max) file blocks starting at index
+ * follow each other on disk, block being the one at index. A run of
+ * unallocated blocks (block 0) counts as one extent too, so the caller
+ * can handle the whole run with a single read or bzero. Such a run ends
+ * where delayed data may begin.*/
+static int read_extent(mem_inode_t *inode, int index, blknum_t block, int max) {
+	int n = 1;
+
+	while(n < max && idx2blk(inode, index + n, FALSE) == ((block == 0) ? 0 : block + n) &&
+	      (block != 0 || !in_delayed(inode, index + n))){
+		n++;
+	}
+	return n;
+}
+
+/* Called by fs_read() before reading size bytes at f->pos through the
+ * open file f. A read that starts where the last one ended is
+ * sequential, and each sequential read doubles the read-ahead window,
+ * up to BCACHE_PREFETCH_MAX blocks. Any other read closes the window.
+ *
+ * When a sequential read needs blocks past what was read ahead before,
+ * those blocks and a window of blocks after them are brought into the
+ * buffer cache with one device read per disk extent. The reads that
+ * follow then find their blocks in the cache. A request too large for
+ * the cache is left to the direct path in fs_read(), and only the
+ * window after it is read ahead.*/
+static void read_ahead(open_file_t *f, mem_inode_t *inode, int size) {
+	int first = f->pos / BLOCK_SIZE;
+	int last = (f->pos + size - 1) / BLOCK_SIZE;
+	int nblocks = (inode->d_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if(f->pos != f->ra_pos){
+		f->ra_window = 0;
+		f->ra_end = 0;
+	}
+	else{
+		//Count the blocks of this read that were read ahead earlier
+		int from = (first > f->ra_next) ? first : f->ra_next;
+		int to = (last < f->ra_end - 1) ? last : f->ra_end - 1;
+		if(to >= from){
+			f->ra_hits += to - from + 1;
+		}
+
+		f->ra_window = (f->ra_window == 0) ? RA_MIN_WINDOW : f->ra_window * 2;
+		if(f->ra_window > BCACHE_PREFETCH_MAX){
+			f->ra_window = BCACHE_PREFETCH_MAX;
+		}
+	}
+	f->ra_pos = f->pos + size;
+	f->ra_next = last + 1;
+
+	//Not streaming, or everything this read needs is already there
+	if(f->ra_window == 0 || last < f->ra_end){
+		return;
+	}
+
+	int start = (first > f->ra_end) ? first : f->ra_end;
+	if(last - start + 1 > BCACHE_PREFETCH_MAX){
+		start = last + 1;
+	}
+	int end = last + 1 + f->ra_window;
+	if(end > nblocks){
+		end = nblocks;
+	}
+
+	for(int i=start; i<end; ){
+		blknum_t block = idx2blk(inode, i, FALSE);
+		if(block < 0){
+			break;
+		}
+		int max = (end - i < BCACHE_PREFETCH_MAX) ? end - i : BCACHE_PREFETCH_MAX;
+		int n = read_extent(inode, i, block, max);
+		if(block != 0){
+			block_prefetch(block, n);
+		}
+		i += n;
+	}
+	f->ra_end = end;
+}
+
+/* The part of fs_read() that reads from a file, with inode locked.
+ * Reads block by block, since the data may span several blocks.*/
+static int file_read(open_file_t *f, mem_inode_t *inode, char *buffer, int size) {
+	int nread = 0;
+
+	//Do not read past end of file
+	if(size > inode->d_inode.size - f->pos){
+		size = inode->d_inode.size - f->pos;
+	}
+	if(size > 0){
+		read_ahead(f, inode, size);
+	}
+
+	while(nread < size){
+		int offset = f->pos % BLOCK_SIZE;
+		int chunk = BLOCK_SIZE - offset;
+		if(chunk > size - nread){
+			chunk = size - nread;
+		}
+
+		int index = f->pos / BLOCK_SIZE;
+		blknum_t block = idx2blk(inode, index, FALSE);
+		if(block < 0){
+			return FSE_INVALIDBLOCK;
+		}
+
+		//A small file is read from the inode, without any block I/O
+		if(inode->d_inode.flags & INODE_INLINE){
+			bcopy(&inode->d_inode.data[f->pos], &buffer[nread], chunk);
+		}
+		//Data that has no block yet is only in the buffer cache
+		else if(block == 0 && in_delayed(inode, index)){
+			if(block_delay_read(DELAY_KEY(inode, index), offset, chunk, &buffer[nread]) < 0){
+				bzero(&buffer[nread], chunk);
+			}
+		}
+		//Whole blocks go straight into "buffer", one extent at a time.
+		//Only a partial first or last block is copied through the cache
+		else if(chunk == BLOCK_SIZE){
+			int n = read_extent(inode, index, block, (size - nread) / BLOCK_SIZE);
+			if(block == 0){
+				bzero(&buffer[nread], n * BLOCK_SIZE);
+			}
+			else if(block_read_direct(block, n, &buffer[nread]) < 0){
+				return FSE_ERROR;
+			}
+			chunk = n * BLOCK_SIZE;
+		}
+		//Unallocated block, reads as zeros
+		else if(block == 0){
+			bzero(&buffer[nread], chunk);
+		}
+		else{
+			block_read_part(block, offset, chunk, &buffer[nread]);
+		}
+
+		nread += chunk;
+		f->pos += chunk;
+	}
+
+	//Reached end of file, reset the offset and return
+	if(nread == 0){
+		f->pos = 0;
+	}
+	return nread;
+}
+
+/* Writes size bytes from buffer at the offset of open file f, whose
+ * inode is not locked. Giving delayed data its blocks changes metadata,
+ * so the data is written WRITE_OP_BLOCKS blocks at a time, each in an
+ * operation of its own (see block.h). Returns what file_write() does
+ * for the whole write.*/
+static int write_ops(open_file_t *f, char *buffer, int size) {
+	int written = 0;
+	int ret;
+
+	if(f->pos + size > superblock->d_super.max_filesize){
+		return FSE_FULL;
+	}
+	do{
+		int chunk = WRITE_OP_BLOCKS * BLOCK_SIZE - f->pos % BLOCK_SIZE;
+		if(chunk > size - written){
+			chunk = size - written;
+		}
+
+		if(block_journal_begin() < 0){
+			return FSE_ERROR;
+		}
+		mem_inode_t *inode = ilock(f->ino);
+		//Check if inode is of type "FILE"
+		if(inode->d_inode.type == INTYPE_FILE){
+			ret = file_write(f, inode, &buffer[written], chunk);
+		}
+		//If inode is of type "DIRECTORY", return error
+		else{
+			ret = FSE_INVALIDMODE;
+		}
+		iunlock(inode);
+		block_journal_end();
+
+		if(ret < 0){
+			return ret;
+		}
+		written += ret;
+	}while(written < size);
+
+	return written;
+}
+
+/* The part of fs_write() that writes to a file, with inode locked.
+ * Writes block by block. Blocks the file does not have yet are not
+ * allocated here: their data waits in the buffer cache until
+ * inode_flush() allocates them all at once, so a file written in many
+ * small pieces still ends up contiguous. A file small enough to be kept
+ * in the inode is written there.*/
+static int file_write(open_file_t *f, mem_inode_t *inode, char *buffer, int size) {
+	int written = 0;
+
+	if(f->pos + size > superblock->d_super.max_filesize){
+		//printf("ERROR: No more space in file to write to\n");
+		return FSE_FULL;
+	}
+	if(size <= 0){
+		return 0;
+	}
+
+	if((inode->d_inode.flags & INODE_INLINE) && f->pos + size > INODE_INLINE_MAX){
+		if(inline_promote(inode) < 0){
+			return FSE_FULL;
+		}
+	}
+	if(inode->d_inode.flags & INODE_INLINE){
+		bcopy(buffer, &inode->d_inode.data[f->pos], size);
+		inode->dirty = TRUE;
+		written = size;
+		f->pos += size;
+	}
+
+	while(written < size){
+		int offset = f->pos % BLOCK_SIZE;
+		int chunk = BLOCK_SIZE - offset;
+		if(chunk > size - written){
+			chunk = size - written;
+		}
+
+		if(file_write_block(inode, f->pos / BLOCK_SIZE, offset, &buffer[written], chunk) < 0){
+			break;
+		}
+		written += chunk;
+		f->pos += chunk;
+	}
+
+	//Increase inode->size if we wrote past the old end of file
+	//The inode is written back when the file is closed
+	if(f->pos > inode->d_inode.size){
+		inode->d_inode.size = f->pos;
+		inode->dirty = TRUE;
+	}
+	bitmap_update();
+
+	if(written < size){
+		//printf("ERROR: Out of data blocks\n");
+		return FSE_FULL;
+	}
+	return written;
+}
+
+/* Writes size bytes at offset in file block index. A block the file
+ * does not have yet gets delayed data. When the cache holds all the
+ * delayed data it can, the file is flushed early, and if that does not
+ * make room, the block is allocated at once. Returns FSE_OK or an
+ * error.*/
+static int file_write_block(mem_inode_t *inode, int index, int offset, char *data, int size) {
+	blknum_t block = idx2blk(inode, index, FALSE);
+	if(block < 0){
+		return FSE_INVALIDBLOCK;
+	}
+
+	if(block == 0){
+		int created = block_delay_modify(DELAY_KEY(inode, index), offset, data, size);
+		if(created < 0){
+			inode_flush(inode);
+			created = block_delay_modify(DELAY_KEY(inode, index), offset, data, size);
+		}
+		if(created > 0){
+			if(inode->delayed == 0 || index < inode->delay_first){
+				inode->delay_first = index;
+			}
+			if(inode->delayed == 0 || index > inode->delay_last){
+				inode->delay_last = index;
+			}
+			inode->delayed++;
+		}
+		if(created >= 0){
+			return FSE_OK;
+		}
+
+		if(inode_alloc_range(inode, index, index) < 0){
+			return FSE_FULL;
+		}
+		block = idx2blk(inode, index, FALSE);
+	}
+
+	return (block_modify(block, offset, data, size) < 0) ? FSE_ERROR : FSE_OK;
+}
+
+/* Moves the data of a small file out of the inode, into the first
+ * block of the file, when it grows too large to be kept there*/
+static int inline_promote(mem_inode_t *inode) {
+	char data[INODE_INLINE_MAX];
+
+	bcopy(inode->d_inode.data, data, INODE_INLINE_MAX);
+	clear_block_pointers(&inode->d_inode);
+	inode->dirty = TRUE;
+
+	if(inode->d_inode.size == 0){
+		return FSE_OK;
+	}
+	return file_write_block(inode, 0, 0, data, inode->d_inode.size);
+}
+
+/* Locks directory dir and the inode its entry name refers to, and
+ * returns that inode, or -1 with nothing locked if there is no such
+ * entry (FSE_INODETABLEFULL if they can not be cached). The entry is
+ * looked up again once both are locked, since it may have changed
+ * while the directory was unlocked.*/
+static inode_t lock_entry(inode_t dir, char *name, mem_inode_t **pdir, mem_inode_t **pino) {
+	while(1){
+		mem_inode_t *d = ilock(dir);
+		if(d == NULL){
+			return FSE_INODETABLEFULL;
+		}
+		inode_t ino = dir_lookup(dir, name);
+		iunlock(d);
+		if(ino < 0){
+			return -1;
+		}
+
+		if(ilock2(dir, ino, pdir, pino) < 0){
+			return FSE_INODETABLEFULL;
+		}
+		if(dir_lookup(dir, name) == ino){
+			return ino;
+		}
+		iunlock2(*pdir, *pino);
+	}
+}
+
+/* Creates file name in directory dir, which the caller has locked, and
+ * opens it. The caller checks that the name is not in the directory
+ * already. Returns the new inode, or an error.*/
+static inode_t file_create(inode_t dir, char *name) {
+	//Check if there is space in inode_table for new file. The inode goes
+	//next to the directory's, in the same inode block if there is room
+	inode_t ino = alloc_inode(dir);
+	if(ino < 0){
+		//printf("ERROR: No more space in inode_table for new file\n");
+		return (ino == FSE_INODETABLEFULL) ? ino : FSE_NOMOREINODES;
+	}
+
+	//Create new inode. Nobody else can find it before dir_add(), but it
+	//is locked so that it stays in the inode cache
+	mem_inode_t *new_inode = ilock(ino);
+	if(new_inode == NULL){
+		free_bitmap_entry(ino, inode_bmap, NINODES);
+		return FSE_INODETABLEFULL;
+	}
+	new_inode->d_inode.type = INTYPE_FILE;
+	new_inode->d_inode.size = 0;
+	new_inode->d_inode.nlinks = 0;
+	clear_block_pointers(&new_inode->d_inode);
+	//The file starts out small enough to be kept in the inode. Data
+	//blocks are allocated when it grows and the data is flushed, the
+	//first one close to the parent directory, in the same group
+	new_inode->d_inode.flags = INODE_INLINE;
+	new_inode->goal = iget(dir)->d_inode.direct[0] + 1;
+	new_inode->open_count = 1;
+	new_inode->dirty = TRUE;
+
+	//Place new_inode in the directory
+	int ev = dir_add(dir, name, ino);
+	if(ev < 0){
+		free_inode_blocks(new_inode, NULL);
+		free_inode(ino);
+		iunlock(new_inode);
+		return ev;
+	}
+	dcache_invalidate(dir, name);
+
+	//Update the new inode, the directory and bitmaps to disk
+	iupdate(new_inode);
+	iupdate(iget(dir));
+	iunlock(new_inode);
+	bitmap_update();
+
+	return ino;
+}
+
+/* Returns the open file behind descriptor fd of current_running, or
+ * NULL if fd is not an open descriptor. Only current_running changes
+ * its own descriptors, and the open file stays until it closes fd, so
+ * callers need fd_lock only to change them.*/
+static open_file_t *fd2file(int fd) {
+	if(fd < 0 || fd >= MAX_OPEN_FILES){
+		return NULL;
+	}
+	int of = current_running->filedes[fd].idx;
+	if(of < 0 || of >= OPEN_FILE_ENTRIES || open_file_table[of].refcount == 0){
+		return NULL;
+	}
+	return &open_file_table[of];
+}
+
+/* Part of fs_fsck(). Reads every block of every directory once, and
+ * counts the entries referring to each inode in fsck_links. Entries
+ * referring to free or invalid inodes are counted in st->bad_entries,
+ * and directories whose size does not match their entries in
+ * st->bad_sizes. Both are fixed if repair is TRUE. Returns
+ * FSE_INODETABLEFULL if a directory can not be cached.*/
+static int fsck_dirs(int repair, struct fsck_stat *st) {
+	dirent_t dirent;
+
+	for(inode_t dir=0; dir<NINODES; dir++){
+		if(fsck_type[dir] != INTYPE_DIR){
+			continue;
+		}
+		mem_inode_t *inode = ilock(dir);
+		if(inode == NULL){
+			return FSE_INODETABLEFULL;
+		}
+		int first, nblocks, live = 0;
+
+		if(inode->d_inode.direct[0] <= 0 || inode->d_inode.direct[0] >= superblock->d_super.nblocks){
+			iunlock(inode);
+			continue;
+		}
+		nblocks = dir_blocks(inode, &first);
+		if(nblocks > INODE_MAX_BLOCKS){
+			nblocks = INODE_MAX_BLOCKS;
+		}
+
+		for(int index=first; index<nblocks; index++){
+			blknum_t b = idx2blk(inode, index, FALSE);
+			if(b <= 0 || b >= superblock->d_super.nblocks){
+				continue;
+			}
+
+			for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+				block_read_part(b, sizeof(dirent_t) * (1 + i), sizeof(dirent_t), &dirent);
+				if(dirent.inode == -1){
+					continue;
+				}
+				if(dirent.inode < 0 || dirent.inode >= NINODES || fsck_type[dirent.inode] == 0){
+					st->bad_entries++;
+					if(repair){
+						dcache_invalidate(dir, dirent.name);
+						dirent.inode = -1;
+						strcpy(dirent.name, "empty");
+						meta_modify(b, sizeof(dirent_t) * (1 + i), &dirent, sizeof(dirent_t));
+					}
+					continue;
+				}
+
+				live++;
+				if(!same_string(dirent.name, ".") && !same_string(dirent.name, "..")){
+					fsck_links[dirent.inode]++;
 				}
-				//If linkname has some links to it, decrement linkname->nlinks
-				else{
-					inode_table[inode].d_inode.nlinks--;
+			}
+			fsck_step(repair);
+		}
+
+		if(inode->d_inode.size != live * (int)sizeof(dirent_t)){
+			st->bad_sizes++;
+			if(repair){
+				inode->d_inode.size = live * (int)sizeof(dirent_t);
+				inode->dirty = TRUE;
+				iupdate(inode);
+			}
+		}
+		iunlock(inode);
+		fsck_step(repair);
+	}
+	return FSE_OK;
+}
+
+/* Part of fs_fsck(). Marks the blocks of inode as used in fsck_dblk.
+ * Bad pointers (see fsck_claim()) are cleared if repair is TRUE.
+ * Writes back the inode if it was changed.*/
+static void fsck_mark_blocks(mem_inode_t *inode, int repair, struct fsck_stat *st) {
+	disk_inode_t *d_inode = &inode->d_inode;
+
+	for(int i=0; i<INODE_NDIRECT; i++){
+		if(d_inode->direct[i] != 0 && !fsck_claim(d_inode->direct[i], st) && repair){
+			d_inode->direct[i] = 0;
+			inode->dirty = TRUE;
+		}
+	}
+
+	if(d_inode->indirect != 0 && !fsck_claim(d_inode->indirect, st)){
+		if(repair){
+			d_inode->indirect = 0;
+			inode->dirty = TRUE;
+		}
+	}
+	else if(d_inode->indirect != 0){
+		fsck_mark_map(d_inode->indirect, 1, repair, st);
+	}
+
+	if(d_inode->dindirect != 0 && !fsck_claim(d_inode->dindirect, st)){
+		if(repair){
+			d_inode->dindirect = 0;
+			inode->dirty = TRUE;
+		}
+	}
+	else if(d_inode->dindirect != 0){
+		fsck_mark_map(d_inode->dindirect, 2, repair, st);
+	}
+
+	iupdate(inode);
+}
+
+/* Part of fs_fsck(). Like fsck_mark_blocks(), for the blocks listed in
+ * indirect block map (a double indirect block if depth is 2).*/
+static void fsck_mark_map(blknum_t map, int depth, int repair, struct fsck_stat *st) {
+	blknum_t zero = 0;
+
+	for(int i=0; i<INODE_NINDIRECT; i++){
+		blknum_t block;
+
+		block_read_part(map, i * sizeof(blknum_t), sizeof(blknum_t), &block);
+		if(block == 0){
+			continue;
+		}
+		if(!fsck_claim(block, st)){
+			if(repair){
+				meta_modify(map, i * sizeof(blknum_t), &zero, sizeof(blknum_t));
+			}
+		}
+		else if(depth > 1){
+			fsck_mark_map(block, depth - 1, repair, st);
+		}
+	}
+	fsck_step(repair);
+}
+
+/* Part of fs_fsck(). Commits the repairs made so far if repair is TRUE,
+ * when fs_fsck() has the journal to itself (see block_journal_lock()),
+ * so the repairs of a badly damaged file system do not overfill the
+ * transaction. Each repair is whole by itself.*/
+static void fsck_step(int repair) {
+	if(repair){
+		bitmap_update();
+		block_journal_commit();
+	}
+}
+
+/* Part of fs_fsck(). Marks block as used in fsck_dblk. Returns FALSE,
+ * and counts it in st->bad_pointers, if block is outside the file
+ * system or was marked already.*/
+static int fsck_claim(blknum_t block, struct fsck_stat *st) {
+	if(block < 0 || block >= superblock->d_super.nblocks){
+		st->bad_pointers++;
+		return FALSE;
+	}
+
+	if(fsck_dblk[block / 32] & MASK(block % 32)){
+		st->bad_pointers++;
+		return FALSE;
+	}
+	fsck_dblk[block / 32] |= MASK(block % 32);
+	return TRUE;
+}
+
+/* Part of fs_fsck(). Compares the blocks found in use in allocation
+ * group group with the data block bitmap, BMAP_CHUNK blocks at a time,
+ * and its free count with the superblock. Both are fixed if repair is
+ * TRUE. Returns the number of free blocks in the group.*/
+static int fsck_group(int group, int repair, struct fsck_stat *st) {
+	disk_superblock_t *sb = &superblock->d_super;
+	blknum_t end = (group + 1) * sb->group_blocks;
+	int group_free = 0;
+
+	if(end > sb->nblocks){
+		end = sb->nblocks;
+	}
+	lock_acquire(&alloc_lock);
+	for(blknum_t first=group * sb->group_blocks; first<end; first+=BMAP_CHUNK){
+		group_free += fsck_dbmap(first, (end - first < BMAP_CHUNK) ? end - first : BMAP_CHUNK, repair, st);
+	}
+	if(sb->group_free[group] != group_free){
+		st->bad_counts++;
+		if(repair){
+			sb->group_free[group] = group_free;
+			superblock->dirty = TRUE;
+		}
+	}
+	lock_release(&alloc_lock);
+	return group_free;
+}
+
+/* Part of fs_fsck(). Compares the blocks found in use, the n blocks
+ * from first on, with the data block bitmap, and fixes the bitmap if
+ * repair is TRUE. The n blocks are at most BMAP_CHUNK and in one bitmap
+ * block. Returns the number of free blocks among them. Called with
+ * alloc_lock held.*/
+static int fsck_dbmap(blknum_t first, int n, int repair, struct fsck_stat *st) {
+	disk_superblock_t *sb = &superblock->d_super;
+	uint32_t words[BMAP_CHUNK / 32];
+	blknum_t block = sb->dbmap_start + first / DBMAP_BITS;
+	int offset = (first % DBMAP_BITS) / 8;
+	int changed = FALSE;
+	int free = 0;
+
+	block_read_part(block, offset, (n + 31) / 32 * sizeof(uint32_t), words);
+	for(int w=0; w * 32<n; w++){
+		//Only compare the bits of blocks in the part
+		uint32_t mask = (n - w * 32 >= 32) ? ~0u : (uint32_t)MASK(n - w * 32) - 1;
+		uint32_t used = fsck_dblk[first / 32 + w];
+		uint32_t diff = (used ^ words[w]) & mask;
+
+		st->blocks += bit_count(used & mask);
+		st->bad_dbmap += bit_count(diff);
+		if(repair && diff != 0){
+			words[w] ^= diff;
+			changed = TRUE;
+		}
+		free += bit_count(~words[w] & mask);
+	}
+	if(changed){
+		meta_modify(block, offset, words, (n + 31) / 32 * sizeof(uint32_t));
+	}
+	return free;
+}
+
+/* Returns the number of bits set in word */
+static int bit_count(uint32_t word) {
+	int n = 0;
+
+	while(word != 0){
+		word &= word - 1;
+		n++;
+	}
+	return n;
+}
+
+/* Sets up f as a newly opened file with offset 0 and one reference */
+static void open_file_init(open_file_t *f, inode_t ino, int mode) {
+	f->refcount = 1;
+	f->ino = ino;
+	f->mode = mode;
+	f->pos = 0;
+	f->ra_pos = 0;
+	f->ra_next = 0;
+	f->ra_end = 0;
+	f->ra_window = 0;
+	f->ra_hits = 0;
+}
+
+/* Forgets all open files, when a file system is made or loaded */
+static void reset_open_files(void) {
+	for(int i=0; i<OPEN_FILE_ENTRIES; i++){
+		open_file_table[i].refcount = 0;
+		open_file_table[i].mode = MODE_UNUSED;
+	}
+	if(current_running != NULL){
+		for(int i=0; i<MAX_OPEN_FILES; i++){
+			current_running->filedes[i].idx = -1;
+		}
+	}
+}
+
+/* Allocates every missing data block with index first to last in the
+ * file. A new block gets the delayed data written for it, if there is
+ * any, and is zeroed otherwise. Each run of missing blocks is allocated
+ * as one extent placed right after the block in front of it (or at
+ * inode->goal), so a file written sequentially ends up contiguous on
+ * disk. Returns FSE_OK, or FSE_FULL if the disk filled up.*/
+static int inode_alloc_range(mem_inode_t *inode, int first, int last) {
+	extent_t extent;
+	int index = first;
+
+	if(last >= INODE_MAX_BLOCKS){
+		last = INODE_MAX_BLOCKS - 1;
+	}
+
+	while(index <= last){
+		int missing = 0;
+		int goal = 0;
+
+		if(idx2blk(inode, index, FALSE) != 0){
+			index++;
+			continue;
+		}
+
+		//Length of this run of missing blocks
+		while(index + missing <= last && idx2blk(inode, index + missing, FALSE) == 0){
+			missing++;
+		}
+
+		//Continue right after the previous block of the file
+		if(index > 0 && idx2blk(inode, index - 1, FALSE) > 0){
+			goal = idx2blk(inode, index - 1, FALSE) + 1;
+		}
+		else if(index == 0){
+			goal = inode->goal;
+		}
+
+		//Get the indirect blocks before the data, so they do not split the run
+		for(int i=index; i<index + missing; i=map_end(i)){
+			if(map_alloc(inode, i, &goal) < 0){
+				return FSE_FULL;
+			}
+		}
+
+		int count = alloc_data_blocks(goal, missing, &extent);
+		if(count == 0){
+			return FSE_FULL;
+		}
+		for(int i=0; i<count; i++){
+			if(!in_delayed(inode, index + i) ||
+			   block_delay_assign(DELAY_KEY(inode, index + i), extent.start + i) < 0){
+				block_write(extent.start + i, zero_block);
+			}
+			set_blk(inode, index + i, extent.start + i);
+		}
+		index += count;
+	}
+
+	return FSE_OK;
+}
+
+/* Gives all delayed data of the file its blocks. They are allocated in
+ * one go, so data written in many small pieces still gets one extent.
+ * If the disk fills up, the data that got no block is lost. Returns
+ * FSE_OK or FSE_FULL.*/
+static int inode_flush(mem_inode_t *inode) {
+	if(inode->delayed == 0){
+		return FSE_OK;
+	}
+
+	int ev = inode_alloc_range(inode, inode->delay_first, inode->delay_last);
+	delayed_drop(inode);
+	//The new block pointers go in the same operation as the bitmap
+	iupdate(inode);
+	return ev;
+}
+
+/* Returns TRUE if file block index may hold delayed data */
+static int in_delayed(mem_inode_t *inode, int index) {
+	return inode->delayed > 0 && index >= inode->delay_first && index <= inode->delay_last;
+}
+
+/* Throws away whatever delayed data of the file is left */
+static void delayed_drop(mem_inode_t *inode) {
+	for(int i=inode->delay_first; inode->delayed > 0 && i<=inode->delay_last; i++){
+		block_delay_drop(DELAY_KEY(inode, i));
+	}
+	inode->delayed = 0;
+}
 
-					//Update inode_table to disk
-					block_write(superblock->d_super.root_inode, &inode_table->d_inode);
+/* Stores block as data block number index of the file. The indirect
+ * blocks must already be allocated if index is past the direct blocks
+ * (see map_alloc()).*/
+static int set_blk(mem_inode_t *inode, int index, blknum_t block) {
+	disk_inode_t *d_inode = &inode->d_inode;
+	blknum_t map;
+	int slot;
+
+	if(index < INODE_NDIRECT){
+		d_inode->direct[index] = block;
+		inode->dirty = TRUE;
+		return FSE_OK;
+	}
+	if(index >= INODE_MAX_BLOCKS || (map = map_block(inode, index, &slot)) == 0){
+		return FSE_INVALIDBLOCK;
+	}
+	return meta_modify(map, slot * sizeof(blknum_t), &block, sizeof(blknum_t));
+}
 
-					return FSE_OK;
-				}
-			}
+/* Marks every block pointer of an inode as unallocated. The inode no
+ * longer holds data of its own either.*/
+static void clear_block_pointers(disk_inode_t *d_inode) {
+	for(int i=0; i<INODE_NDIRECT; i++){
+		d_inode->direct[i] = 0;
+	}
+	d_inode->indirect = 0;
+	d_inode->dindirect = 0;
+	d_inode->flags = 0;
+}
 
-			pos += sizeof(dirent_t);
-		}
-		//If no entries in current_running->datablock matches "linkname"
-		//printf("ERROR: Did not find 'linkname' in current_running->datablock.\n");
-		return FSE_DENOTFOUND;	
+/* Takes all data blocks away from an inode, including the indirect
+ * blocks, and drops any delayed data. A small file just loses the data
+ * in the inode, and the direct blocks of a file without indirect blocks
+ * are freed in the operation in progress. A larger file has more blocks
+ * than one operation may free, so their pointers are moved to *freed,
+ * for free_detached() to free once the operation has ended. If freed is
+ * NULL, they are freed at once, which only suits a file of a block or
+ * two.*/
+static void free_inode_blocks(mem_inode_t *inode, disk_inode_t *freed) {
+	disk_inode_t *d_inode = &inode->d_inode;
+
+	delayed_drop(inode);
+	if(d_inode->flags & INODE_INLINE){
+		clear_block_pointers(d_inode);
+		inode->dirty = TRUE;
+		return;
+	}
+
+	if(freed != NULL && (d_inode->indirect != 0 || d_inode->dindirect != 0)){
+		bcopy((char*)d_inode, (char*)freed, sizeof(disk_inode_t));
 	}
-	//Linkname does not exist
 	else{
-		//printf("ERROR: unlink name does not exist.\n");
-		return FSE_DENOTFOUND;
+		free_blocks(d_inode, NULL);
 	}
+	clear_block_pointers(d_inode);
+	inode->dirty = TRUE;
 }
 
-/*Prints a files: filename, type, nlinks and size*/
-int fs_stat(int fd, char *buffer)
-{
-	//Find inode number at position "fd" in file_descriptor_table
-	inode_t inode = file_descriptor_table[fd].idx;
-
-	//Load contents of inode into buffer
-	buffer[0] = inode_table[inode].d_inode.type;
-	buffer[1] = inode_table[inode].d_inode.nlinks;
-	int size = inode_table[inode].d_inode.size;
-	bcopy(&size, &buffer[2], sizeof(int));
+/* Frees the blocks that free_inode_blocks() moved to *freed, in
+ * operations of FREE_STEP blocks each. Called with no inode locked and
+ * outside an operation. Should the system stop halfway, the blocks not
+ * freed yet stay in use until fs_fsck() finds them.*/
+static void free_detached(disk_inode_t *freed) {
+	int count = 0;
 
-	return FSE_OK;
+	if(block_journal_begin() < 0){
+		return;
+	}
+	if(free_blocks(freed, &count) == FSE_OK){
+		bitmap_update();
+		block_journal_end();
+	}
 }
 
-/*
- * Helper functions for the system calls
- */
+/* Frees the data blocks and indirect blocks listed in d_inode. If count
+ * is not NULL, it counts the blocks freed in the operation in progress,
+ * which is ended and a new one started every FREE_STEP blocks. Returns
+ * FSE_ERROR, outside any operation, if a new one could not start.*/
+static int free_blocks(disk_inode_t *d_inode, int *count) {
+	for(int i=0; i<INODE_NDIRECT; i++){
+		if(d_inode->direct[i] != 0){
+			free_data_block(d_inode->direct[i]);
+			if(free_step(count) < 0){
+				return FSE_ERROR;
+			}
+		}
+	}
 
-/* Search the given bitmap for the first zero bit.  If an entry is
- * found it is set to one and the entry number is returned.  Returns
- * -1 if all entrys in the bitmap are set.
-*/
-static int get_free_entry(unsigned char *bitmap) {
-	int i;
+	if(d_inode->indirect != 0 && free_map_blocks(d_inode->indirect, 1, count) < 0){
+		return FSE_ERROR;
+	}
+	if(d_inode->dindirect != 0 && free_map_blocks(d_inode->dindirect, 2, count) < 0){
+		return FSE_ERROR;
+	}
+	return FSE_OK;
+}
 
-	/* Seach for a free entry */
-	for (i = 0; i < BITMAP_ENTRIES / 8; i++) {
-		if (bitmap[i] == 0xff) /* All taken */
-			continue;
-		if ((bitmap[i] & 0x80) == 0) { /* msb */
-			bitmap[i] |= 0x80;
-			return i * 8;
-		}
-		else if ((bitmap[i] & 0x40) == 0) {
-			bitmap[i] |= 0x40;
-			return i * 8 + 1;
-		}
-		else if ((bitmap[i] & 0x20) == 0) {
-			bitmap[i] |= 0x20;
-			return i * 8 + 2;
-		}
-		else if ((bitmap[i] & 0x10) == 0) {
-			bitmap[i] |= 0x10;
-			return i * 8 + 3;
-		}
-		else if ((bitmap[i] & 0x08) == 0) {
-			bitmap[i] |= 0x08;
-			return i * 8 + 4;
-		}
-		else if ((bitmap[i] & 0x04) == 0) {
-			bitmap[i] |= 0x04;
-			return i * 8 + 5;
-		}
-		else if ((bitmap[i] & 0x02) == 0) {
-			bitmap[i] |= 0x02;
-			return i * 8 + 6;
+/* Frees the blocks listed in indirect block map, and map itself. If
+ * depth is 2, map is a double indirect block, and the blocks listed in
+ * the indirect blocks it lists are freed too. count is as for
+ * free_blocks().*/
+static int free_map_blocks(blknum_t map, int depth, int *count) {
+	for(int i=0; i<INODE_NINDIRECT; i++){
+		blknum_t block;
+
+		block_read_part(map, i * sizeof(blknum_t), sizeof(blknum_t), &block);
+		if(block != 0 && depth > 1){
+			if(free_map_blocks(block, depth - 1, count) < 0){
+				return FSE_ERROR;
+			}
 		}
-		else if ((bitmap[i] & 0x01) == 0) { /* lsb */
-			bitmap[i] |= 0x01;
-			return i * 8 + 7;
+		else if(block != 0){
+			free_data_block(block);
+			if(free_step(count) < 0){
+				return FSE_ERROR;
+			}
 		}
 	}
-	return -1;
+	free_data_block(map);
+	return free_step(count);
 }
 
-/* Free a bitmap entry, if the entry is not found -1 is returned, otherwise zero.
- * Note that this function does not check if the bitmap entry was used (freeing
- * an unused entry has no effect).
- */
-static int free_bitmap_entry(int entry, unsigned char *bitmap) {
-	unsigned char *bme;
-
-	if (entry >= BITMAP_ENTRIES)
-		return -1;
+/* Counts a block freed by free_blocks(), and moves on to a new
+ * operation once FREE_STEP blocks have been freed in this one.*/
+static int free_step(int *count) {
+	if(count == NULL || ++*count < FREE_STEP){
+		return FSE_OK;
+	}
+	*count = 0;
+	bitmap_update();
+	block_journal_end();
+	return (block_journal_begin() < 0) ? FSE_ERROR : FSE_OK;
+}
 
-	bme = &bitmap[entry / 8];
-
-	switch (entry % 8) {
-	case 0:
-		*bme &= ~0x80;
-		break;
-	case 1:
-		*bme &= ~0x40;
-		break;
-	case 2:
-		*bme &= ~0x20;
-		break;
-	case 3:
-		*bme &= ~0x10;
-		break;
-	case 4:
-		*bme &= ~0x08;
-		break;
-	case 5:
-		*bme &= ~0x04;
-		break;
-	case 6:
-		*bme &= ~0x02;
-		break;
-	case 7:
-		*bme &= ~0x01;
-		break;
+/* Writes a whole metadata block, as part of the running journal
+ * transaction */
+static int meta_write(blknum_t block, void *data) {
+	if(block_journal_modify(block, 0, data, BLOCK_SIZE) < 0){
+		return FSE_ERROR;
 	}
+	return FSE_OK;
+}
 
-	return 0;
+/* Changes part of a metadata block, as part of the running journal
+ * transaction */
+static int meta_modify(blknum_t block, int offset, void *data, int size) {
+	if(block_journal_modify(block, offset, data, size) < 0){
+		return FSE_ERROR;
+	}
+	return FSE_OK;
 }
 
-/* Returns the filesystem block (block number relative to the super
- * block) corresponding to the inode number passed.*/
-static blknum_t ino2blk(inode_t ino) {
-	return (blknum_t)-1;
+/* Writes the inode bitmap to the bitmap block, and the free counts to
+ * the super block, if they have changed (superblock->dirty). Both are
+ * journaled, like the rest of the metadata. The data block bitmap is
+ * changed in the buffer cache when blocks are allocated or freed.*/
+static void bitmap_update(void) {
+	lock_acquire(&alloc_lock);
+	if(superblock->dirty){
+		meta_modify(superblock->d_super.bitmap_block, 0, inode_bmap, sizeof(inode_bmap));
+		meta_modify(superblock_datablock, 0, &superblock->d_super, sizeof(disk_superblock_t));
+		superblock->dirty = FALSE;
+	}
+	lock_release(&alloc_lock);
 }
 
-/* Returns the filesystem block (block number relative to the super
- * block) corresponding to the data block index passed.*/
-static blknum_t idx2blk(int index) {
-	return (blknum_t)-1;
+/* Loads the file system found on disk. Only the superblock, the bitmaps
+ * and the root inode are read here, all from the MOUNT_BLOCKS blocks that
+ * fs_init() brought in with one read. Other inodes, directories and
+ * data blocks are read when they are first used, so mounting does not
+ * take longer as the file system fills up.
+ */
+static void fs_mount(void)
+{
+	//Finish the metadata updates that were committed before a crash
+	disk_superblock_t on_disk;
+	block_read_part(SUPER_BLOCK, 0, sizeof(disk_superblock_t), &on_disk);
+	block_journal_replay(on_disk.journal_start, on_disk.journal_blocks);
+
+	//Replay may have changed the superblock and the inode bitmap. The
+	//data block bitmap is read when blocks are allocated or freed
+	block_read_part(SUPER_BLOCK, 0, sizeof(disk_superblock_t), &superblock->d_super);
+	superblock_datablock = SUPER_BLOCK;
+	superblock->ibmap = &inode_bmap;
+	superblock->dirty = FALSE;
+
+	block_read_part(superblock->d_super.bitmap_block, 0, sizeof(inode_bmap), inode_bmap);
+
+	//Nothing is cached or open yet
+	icache_reset();
+	dblk_rotor = 0;
+	dcache_init();
+
+	reset_open_files();
+
+	//Every path lookup starts at the root
+	iget(0);
 }
 
 /* Parses a file name and returns the corresponding inode number. If
- * the file cannot be found, -1 is returned.
- * Loops through inode table to see if names from path exists
+ * the file cannot be found, -1 is returned, and FSE_INODETABLEFULL if
+ * a directory on the way can not be cached.
+ * Absolute paths are resolved from the root directory, all others
+ * from current_running->cwd, one directory at a time. Each directory
+ * is locked only while it is searched, so the caller must not hold any
+ * inode locks.
  */
-static inode_t name2inode(char *name) 
+static inode_t name2inode(const char *name)
 {		
-	//If "name" == "/", return 0
-	if(same_string(name, "/") == 1){
-		return 0;
-	}
-
-
-	int current_inode = -1;
+	int current_inode = 0;
 	int current_read_pos = 0;
 
+	if(name[0] != '/'){
+		current_inode = current_running->cwd;
+	}
+
 	while(name[current_read_pos] != '\0'){
 		if(name[current_read_pos] == '/'){
 			current_read_pos++;
@@ -855,7 +2995,10 @@ static inode_t name2inode(char *name)
 			char path_name[MAX_FILENAME_LEN];
 
 			while(name[current_read_pos] != '\0' && name[current_read_pos] != '/'){
-				//Last første dir navn inn i array
+				//Names that do not fit in a dirent can not exist
+				if(i == MAX_FILENAME_LEN - 1){
+					return -1;
+				}
 				path_name[i] = name[current_read_pos];
 				
 				i++;				
@@ -864,43 +3007,449 @@ static inode_t name2inode(char *name)
 
 			//Place a '\0' terminator at end of path_name
 			path_name[i] = '\0';
-			//There was a bug with path_name, but copying it to "test" worked....
-			char test[MAX_FILENAME_LEN];
-			strcpy(&test, &path_name);
-
-
-			//Loop through entries in inode_table
-			for(int j=0; j<BLOCK_SIZE/sizeof(disk_inode_t); j++){
-				int found_inode = 0;
-				//If there is an inode in inode_table
-				if(inode_table[j].inode_num != -1){
-					//Read inode->datablock into memory
-					dirent_t dirents[DIRENTS_PER_BLK];
-					block_read(inode_table[j].d_inode.direct[0], &dirents);
-
-					//Check if entry in inode->datablock matches path_name
-					for(int k=0; k<DIRENTS_PER_BLK; k++){
-						if(same_string(dirents[k].name, test) == 1){
-							current_inode = dirents[k].inode;
-							found_inode = 1;
-							break;
-						}
-					}
+
+			//Only directories can have entries
+			mem_inode_t *dir = ilock(current_inode);
+			if(dir == NULL){
+				return FSE_INODETABLEFULL;
+			}
+			inode_t next = -1;
+			if(dir->d_inode.type == INTYPE_DIR){
+				next = dir_lookup(current_inode, path_name);
+			}
+			iunlock(dir);
+
+			current_inode = next;
+			if(current_inode < 0){
+				return -1;
+			}
+		}
+	}
+
+	return current_inode;
+}
+
+/* Returns the inode of the entry called name in directory dir, or -1
+ * if there is no such entry. Answers from the dentry cache when it
+ * can, otherwise reads the directory and caches the result (also when
+ * the name was not found). Like the other dir_ functions, it must be
+ * called with dir locked.*/
+static inode_t dir_lookup(inode_t dir, char *name)
+{
+	inode_t found = -1;
+
+	if(dcache_lookup(dir, name, &found)){
+		return found;
+	}
+
+	found = dir_find(dir, name, NULL, NULL);
+	dcache_insert(dir, name, found);
+	return found;
+}
+
+/* Hash of a file name, selects the directory block the name is kept in */
+static unsigned int dir_hash(char *name)
+{
+	unsigned int hash = 0;
+
+	while(*name != '\0'){
+		hash = hash * 31 + *name++;
+	}
+	return hash;
+}
+
+/* Makes inode dir an empty directory: writes block 0 with no entries
+ * in use, and adds the entries "." and "..". Returns FSE_OK or
+ * FSE_FULL.*/
+static int dir_init(inode_t dir, inode_t parent)
+{
+	mem_inode_t *inode = iget(dir);
+	int ev;
+
+	if(idx2blk(inode, 0, TRUE) <= 0){
+		return FSE_FULL;
+	}
+
+	meta_write(inode->d_inode.direct[0], &empty_dir_block);
+	inode->d_inode.size = 0;
+
+	if((ev = dir_add(dir, ".", dir)) < 0){
+		return ev;
+	}
+	return dir_add(dir, "..", parent);
+}
+
+/* Returns the number of blocks in directory inode, and sets *first to
+ * the index of its first dirent block: 0 for a directory of one block,
+ * 1 (after the header) for a hash table.*/
+static int dir_blocks(mem_inode_t *inode, int *first)
+{
+	int nblocks;
+
+	block_read_part(inode->d_inode.direct[0], 0, sizeof(int), &nblocks);
+	if(nblocks == 0){
+		*first = 0;
+		return 1;
+	}
+	*first = 1;
+	return nblocks;
+}
+
+/* Returns the index (within directory inode) of the block that names
+ * with the given hash are kept in*/
+static int dir_bucket(mem_inode_t *inode, unsigned int hash)
+{
+	blknum_t header_block = inode->d_inode.direct[0];
+	int nblocks, depth, index;
+
+	block_read_part(header_block, 0, sizeof(int), &nblocks);
+	if(nblocks == 0){
+		return 0;
+	}
+
+	//The buckets come right after nblocks and depth in the header
+	block_read_part(header_block, sizeof(int), sizeof(int), &depth);
+	block_read_part(header_block, sizeof(int) * (2 + (hash & ((1 << depth) - 1))), sizeof(int), &index);
+	return index;
+}
+
+/* Looks name up in the block it hashes to. Returns its inode, and if
+ * block and slot are not NULL, the disk block and the index in the
+ * entries of that block where it was found. Returns -1 if the name is
+ * not in the directory.*/
+static inode_t dir_find(inode_t dir, char *name, blknum_t *block, int *slot)
+{
+	mem_inode_t *inode = iget(dir);
+	dirent_t dirent;
+	int index = dir_bucket(inode, dir_hash(name));
+
+	//Search the block, and the blocks chained to it
+	do{
+		blknum_t b = idx2blk(inode, index, FALSE);
+		if(b <= 0){
+			return -1;
+		}
+
+		//One entry at a time, a whole block may not fit on the stack
+		for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+			block_read_part(b, sizeof(dirent_t) * (1 + i), sizeof(dirent_t), &dirent);
+			if(dirent.inode != -1 && same_string(dirent.name, name) == 1){
+				if(block != NULL){
+					*block = b;
 				}
-				if(found_inode == 1){
-					break;
+				if(slot != NULL){
+					*slot = i;
+				}
+				return dirent.inode;
+			}
+		}
+		block_read_part(b, 0, sizeof(int), &index);
+	}while(index != 0);
+
+	return -1;
+}
+
+/* Adds the entry name -> ino to directory dir. The entry goes into the
+ * first free slot of the block it hashes to, or of the blocks chained
+ * to it. If there is none, the directory is grown by dir_grow() and the
+ * slot looked for again. The caller checks that the name is not in the
+ * directory already.*/
+static int dir_add(inode_t dir, char *name, inode_t ino)
+{
+	mem_inode_t *inode = iget(dir);
+	unsigned int hash = dir_hash(name);
+	dirent_t dirent;
+	inode_t used;
+	int ev;
+
+	if(strlen(name) >= MAX_FILENAME_LEN){
+		return FSE_NAMETOLONG;
+	}
+	dirent.inode = ino;
+	strcpy(dirent.name, name);
+
+	while(1){
+		int first = dir_bucket(inode, hash);
+		int index = first;
+
+		do{
+			blknum_t b = idx2blk(inode, index, FALSE);
+			if(b <= 0){
+				return FSE_INVALIDBLOCK;
+			}
+
+			for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+				block_read_part(b, sizeof(dirent_t) * (1 + i), sizeof(inode_t), &used);
+				if(used == -1){
+					meta_modify(b, sizeof(dirent_t) * (1 + i), &dirent, sizeof(dirent_t));
+					inode->d_inode.size += sizeof(dirent_t);
+					inode->dirty = TRUE;
+					return FSE_OK;
 				}
 			}
+			block_read_part(b, 0, sizeof(int), &index);
+		}while(index != 0);
+
+		if((ev = dir_grow(inode, first, hash)) < 0){
+			return ev;
+		}
+	}
+}
+
+/* Makes room in directory inode for a name with the given hash, whose
+ * block (index) is full. A directory of one block becomes a hash table
+ * with that block as its only bucket. Otherwise the block is split, if
+ * need be after doubling buckets[], or at DIR_MAX_DEPTH a new block is
+ * chained in front of it. Returns FSE_OK, FSE_FULL or FSE_ADDDIR.*/
+static int dir_grow(mem_inode_t *inode, int index, unsigned int hash)
+{
+	blknum_t header_block = inode->d_inode.direct[0];
+	int depth, block_depth, n;
+
+	if(index == 0){
+		return dir_to_table(inode);
+	}
+
+	block_read_part(header_block, sizeof(int), sizeof(int), &depth);
+	block_read_part(idx2blk(inode, index, FALSE), sizeof(int), sizeof(int), &block_depth);
+
+	if(block_depth == DIR_MAX_DEPTH){
+		n = dir_new_block(inode, index, block_depth);
+		if(n < 0){
+			return n;
+		}
+		meta_modify(header_block, sizeof(int) * (2 + (hash & (DIR_BUCKETS - 1))), &n, sizeof(int));
+		return FSE_OK;
+	}
+
+	//Double buckets[], each new bucket shares the block of its twin
+	if(block_depth == depth){
+		for(int i=0; i<(1 << depth); i++){
+			int b;
+			block_read_part(header_block, sizeof(int) * (2 + i), sizeof(int), &b);
+			meta_modify(header_block, sizeof(int) * (2 + (1 << depth) + i), &b, sizeof(int));
+		}
+		depth++;
+		meta_modify(header_block, sizeof(int), &depth, sizeof(int));
+	}
+
+	return dir_split(inode, index, block_depth, depth);
+}
+
+/* Splits block index of directory inode, whose names share their low
+ * block_depth hash bits, by the next bit. The names with that bit set
+ * move to a new block, which the buckets with the bit set now use.
+ * depth is the depth of the header. Returns FSE_OK, FSE_FULL or
+ * FSE_ADDDIR.*/
+static int dir_split(mem_inode_t *inode, int index, int block_depth, int depth)
+{
+	blknum_t header_block = inode->d_inode.direct[0];
+	blknum_t b = idx2blk(inode, index, FALSE);
+	dirent_t dirent;
+	int n, slot = 0;
+
+	n = dir_new_block(inode, 0, block_depth + 1);
+	if(n < 0){
+		return n;
+	}
+	blknum_t nb = idx2blk(inode, n, FALSE);
+
+	block_depth++;
+	meta_modify(b, sizeof(int), &block_depth, sizeof(int));
+
+	for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+		block_read_part(b, sizeof(dirent_t) * (1 + i), sizeof(dirent_t), &dirent);
+		if(dirent.inode == -1 || ((dir_hash(dirent.name) >> (block_depth - 1)) & 1) == 0){
+			continue;
+		}
+		meta_modify(nb, sizeof(dirent_t) * (1 + slot++), &dirent, sizeof(dirent_t));
+		meta_modify(b, sizeof(dirent_t) * (1 + i), &empty_dir_block.entries[i], sizeof(dirent_t));
+	}
+
+	for(int i=0; i<(1 << depth); i++){
+		int bucket;
+		block_read_part(header_block, sizeof(int) * (2 + i), sizeof(int), &bucket);
+		if(bucket == index && ((i >> (block_depth - 1)) & 1) != 0){
+			meta_modify(header_block, sizeof(int) * (2 + i), &n, sizeof(int));
+		}
+	}
+	return FSE_OK;
+}
+
+/* Turns directory inode, of one full block, into a hash table of one
+ * bucket: its entries are copied to a new block 1, and block 0 becomes
+ * the header. Returns FSE_OK or FSE_FULL.*/
+static int dir_to_table(mem_inode_t *inode)
+{
+	blknum_t header_block = inode->d_inode.direct[0];
+	int header[3] = {2, 0, 1}; //nblocks, depth, buckets[0]
+	dirent_t dirent;
+
+	blknum_t b = idx2blk(inode, 1, TRUE);
+	if(b <= 0){
+		return FSE_FULL;
+	}
+
+	meta_write(b, &empty_dir_block);
+	for(int i=0; i<DIR_BLOCK_ENTRIES; i++){
+		block_read_part(header_block, sizeof(dirent_t) * (1 + i), sizeof(dirent_t), &dirent);
+		meta_modify(b, sizeof(dirent_t) * (1 + i), &dirent, sizeof(dirent_t));
+	}
+
+	meta_write(header_block, zero_block);
+	meta_modify(header_block, 0, header, sizeof(header));
+	return FSE_OK;
+}
+
+/* Adds a block with no entries in use to the end of directory inode (a
+ * hash table), with the given next and depth. Returns its index, or
+ * FSE_FULL or FSE_ADDDIR.*/
+static int dir_new_block(mem_inode_t *inode, int next, int depth)
+{
+	blknum_t header_block = inode->d_inode.direct[0];
+	int nblocks;
+
+	block_read_part(header_block, 0, sizeof(int), &nblocks);
+	if(nblocks >= INODE_MAX_BLOCKS){
+		return FSE_ADDDIR;
+	}
+	blknum_t b = idx2blk(inode, nblocks, TRUE);
+	if(b <= 0){
+		return FSE_FULL;
+	}
+
+	meta_write(b, &empty_dir_block);
+	meta_modify(b, 0, &next, sizeof(int));
+	meta_modify(b, sizeof(int), &depth, sizeof(int));
+
+	nblocks++;
+	meta_modify(header_block, 0, &nblocks, sizeof(int));
+	return nblocks - 1;
+}
+
+/* Removes the entry called name from directory dir. Returns the inode
+ * the entry pointed to, or -1 if there was no such entry. Blocks that
+ * become empty stay in the directory and are reused by dir_add().*/
+static inode_t dir_remove(inode_t dir, char *name)
+{
+	mem_inode_t *inode = iget(dir);
+	blknum_t block;
+	int slot;
+	dirent_t dirent;
+
+	inode_t ino = dir_find(dir, name, &block, &slot);
+	if(ino < 0){
+		return -1;
+	}
+
+	dirent.inode = -1;
+	strcpy(dirent.name, "empty");
+	meta_modify(block, sizeof(dirent_t) * (1 + slot), &dirent, sizeof(dirent_t));
+
+	inode->d_inode.size -= sizeof(dirent_t);
+	inode->dirty = TRUE;
+	return ino;
+}
+
+/* Reads the next entry in use of directory dir into *dirent. *pos is
+ * the entry slot to start at, counted over all dirent blocks, and is
+ * moved past the entry returned. Returns FALSE at the end of the
+ * directory. Entries move when a block is split, so a listing taken
+ * while names are added may miss a name or see it twice.*/
+static int dir_readdir(inode_t dir, int *pos, dirent_t *dirent)
+{
+	mem_inode_t *inode = iget(dir);
+	int first, nblocks = dir_blocks(inode, &first);
 
+	while(*pos < (nblocks - first) * DIR_BLOCK_ENTRIES){
+		int index = first + *pos / DIR_BLOCK_ENTRIES;
+		int slot = *pos % DIR_BLOCK_ENTRIES;
+		blknum_t b = idx2blk(inode, index, FALSE);
+
+		(*pos)++;
+		if(b <= 0){
+			continue;
+		}
+		block_read_part(b, sizeof(dirent_t) * (1 + slot), sizeof(dirent_t), dirent);
+		if(dirent->inode != -1){
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Reads up to max entries in use of the directory inode (locked) into
+ * dirents, from the entry slot *pos on, like dir_readdir(). Only one
+ * dirent block is read, unless it has no entries in use from *pos on.
+ * The slots are copied straight into dirents with one block_read_part(),
+ * and the unused ones are then squeezed out. *pos is moved past the
+ * last slot looked at. Returns the number of entries stored.*/
+static int dir_getdents(mem_inode_t *inode, dirent_t *dirents, int max, int *pos)
+{
+	int first, nblocks = dir_blocks(inode, &first);
+	int n = 0;
+
+	while(n == 0 && *pos < (nblocks - first) * DIR_BLOCK_ENTRIES){
+		int index = first + *pos / DIR_BLOCK_ENTRIES;
+		int slot = *pos % DIR_BLOCK_ENTRIES;
+		int count = DIR_BLOCK_ENTRIES - slot;
+		blknum_t b = idx2blk(inode, index, FALSE);
+
+		if(count > max){
+			count = max;
+		}
+		*pos += count;
+		if(b <= 0){
+			continue;
+		}
+
+		block_read_part(b, sizeof(dirent_t) * (1 + slot), sizeof(dirent_t) * count, dirents);
+		for(int i=0; i<count; i++){
+			if(dirents[i].inode != -1){
+				dirents[n++] = dirents[i];
+			}
 		}
 	}
 
-	if(current_inode < 0){
+	return n;
+}
+
+/* Allocates an inode number and returns it, with a cleared inode in
+ * the inode cache. The first free inode from goal on is taken. Returns
+ * -1 if there are no free inodes, and FSE_INODETABLEFULL if the inode
+ * can not be cached.*/
+static inode_t alloc_inode(inode_t goal)
+{
+	inode_t ino = get_free_entry(inode_bmap, NINODES, goal);
+
+	if(ino < 0){
 		return -1;
 	}
-	else{
-		return current_inode;
+
+	mem_inode_t *inode = iget(ino);
+	if(inode == NULL){
+		free_bitmap_entry(ino, inode_bmap, NINODES);
+		return FSE_INODETABLEFULL;
 	}
+	bzero((char*)&inode->d_inode, sizeof(disk_inode_t));
+	inode->dirty = TRUE;
+	return ino;
+}
+
+/* Frees an inode number, and clears the inode on disk. The data blocks
+ * must already have been freed.*/
+static void free_inode(inode_t ino)
+{
+	mem_inode_t *inode = iget(ino);
+
+	bzero((char*)&inode->d_inode, sizeof(disk_inode_t));
+	inode->dirty = TRUE;
+	iupdate(inode);
+	inode->inode_num = -1;
+
+	free_bitmap_entry(ino, inode_bmap, NINODES);
+	dcache_invalidate_inode(ino);
 }
 
 /*Parses a given path.
@@ -929,49 +3478,3 @@ int parse_num(char *path)
 		return size;
 	}
 }
-
-/*Prints inode_table*/
-void print_inode_table()
-{
-	for(int i=0; i<BLOCK_SIZE/sizeof(disk_inode_t); i++){
-		//printf("inode_table[%d].inode = %d\n", i, inode_table[i].inode_num);
-	}
-}
-
-/*Prints file_descriptor_table*/
-void print_FD_table()
-{
-	for(int i=0; i<MAX_OPEN_FILES; i++){
-		//printf("FD_table[%d].inode = %d\n", i, file_descriptor_table[i].idx);
-	}
-}
-
-/*Prints all directory entries in datablock*/
-void print_dirents(blknum_t block_number)
-{
-	//printf("Printing dirents from datablock[%d]\n", block_number);
-	dirent_t dirent;
-	int pos = 0;
-
-	for(int i=0; i<DIRENTS_PER_BLK; i++){
-		block_read_part(block_number, pos, sizeof(dirent_t), &dirent);
-		
-		//printf("dirent[%d]: inode[%d], name[%s]\n", i, dirent.inode, dirent.name);
-		
-		pos += sizeof(dirent_t);
-	}
-}
-
-/*Prints char contents from given datablock*/
-void print_characters(blknum_t block_number)
-{
-	//printf("Printing characters from datablock[%d]\n", block_number);
-	char characters[BLOCK_SIZE];
-	int pos = 0;
-
-	block_read(block_number, &characters);
-
-	for(int i=0; i<BLOCK_SIZE; i++){
-		//printf("Datablock[%d] = %c\n", i, characters[i]);
-	}
-}
\ No newline at end of file
@@ -12,11 +12,39 @@
 
 #endif /* LINUX_SIM */
 
-/* Number of file system blocks.
- *
- * If you decide to change this, you must probably change the number
- * of blocks reserved for the filesystem in createimage.c as well.*/
-#define FS_BLOCKS (512 + 2)
+/* The number of file system blocks is decided when the file system is
+ * made, from the room the device has (see block_dev_blocks()). On the
+ * USB stick that is what createimage.c reserves for the file system
+ * (--fs=blocks), and in the simulator the size of image_sim.*/
+
+/* The inode area is sized when the file system is made, with an inode
+ * for every FS_INODE_RATIO bytes of the file system. It is at least
+ * FS_MIN_INODE_BLOCKS blocks (16KB whatever the block size), and has at
+ * most FS_MAX_INODES inodes, since the inode bitmap is one block.*/
+#define FS_INODE_RATIO 8192
+#define FS_MIN_INODE_BLOCKS (32 / BLOCK_SECTORS)
+#define FS_MAX_INODES (BLOCK_SIZE * 8)
+
+/* Number of blocks in the metadata journal region (at most
+ * JOURNAL_MAX_BLOCKS, and more than JOURNAL_TX_MAX + 1), so it holds a
+ * full transaction and a few smaller ones before a checkpoint.*/
+#define FS_JOURNAL_BLOCKS 48
+
+/* fs_fsck() keeps a link count and a type for every inode, and marks
+ * the blocks in use in a bitmap with a bit for every block, in at most
+ * FSCK_MEM_SIZE bytes. What the inodes leave of it (FSCK_MAX_BLOCKS
+ * bits) limits the number of blocks in the file system. In the kernel
+ * this is kept at FSCK_MEM_START, above the pageable memory, rather
+ * than in the kernel image. The kernel page table maps it (see
+ * memory.c).*/
+#define FSCK_MEM_START 0x200000
+#define FSCK_MEM_SIZE 0x100000
+#define FSCK_INODE_BYTES 3	/* a short link count and a char type */
+#define FSCK_MAX_BLOCKS ((FSCK_MEM_SIZE - FS_MAX_INODES * FSCK_INODE_BYTES) * 8)
+
+/* Largest file, as long as the block pointers of an inode reach that
+ * far. File offsets are ints. */
+#define FS_MAX_FILESIZE (1 << 30)
 
 #define MASK(v) (1 << (v))
 
@@ -50,9 +78,10 @@
 
 enum
 {
-	MAX_FILENAME_LEN = 14,
+	/* Keeps sizeof(struct dirent) at 16, so dirents fill a block exactly */
+	MAX_FILENAME_LEN = 12,
 	MAX_PATH_LEN = 256, /* Total length of a path */
-	STAT_SIZE = 6,      /* Size of the information returned by fs_stat */
+	STAT_SIZE = 22,     /* Size of the information returned by fs_stat */
 };
 
 /* A directory entry */
@@ -62,7 +91,39 @@ struct dirent {
 	char name[MAX_FILENAME_LEN];
 };
 
-#define DIRENTS_PER_BLK (BLOCK_SIZE / sizeof(struct dirent))
+#define DIRENTS_PER_BLK ((int)(BLOCK_SIZE / sizeof(struct dirent)))
+
+/*
+ * A directory of one block is a dir_block of entries in no order, with
+ * next == 0. When it fills up, it becomes an extendible hash table:
+ * block 0 then holds a dir_header (whose nblocks is at least 2), and
+ * the entries move to dir_blocks after it. A name is kept in the block
+ * buckets[dir_hash(name) & ((1 << depth) - 1)], so finding, adding or
+ * removing an entry reads the header and one block. Several buckets
+ * may share a block whose depth is lower than the header's, and a full
+ * block is split in two by the next bit of the hash, doubling buckets[]
+ * if needed. Only at DIR_MAX_DEPTH are full blocks chained through
+ * next instead. A directory thus takes blocks in proportion to its
+ * names. Unused dirents have inode -1.
+ */
+#define DIR_MAX_DEPTH ((BLOCK_SECTORS == 1) ? 6 : (BLOCK_SECTORS == 2) ? 7 : (BLOCK_SECTORS == 4) ? 8 : 9)
+#define DIR_BUCKETS (1 << DIR_MAX_DEPTH)
+#define DIR_BLOCK_ENTRIES (DIRENTS_PER_BLK - 1)
+
+typedef struct dir_header dir_header_t;
+struct dir_header {
+	int nblocks;              /* blocks in the directory, header included */
+	int depth;                /* hash bits used to index buckets[] */
+	int buckets[DIR_BUCKETS]; /* block of each bucket, 1 << depth in use */
+};
+
+typedef struct dir_block dir_block_t;
+struct dir_block {
+	int next;                 /* next block in this bucket, 0 if last */
+	int depth;                /* hash bits shared by the names in here */
+	char pad[sizeof(struct dirent) - 2 * sizeof(int)];
+	struct dirent entries[DIR_BLOCK_ENTRIES];
+};
 
 #ifndef SEEK_SET
 enum
@@ -83,6 +144,36 @@ int fs_lseek(int fd, int offset, int whence);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
 int fs_stat(int fd, char *buffer);
+int fs_fsck(int repair, struct fsck_stat *st);
+int fs_sync(void);
+int fs_statfs(struct fs_statfs *st);
+int fs_pread(int fd, char *buffer, int size, int offset);
+int fs_pwrite(int fd, char *buffer, int size, int offset);
+int fs_pread_iov(int fd, struct fs_iovec *iov, int offset);
+int fs_pwrite_iov(int fd, struct fs_iovec *iov, int offset);
+int fs_getdents(int fd, char *buffer, int size, int *cookie);
+int fs_getdents_iov(int fd, struct fs_iovec *iov, int *cookie);
+void fs_exit(void);
+int fs_readv(int fd, struct fs_iovec *iov, int iovcnt);
+int fs_writev(int fd, struct fs_iovec *iov, int iovcnt);
+
+/*
+ * Access to an open file without a descriptor, for the I/O thread
+ * (aio.c). The open file stays from fs_file_get() to fs_file_put().
+ */
+open_file_t *fs_file_get(int fd);
+void fs_file_put(open_file_t *f);
+int fs_file_read(open_file_t *f, char *buffer, int size);
+int fs_file_write(open_file_t *f, char *buffer, int size);
+
+/*
+ * Access by inode to files mapped into memory by fs_mmap(), for
+ * memory.c. The file stays open from fs_map_get() to fs_map_put().
+ */
+inode_t fs_map_get(int fd, int *writable);
+void fs_map_put(inode_t ino);
+int fs_map_read(inode_t ino, int offset, char *buffer, int size);
+int fs_map_write(inode_t ino, int offset, char *buffer, int size);
 
 int fs_mkdir(char *dir_name);
 int fs_chdir(char *path);
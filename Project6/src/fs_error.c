@@ -61,7 +61,11 @@ struct fse et[] = {
     /* Invalid block */
     {FSE_INVALIDBLOCK, "Inode contains invalid block pointer"},
     /* Tried to delete a file that was opened by another program */
-    {FSE_FILEOPEN, "File to delete is used by another program"}};
+    {FSE_FILEOPEN, "File to delete is used by another program"},
+    /* Buffer lies where files are mapped into memory */
+    {FSE_MAPPEDBUFFER, "Buffer is in a mapped file"},
+    /* No file system is mounted */
+    {FSE_NOTMOUNTED, "No file system is mounted"}};
 
 #ifdef LINUX_SIM
 
@@ -51,7 +51,11 @@ enum
 	FSE_INVALIDBLOCK = -22,
 	/* Tried to delete a file that was opened by another program */
 	FSE_FILEOPEN = -23,
-	FSE_COUNT = -24
+	/* Buffer lies where files are mapped into memory */
+	FSE_MAPPEDBUFFER = -24,
+	/* No file system is mounted */
+	FSE_NOTMOUNTED = -25,
+	FSE_COUNT = -26
 };
 
 enum
@@ -0,0 +1,243 @@
+/*
+ * File system benchmark for the development host.
+ *
+ * Runs fs.c on top of block_sim.c, like p6sh, and replays a few
+ * scripted workloads against a freshly made file system in image_sim
+ * (which is overwritten). For each workload it prints one CSV line
+ * with the number of operations, the blocks read from and written to
+ * the device (as counted by the buffer cache), and the wall time:
+ *
+ *   workload,ops,block_reads,block_writes,usec
+ *
+ * The cache is not emptied between workloads, so later workloads see
+ * what earlier ones left in it, just like a real session would. Dirty
+ * blocks are written back by the last line, "sync".
+ *
+ * Usage: ./fsbench [workload ...]   (default: all of them, in order)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "block.h"
+#include "fs.h"
+#include "kernel.h"
+#include "util.h"
+
+#define CREATE_FILES 32   /* files made by the create workload */
+#define LOOKUP_DEPTH 8    /* directories in the path looked up */
+#define LOOKUP_OPENS 256  /* opens of the deepest file */
+#define APPEND_COUNT 512  /* appends to the log */
+#define APPEND_SIZE 48    /* bytes per append */
+#define APPEND_REOPEN 32  /* appends between reopens of the log */
+#define LIST_COUNT 32     /* listings of the create directory */
+#define CHURN_FILES 128   /* files made and removed by the unlink workload */
+#define CHURN_SIZE 1000   /* bytes written to each of them */
+#define IMAGE_BLOCKS 514  /* size of image_sim, as made by make image */
+
+struct pcb fake_pcb;
+struct pcb *current_running = &fake_pcb;
+
+const int os_size = 0;
+
+/* A workload does its operations and returns how many it did */
+struct workload {
+	char *name;
+	int (*run)(void);
+};
+
+static int create(void);
+static int lookup(void);
+static int append(void);
+static int list(void);
+static int churn(void);
+static int flush(void);
+
+static struct workload workloads[] = {
+	{"create", create},
+	{"lookup", lookup},
+	{"append", append},
+	{"list", list},
+	{"unlink", churn},
+	{"sync", flush},
+};
+
+#define NWORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+static void make_image(void);
+static void run(struct workload *w);
+static int check(int ret, char *what);
+static void name(char *buf, char *prefix, int n);
+
+int main(int argc, char *argv[]) {
+	int i, j;
+
+	make_image();
+	fs_init();
+
+	printf("workload,ops,block_reads,block_writes,usec\n");
+	if (argc == 1) {
+		for (i = 0; i < NWORKLOADS; i++)
+			run(&workloads[i]);
+	}
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < NWORKLOADS; i++) {
+			if (same_string(argv[j], workloads[i].name))
+				break;
+		}
+		if (i == NWORKLOADS) {
+			fprintf(stderr, "fsbench: no workload %s\n", argv[j]);
+			return EXIT_FAILURE;
+		}
+		run(&workloads[i]);
+	}
+
+	block_destruct();
+	return EXIT_SUCCESS;
+}
+
+/* Fill image_sim with zeros, so that fs_init() makes a new file system */
+static void make_image(void) {
+	char zeros[BLOCK_SIZE];
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen("image_sim", "w")) == NULL) {
+		perror("fsbench: image_sim");
+		exit(EXIT_FAILURE);
+	}
+	bzero(zeros, BLOCK_SIZE);
+	for (i = 0; i < IMAGE_BLOCKS; i++)
+		fwrite(zeros, BLOCK_SIZE, 1, fp);
+	fclose(fp);
+}
+
+/* Run one workload and print its line */
+static void run(struct workload *w) {
+	struct bcache_stat before, after;
+	struct timeval start, end;
+	int ops;
+
+	block_cache_stat(&before);
+	gettimeofday(&start, NULL);
+	ops = w->run();
+	gettimeofday(&end, NULL);
+	block_cache_stat(&after);
+
+	printf("%s,%d,%d,%d,%ld\n", w->name, ops,
+	       after.dev_reads - before.dev_reads,
+	       after.dev_writes - before.dev_writes,
+	       (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+}
+
+/* Exit if a file system call failed */
+static int check(int ret, char *what) {
+	if (ret < 0) {
+		fprintf(stderr, "fsbench: %s failed (%d)\n", what, ret);
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
+
+/* Store prefix followed by the number n in buf */
+static void name(char *buf, char *prefix, int n) {
+	sprintf(buf, "%s%d", prefix, n);
+}
+
+/* Make a directory full of small files, like configuration files */
+static int create(void) {
+	char file[MAX_FILENAME_LEN];
+	char data[] = "key=value\n";
+	int i, fd;
+
+	check(fs_mkdir("files"), "mkdir files");
+	check(fs_chdir("files"), "chdir files");
+	for (i = 0; i < CREATE_FILES; i++) {
+		name(file, "f", i);
+		fd = check(fs_open(file, MODE_WRONLY | MODE_CREAT), "create");
+		check(fs_write(fd, data, sizeof(data) - 1), "write");
+		check(fs_close(fd), "close");
+	}
+	check(fs_chdir(".."), "chdir ..");
+	return CREATE_FILES;
+}
+
+/* Open a file at the bottom of a deep directory tree, by full path */
+static int lookup(void) {
+	char path[MAX_PATH_LEN];
+	char dir[MAX_FILENAME_LEN];
+	int i;
+
+	path[0] = '\0';
+	for (i = 0; i < LOOKUP_DEPTH; i++) {
+		name(dir, "d", i);
+		check(fs_mkdir(dir), "mkdir");
+		check(fs_chdir(dir), "chdir");
+		strcpy(&path[strlen(path)], "/");
+		strcpy(&path[strlen(path)], dir);
+	}
+	check(fs_close(check(fs_open("leaf", MODE_WRONLY | MODE_CREAT), "create leaf")), "close");
+	check(fs_chdir("/"), "chdir /");
+
+	strcpy(&path[strlen(path)], "/leaf");
+	for (i = 0; i < LOOKUP_OPENS; i++)
+		check(fs_close(check(fs_open(path, MODE_RDONLY), "open")), "close");
+	return LOOKUP_OPENS;
+}
+
+/* Append short records to a log, reopening it now and then */
+static int append(void) {
+	char record[APPEND_SIZE + 1];
+	int i, fd = -1;
+
+	for (i = 0; i < APPEND_COUNT; i++) {
+		if (i % APPEND_REOPEN == 0) {
+			if (fd >= 0)
+				check(fs_close(fd), "close log");
+			fd = check(fs_open("log", MODE_WRONLY | MODE_CREAT), "open log");
+			check(fs_lseek(fd, 0, SEEK_END), "lseek log");
+		}
+		sprintf(record, "%0*d\n", APPEND_SIZE - 1, i);
+		check(fs_write(fd, record, APPEND_SIZE), "write log");
+	}
+	check(fs_close(fd), "close log");
+	return APPEND_COUNT;
+}
+
+/* Read all entries of the directory made by create() */
+static int list(void) {
+	dirent_t dirent;
+	int i, fd;
+
+	for (i = 0; i < LIST_COUNT; i++) {
+		fd = check(fs_open("files", MODE_RDONLY), "open files");
+		while (check(fs_read(fd, (char *)&dirent, sizeof(dirent_t)), "read files") > 0)
+			;
+		check(fs_close(fd), "close files");
+	}
+	return LIST_COUNT;
+}
+
+/* Make, write and remove short-lived files, like temporary files */
+static int churn(void) {
+	char data[CHURN_SIZE];
+	char file[MAX_FILENAME_LEN];
+	int i, fd;
+
+	bzero(data, CHURN_SIZE);
+	for (i = 0; i < CHURN_FILES; i++) {
+		name(file, "tmp", i);
+		fd = check(fs_open(file, MODE_WRONLY | MODE_CREAT), "create tmp");
+		check(fs_write(fd, data, CHURN_SIZE), "write tmp");
+		check(fs_close(fd), "close tmp");
+		check(fs_unlink(file), "unlink tmp");
+	}
+	return CHURN_FILES;
+}
+
+/* Write back everything still dirty in the cache */
+static int flush(void) {
+	check(block_flush(), "block_flush");
+	return 1;
+}
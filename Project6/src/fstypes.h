@@ -1,18 +1,61 @@
 #ifndef FSTYPES_H
 #define FSTYPES_H
 
-typedef short blknum_t; /* type for disk block number */
+typedef int blknum_t; /* type for disk block number */
 
 typedef int inode_t; /* type for index node number */
 
-/* filedescriptor entry */
+/* A run of count contiguous disk blocks starting at block start */
+typedef struct extent extent_t;
+struct extent {
+	blknum_t start;
+	int count;
+};
+
+/*
+ * An open file, made by fs_open(). Holds the offset used by fs_read,
+ * fs_write and fs_lseek, so every open of a file reads and writes
+ * independently of the others. Descriptors refer to open files by
+ * their index in the global open file table (see fs.c).
+ */
+typedef struct open_file open_file_t;
+struct open_file {
+	int refcount;      /* descriptors referring to this open file, 0 if unused */
+	inode_t ino;       /* the file */
+	unsigned int mode; /* mode bits (see MODE_XXX enum vals in fs.h) */
+	int pos;           /* read/write offset in bytes */
+	/* Sequential read-ahead state, see read_ahead() in fs.c */
+	int ra_pos;        /* byte offset where the last read ended */
+	int ra_next;       /* first file block the reader has not asked for */
+	int ra_end;        /* file blocks before this one have been read ahead */
+	int ra_window;     /* blocks to read beyond a request, 0 if not streaming */
+	int ra_hits;       /* blocks that were in the cache thanks to read-ahead */
+};
+
+/* filedescriptor entry, kept in the descriptor table of each process */
 typedef struct fd_entry fd_entry_t;
 struct fd_entry {
-	int idx;           //USED TO KEEP INODE NUMBER /* index into the global inode_table */ 
-	unsigned int mode; /* mode bits (see MODE_XXX enum vals in fs.h) */
+	int idx;           /* index into the global open file table, -1 if unused */
 };
 
 /* per-process maximum open file count */
 #define MAX_OPEN_FILES 10
 
+/*
+ * A file mapped into the address space of a process by fs_mmap(), kept
+ * in each process. The pages are read from the file when first touched
+ * (see page_fault_handler() in memory.c).
+ */
+typedef struct file_map file_map_t;
+struct file_map {
+	inode_t ino;       /* the file, -1 if the entry is unused */
+	int offset;        /* file offset of the first page */
+	int npages;        /* pages in the mapping */
+	int writable;      /* TRUE if changed pages are written back to the file */
+	int table;         /* page map index of the page table of the mapping */
+};
+
+/* per-process maximum number of file mappings */
+#define MAX_FILE_MAPS 4
+
 #endif /* FSTYPES_H */
\ No newline at end of file
@@ -7,31 +7,59 @@
  * that have this file as an entry. This can be used to
  * consistency-check the filesystem (the number of references made in all
  * directories should equal nlinks). The first NDIRECT blocks of the
- * file are located in the direct blocks. The rest are located in the
- * blocks listed in disk block given in indirect. The member type
+ * file are located in the direct blocks. The next NINDIRECT are located
+ * in the blocks listed in disk block given in indirect, and the rest in
+ * the blocks listed in the indirect blocks listed in dindirect (the
+ * double indirect block). The member type
  * describes the type of file this is (regular, directory). The size
  * member must be used to determine which direct and indirect entries
- * hold actual file data.
+ * hold actual file data. A block pointer of 0 means that no block is
+ * allocated (block 0 always holds the superblock), and reads of such
+ * a block return zeros. A file of at most INODE_INLINE_MAX bytes keeps
+ * its data in data[], where the block pointers would be, and has
+ * INODE_INLINE set in flags.
  */
 
+#include "block.h"
 #include "fstypes.h"
+#include "thread.h"
 
 #define INODE_NDIRECT 8 /* number of direct disk blocks in an inode */
+/* number of block pointers in the indirect block */
+#define INODE_NINDIRECT ((int)(BLOCK_SIZE / sizeof(blknum_t)))
+/* number of data blocks reached through the double indirect block */
+#define INODE_NDINDIRECT (INODE_NINDIRECT * INODE_NINDIRECT)
+/* largest number of data blocks a file can have */
+#define INODE_MAX_BLOCKS (INODE_NDIRECT + INODE_NINDIRECT + INODE_NDINDIRECT)
+
+/* largest file whose data is kept in the inode */
+#define INODE_INLINE_MAX ((int)((INODE_NDIRECT + 2) * sizeof(blknum_t)))
 
 #define INTYPE_FILE 1
 #define INTYPE_DIR 2
 
+#define INODE_INLINE 1 /* flags: the file data is in the inode */
+
 typedef struct disk_inode disk_inode_t;
 struct disk_inode {
 	short type;   /* file type */
+	short flags;  /* INODE_INLINE or 0 */
 	int size;     /* file size in bytes */
 	short nlinks; /* number of directory entries referring to this file */
-	/* pointers to the first NDIRECT blocks */
-	blknum_t direct[INODE_NDIRECT];
-	/*      blknum_t indirect; /\* The rest of the blocks *\/ */
+	union {
+		struct {
+			/* pointers to the first NDIRECT blocks */
+			blknum_t direct[INODE_NDIRECT];
+			blknum_t indirect; /* The next NINDIRECT blocks */
+			blknum_t dindirect; /* The rest of the blocks */
+		};
+		char data[INODE_INLINE_MAX]; /* contents of a small file */
+	};
 };
 
 #define INODE_BLK_SIZE 1
+/* number of inodes stored in one block of the inode area */
+#define INODES_PER_BLK ((int)(BLOCK_SIZE / sizeof(struct disk_inode)))
 
 /*
  * Index node as used in memory; contains everything that is stored on
@@ -39,17 +67,30 @@ struct disk_inode {
  * open_count: The number of opens done on this file.
  * inode_num: its inode_number.
  * dirty: True if the inode needs to be updated on disk.
- * pos: The current read/write position in bytes from start (if we implement fork(), then
- * we can't have this field here anymore).
+ * last_used: When the inode was last looked up, used to pick which
+ * inode to throw out of the inode cache.
+ * lock: Held while a system call reads or changes the inode or the
+ * file (or directory) contents, see ilock() in fs.c.
+ * pins: System calls holding or waiting for lock. A pinned inode stays
+ * in the inode cache.
+ * delayed, delay_first, delay_last: How many file blocks have data
+ * written but no disk block yet (see block_delay_modify()), and the
+ * lowest and highest index among them.
+ * goal: Where to look for the first block of the file, if it has none.
  */
 typedef struct mem_inode mem_inode_t;
 struct mem_inode {
 	struct disk_inode d_inode;	//The similar inode reciding on disk
 	short open_count;
-	int pos;	//Used when reading from file
-	int write_pos;	//Used when writing to file
-	inode_t inode_num; 			//Index in inode table
+	inode_t inode_num; 			//Inode number, -1 if the cache entry is unused
 	char dirty;
+	int last_used;
+	lock_t lock;
+	short pins;
+	short delayed;
+	int delay_first;
+	int delay_last;
+	blknum_t goal;
 };
 
 #endif /* INODE_H */
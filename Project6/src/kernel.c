@@ -1,3 +1,4 @@
+#include "aio.h"
 #include "common.h"
 #include "fs.h"
 #include "interrupt.h"
@@ -26,6 +27,7 @@ static int create_thread(int i);
 static int create_process(uint32_t location, uint32_t size);
 static pcb_t *alloc_pcb();
 static void insert_pcb(pcb_t *p);
+static void init_pcb_fs(pcb_t *p);
 
 /* System call table */
 syscall_t syscall[SYSCALL_COUNT];
@@ -55,6 +57,8 @@ static unsigned int start_addr[NUM_THREADS] = {
     (unsigned int)loader_thread, /* Loads shell */
     (unsigned int)clock_thread,  /* Running indefinitely */
     (unsigned int)usb_thread,    /* Scans USB hub port */
+    (unsigned int)flush_thread,  /* Writes file system changes to disk */
+    (unsigned int)io_thread,     /* Does asynchronous reads and writes */
     (unsigned int)thread2,       /* Test thread */
     (unsigned int)thread3        /* Test thread */
 };
@@ -85,7 +89,7 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_EXIT, (syscall_t)exit);
 	init_syscall(SYSCALL_GETPID, (syscall_t)getpid);
 	init_syscall(SYSCALL_GETPRIORITY, (syscall_t)getpriority);
-	init_syscall(SYSCALL_SETPRIORITY, (syscall_t)setpriority);
+	init_syscall(SYSCALL_SETPRIORITY, (syscall_t)(void (*)(void))setpriority);
 	init_syscall(SYSCALL_CPUSPEED, (syscall_t)cpuspeed);
 	init_syscall(SYSCALL_MBOX_OPEN, (syscall_t)mbox_open);
 	init_syscall(SYSCALL_MBOX_CLOSE, (syscall_t)mbox_close);
@@ -94,7 +98,8 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_MBOX_SEND, (syscall_t)mbox_send);
 	init_syscall(SYSCALL_GETCHAR, (syscall_t)getchar);
 	init_syscall(SYSCALL_READDIR, (syscall_t)readdir);
-	init_syscall(SYSCALL_LOADPROC, (syscall_t)loadproc);
+	init_syscall(SYSCALL_LOADPROC, (syscall_t)(void (*)(void))loadproc);
+	init_syscall(SYSCALL_FS_FSCK, (syscall_t)fs_fsck);
 	init_syscall(SYSCALL_FS_MKFS, (syscall_t)fs_mkfs);
 	init_syscall(SYSCALL_FS_OPEN, (syscall_t)fs_open);
 	init_syscall(SYSCALL_FS_CLOSE, (syscall_t)fs_close);
@@ -107,6 +112,18 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_FS_MKDIR, (syscall_t)fs_mkdir);
 	init_syscall(SYSCALL_FS_CHDIR, (syscall_t)fs_chdir);
 	init_syscall(SYSCALL_FS_RMDIR, (syscall_t)fs_rmdir);
+	init_syscall(SYSCALL_FS_READV, (syscall_t)fs_readv);
+	init_syscall(SYSCALL_FS_WRITEV, (syscall_t)fs_writev);
+	init_syscall(SYSCALL_FS_PREAD, (syscall_t)fs_pread_iov);
+	init_syscall(SYSCALL_FS_PWRITE, (syscall_t)fs_pwrite_iov);
+	init_syscall(SYSCALL_IOSTAT, (syscall_t)block_iostat);
+	init_syscall(SYSCALL_FS_SYNC, (syscall_t)fs_sync);
+	init_syscall(SYSCALL_FS_STATFS, (syscall_t)fs_statfs);
+	init_syscall(SYSCALL_FS_GETDENTS, (syscall_t)fs_getdents_iov);
+	init_syscall(SYSCALL_FS_MMAP, (syscall_t)fs_mmap);
+	init_syscall(SYSCALL_FS_MSYNC, (syscall_t)fs_msync);
+	init_syscall(SYSCALL_FS_READ_ASYNC, (syscall_t)aio_read);
+	init_syscall(SYSCALL_FS_WRITE_ASYNC, (syscall_t)aio_write);
 
 	init_idt();
 	init_gdt();
@@ -116,6 +133,7 @@ void _start(int load_size) {
 	/* Initialize various "subsystems" */
 	init_memory();
 	mbox_init();
+	aio_init();
 	time_init();
 	keyboard_init();
 	scsi_static_init();
@@ -515,6 +533,7 @@ static int create_thread(int i) {
 
 	p->swap_loc = 0;
 	p->swap_size = 0;
+	init_pcb_fs(p);
 	/* Sets p->page_directory = &(created page directory) */
 	setup_page_table(p);
 	insert_pcb(p);
@@ -566,6 +585,7 @@ static int create_process(uint32_t location, uint32_t size) {
 
 	p->swap_loc = location;
 	p->swap_size = size;
+	init_pcb_fs(p);
 	setup_page_table(p);
 
 	insert_pcb(p);
@@ -615,6 +635,20 @@ static void insert_pcb(pcb_t *p) {
 	STI_FL(eflags);
 }
 
+/*
+ * A new job starts in the root directory, with no open files. Its
+ * descriptor table refers to the open files it gets from fs_open().
+ */
+static void init_pcb_fs(pcb_t *p) {
+	int i;
+
+	p->cwd = 0;
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+		p->filedes[i].idx = -1;
+	for (i = 0; i < MAX_FILE_MAPS; i++)
+		p->maps[i].ino = -1;
+}
+
 /* put the pcb back into the free list */
 void free_pcb(pcb_t *p) {
 	long eflags;
@@ -52,7 +52,7 @@ enum
 	 * Number of threads initially started by the kernel. Change this
 	 * when adding to or removing elements from the start_addr array.
 	 */
-	NUM_THREADS = 5,
+	NUM_THREADS = 7,
 
 	/* Number of pcbs the OS supports */
 	PCB_TABLE_SIZE = 128,
@@ -130,6 +130,7 @@ struct pcb {
 	/* filesystem stuff */
 	inode_t cwd;
 	struct fd_entry filedes[MAX_OPEN_FILES];
+	struct file_map maps[MAX_FILE_MAPS];
 
 	struct pcb *next;     /* Used when job is in the ready queue */
 	struct pcb *previous; /* Used when job is in the ready queue */
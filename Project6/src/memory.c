@@ -9,10 +9,21 @@
  * same image without screwing up the running. It also means the
  * disk image is read once. And that we cannot use the program disk.
  *
+ * Files mapped with fs_mmap() are paged the same way, except that their
+ * pages are read from and written back to the file, through the file
+ * system. page_map_lock is let go while the file system works, since it
+ * may wait for the disk. A page fault taken while the kernel holds
+ * file system locks, like one on the buffer of an fs_read(), must not
+ * go to the file system, or it would wait for itself. So the file
+ * system calls refuse buffers in the mapping area (map_overlap()), and
+ * faults in kernel mode leave changed file pages alone.
+ *
  * Best viewed with tabs set to 4 spaces.
  */
 
 #include "common.h"
+#include "fs.h"
+#include "fs_error.h"
 #include "interrupt.h"
 #include "kernel.h"
 #include "memory.h"
@@ -23,11 +34,13 @@
 
 /*
  * page_alloc allocates a page.  If necessary, it swaps a page out.
- * On success, it returns the index of the page in the page map.  On
+ * Changed pages of mapped files are only swapped out if writeback is
+ * TRUE, that is, when the caller holds no file system locks. On
+ * success, it returns the index of the page in the page map.  On
  * failure, it aborts.  BUG: pages are not made free when a process
- * exits.
+ * exits (except those of file mappings).
  */
-static int page_alloc(int pinned);
+static int page_alloc(int pinned, int writeback);
 
 /* page_addr returns the physical address of the i-th page */
 static uint32_t *page_addr(int i);
@@ -36,7 +49,13 @@ static uint32_t *page_addr(int i);
  * page_replacement_policy returns the index in the page map of a page
  * to be swapped out
  */
-static int page_replacement_policy(void);
+static int page_replacement_policy(int writeback);
+
+/* may page i be swapped out? */
+static int page_replaceable(int i, int writeback);
+
+/* give page i back, for page_alloc to hand out again */
+static void page_free(int i);
 
 /* swap the i-th page in */
 static void page_swap_in(int pageno);
@@ -44,6 +63,18 @@ static void page_swap_in(int pageno);
 /* swap the i-th page out */
 static void page_swap_out(int pageno);
 
+/* read the i-th page in from the file mapping map */
+static void page_map_in(int pageno, file_map_t *map);
+
+/* write the i-th page back to the file it is mapped from */
+static void page_write_file(int pageno);
+
+/* is the page of p at vaddr being written back to its file? */
+static int page_writing(pcb_t *p, uint32_t vaddr);
+
+/* return the index of the file mapping holding vaddr, or -1 */
+static int map_find(pcb_t *p, uint32_t vaddr);
+
 /* return the disk_sector of the given page */
 static uint32_t page_disk_sector(page_map_entry_t *page);
 
@@ -54,12 +85,18 @@ static page_map_entry_t page_map[PAGEABLE_PAGES];
 /* lock to control the access to the page map */
 static lock_t page_map_lock;
 
+/* signalled when a page has been written back to its file */
+static condition_t page_written;
+
 /* address of the kernel page directory (shared by all kernel threads) */
 static uint32_t *kernel_pdir;
 
 /* addresses of the kernel page tables */
 static uint32_t *kernel_pts[N_KERNEL_PTS];
 
+/* virtual address of file mapping i of a process */
+#define MAP_ADDR(i) (MMAP_START + (i) * PTABLE_SPAN)
+
 /* Use virtual address to get index in page directory.  */
 inline uint32_t get_directory_index(uint32_t vaddr) {
 	return (vaddr & PAGE_DIRECTORY_MASK) >> PAGE_DIRECTORY_BITS;
@@ -149,16 +186,17 @@ void init_memory(void) {
 
 	/* initialize the lock to access the page map */
 	lock_init(&page_map_lock);
+	condition_init(&page_written);
 
 	/* allocate the kernel page directory */
-	p = page_alloc(TRUE);
+	p = page_alloc(TRUE, FALSE);
 	kernel_pdir = page_addr(p);
 
 	/* for each kernel page table */
 	pbaddr = 0;
 	for (i = 0; i < N_KERNEL_PTS; i++) {
 		/* allocate the page table */
-		p = page_alloc(TRUE);
+		p = page_alloc(TRUE, FALSE);
 		kernel_pts[i] = page_addr(p);
 
 		/* Insert table into the page directory */
@@ -173,6 +211,14 @@ void init_memory(void) {
 		}
 	}
 
+	/* The block bitmap of fs_fsck(), see fs.h */
+	for (pbaddr = FSCK_MEM_START; pbaddr < FSCK_MEM_START + FSCK_MEM_SIZE; pbaddr += PAGE_SIZE)
+		table_map_page(kernel_pts[0], pbaddr, pbaddr, PE_P | PE_RW);
+
+	/* The buffer cache, see block.h */
+	for (pbaddr = BCACHE_MEM_START; pbaddr < BCACHE_MEM_START + BCACHE_MEM_SIZE; pbaddr += PAGE_SIZE)
+		table_map_page(kernel_pts[0], pbaddr, pbaddr, PE_P | PE_RW);
+
 	/* Give the user permission to write on the screen */
 	page_set_mode(kernel_pdir, (uint32_t)SCREEN_ADDR, PE_P | PE_RW | PE_US);
 }
@@ -203,11 +249,11 @@ void setup_page_table(pcb_t *p) {
 		int i, pdir, ptbl, stkt, stkp1, stkp2;
 
 		/* allocate the four pages and pin them immediately */
-		pdir = page_alloc(TRUE);  /* page directory */
-		ptbl = page_alloc(TRUE);  /* page table */
-		stkt = page_alloc(TRUE);  /* stack page table */
-		stkp1 = page_alloc(TRUE); /* stack page 1 */
-		stkp2 = page_alloc(TRUE); /* stack page 2 */
+		pdir = page_alloc(TRUE, TRUE);  /* page directory */
+		ptbl = page_alloc(TRUE, TRUE);  /* page table */
+		stkt = page_alloc(TRUE, TRUE);  /* stack page table */
+		stkp1 = page_alloc(TRUE, TRUE); /* stack page 1 */
+		stkp2 = page_alloc(TRUE, TRUE); /* stack page 2 */
 
 		/* save process page directory address */
 		pde = page_addr(pdir);
@@ -286,6 +332,8 @@ void page_fault_handler(void) {
 	uint32_t *pta;          /* page table address */
 	int pidx;               /* page index in page map */
 	page_map_entry_t *page; /* ptr to page map entry of a page */
+	int map;                /* file mapping of the page, -1 if none */
+	int user;               /* did the fault happen in user mode? */
 
 	current_running->page_fault_count++;
 	lock_acquire(&page_map_lock);
@@ -322,7 +370,27 @@ void page_fault_handler(void) {
 		if (pte & PE_P)
 			page_protection_error(pde, pte);
 
-		pidx = page_alloc(FALSE);
+		/*
+		 * A fault in user mode is taken with no kernel locks
+		 * held, so a changed file page may be written back to
+		 * make room. A file page is pinned while it is read in.
+		 */
+		map = map_find(current_running, current_running->fault_addr);
+		user = (current_running->error_code & PF_USER) != 0;
+
+		/* past the end of a file mapping */
+		if ((map < 0) && (current_running->fault_addr >= MMAP_START) && (current_running->fault_addr < MAP_ADDR(MAX_FILE_MAPS)))
+			page_protection_error(pde, pte);
+
+		/*
+		 * A file page swapped out is not present while it is
+		 * written back, and must not be read in from the file
+		 * before the write is done.
+		 */
+		while ((map >= 0) && page_writing(current_running, current_running->fault_addr & PE_BASE_ADDR_MASK))
+			condition_wait(&page_map_lock, &page_written);
+
+		pidx = page_alloc(map >= 0, user);
 
 		/* update the mapping for the new page */
 		page = &page_map[pidx];
@@ -331,9 +399,14 @@ void page_fault_handler(void) {
 		page->swap_size = current_running->swap_size;
 		page->vaddr = current_running->fault_addr & PE_BASE_ADDR_MASK;
 		page->entry = &pta[pti];
-		page->pinned = FALSE;
 
-		page_swap_in(pidx);
+		if (map >= 0) {
+			page_map_in(pidx, &current_running->maps[map]);
+		}
+		else {
+			page->pinned = FALSE;
+			page_swap_in(pidx);
+		}
 	}
 	lock_release(&page_map_lock);
 }
@@ -346,7 +419,7 @@ void page_fault_handler(void) {
  *
  * Swaps out a page if no space is available.
  */
-static int page_alloc(int pinned) {
+static int page_alloc(int pinned, int writeback) {
 	static int dole_ptr = 0;
 	int i, page;
 	uint32_t *p;
@@ -358,8 +431,9 @@ static int page_alloc(int pinned) {
 	}
 	else {
 		/* no free pages left: swap a page out */
-		page = page_replacement_policy();
-		page_swap_out(page);
+		page = page_replacement_policy(writeback);
+		if (page_map[page].entry != NULL)
+			page_swap_out(page);
 	}
 	ASSERT((page >= 0) && (page < PAGEABLE_PAGES));
 
@@ -370,6 +444,10 @@ static int page_alloc(int pinned) {
 	page_map[page].vaddr = 0;
 	page_map[page].entry = NULL;
 	page_map[page].pinned = pinned;
+	page_map[page].ino = -1;
+	page_map[page].offset = 0;
+	page_map[page].io_pins = 0;
+	page_map[page].writing = FALSE;
 
 	/* Zero out page before returning  */
 	p = page_addr(page);
@@ -390,17 +468,23 @@ static uint32_t *page_addr(int i) {
 }
 
 /* Decide which page to replace, return the page number  */
-static int page_replacement_policy(void) {
+static int page_replacement_policy(int writeback) {
 	static int page = -1;
 	bool_t found;
 	int i;
 
-	/* check if there is any page not pinned */
+	/* a page given back by page_free() is used first */
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		if ((page_map[i].pinned == FALSE) && (page_map[i].io_pins == 0) && (page_map[i].entry == NULL))
+			return i;
+	}
+
+	/* check if there is any page that may be replaced */
 	found = FALSE;
 	i = 0;
 	while ((!found) && (i < PAGEABLE_PAGES)) {
+		found = page_replaceable(i, writeback);
 		i++;
-		found = (page_map[i].pinned == FALSE);
 	}
 	ASSERT2(found, "All pages pinned");
 
@@ -412,11 +496,39 @@ static int page_replacement_policy(void) {
 		page++;
 		if (page >= PAGEABLE_PAGES)
 			page = 0;
-		if (page_map[page].pinned == FALSE)
+		if (page_replaceable(page, writeback))
 			return page;
 	}
 }
 
+/*
+ * A page may be replaced if it is not pinned. A changed page of a
+ * mapped file also needs writeback, since the file system writes it.
+ */
+static int page_replaceable(int i, int writeback) {
+	page_map_entry_t *page = &page_map[i];
+
+	if (page->pinned || (page->io_pins > 0))
+		return FALSE;
+	return writeback || (page->ino < 0) || ((*page->entry & PE_D) == 0);
+}
+
+/* Unmap page i and make it free */
+static void page_free(int i) {
+	page_map_entry_t *page = &page_map[i];
+
+	if (page->entry != NULL) {
+		*page->entry = 0;
+		invalidate_page((uint32_t *)page->vaddr);
+	}
+	page->owner = NULL;
+	page->vaddr = 0;
+	page->entry = NULL;
+	page->pinned = FALSE;
+	page->ino = -1;
+	page->offset = 0;
+}
+
 /* Swap page in from image */
 static void page_swap_in(int pageno) {
 	page_map_entry_t *page = &page_map[pageno];
@@ -475,8 +587,12 @@ static void page_swap_out(int pageno) {
 
 	scrprintf(24, 71, "0");
 
+	/* a changed page of a mapped file goes back to the file */
+	if ((page->ino >= 0) && ((*page->entry & PE_D) != 0)) {
+		page_write_file(pageno);
+	}
 	/* if page is dirty */
-	if ((*page->entry & PE_D) != 0) {
+	else if ((page->ino < 0) && ((*page->entry & PE_D) != 0)) {
 		uint32_t sector, nsectors, addr;
 
 		sector = page_disk_sector(page);
@@ -501,3 +617,257 @@ static void page_swap_out(int pageno) {
 static uint32_t page_disk_sector(page_map_entry_t *page) {
 	return page->swap_loc + ((page->vaddr - PROCESS_START) / PAGE_SIZE) * SECTORS_PER_PAGE;
 }
+
+/*
+ * Read page pageno in from the file mapping map, with the page pinned.
+ * Bytes past the end of the file are left zero. The page is only
+ * writable if the file was opened for writing.
+ */
+static void page_map_in(int pageno, file_map_t *map) {
+	page_map_entry_t *page = &page_map[pageno];
+	uint32_t addr = (uint32_t)page_addr(pageno);
+	uint32_t mode = PE_P | PE_US | PE_A;
+
+	page->ino = map->ino;
+	page->offset = map->offset + (page->vaddr & (PTABLE_SPAN - 1));
+
+	scrprintf(23, 50, "pid %-3d rding page %-3d", current_running->pid, pageno);
+
+	lock_release(&page_map_lock);
+	fs_map_read(page->ino, page->offset, (char *)addr, PAGE_SIZE);
+	lock_acquire(&page_map_lock);
+
+	if (map->writable)
+		mode |= PE_RW;
+	*page->entry = mode | addr;
+	page->pinned = FALSE;
+}
+
+/*
+ * Write page pageno back to the file it is mapped from. The file
+ * system may wait for the disk, so page_map_lock is let go meanwhile,
+ * with the page pinned to keep it where it is. The page is marked as
+ * writing until the write is done, so that its owner waits for it
+ * before faulting it in again from the file.
+ */
+static void page_write_file(int pageno) {
+	page_map_entry_t *page = &page_map[pageno];
+	bool_t pinned = page->pinned;
+
+	page->pinned = TRUE;
+	page->writing = TRUE;
+	lock_release(&page_map_lock);
+	fs_map_write(page->ino, page->offset, (char *)page_addr(pageno), PAGE_SIZE);
+	lock_acquire(&page_map_lock);
+	page->pinned = pinned;
+	page->writing = FALSE;
+	condition_broadcast(&page_written);
+}
+
+/* Is the page of process p at vaddr being written back to its file? */
+static int page_writing(pcb_t *p, uint32_t vaddr) {
+	int i;
+
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		if (page_map[i].writing && (page_map[i].owner == p) && (page_map[i].vaddr == vaddr))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Find the file mapping of process p holding address vaddr */
+static int map_find(pcb_t *p, uint32_t vaddr) {
+	int i;
+
+	if ((vaddr < MMAP_START) || (vaddr >= MAP_ADDR(MAX_FILE_MAPS)))
+		return -1;
+	i = (vaddr - MMAP_START) / PTABLE_SPAN;
+	if ((p->maps[i].ino < 0) || ((int)get_table_index(vaddr) >= p->maps[i].npages))
+		return -1;
+	return i;
+}
+
+/*
+ * Does the size bytes at addr reach into the area where files are
+ * mapped? Faults there are served through the file system, so a file
+ * system call, which copies to and from its buffers while it holds
+ * file system locks, must not be given such a buffer.
+ */
+int map_overlap(uint32_t addr, int size) {
+	if (size < 1)
+		size = 1;
+	if (addr >= MAP_ADDR(MAX_FILE_MAPS))
+		return FALSE;
+	return (addr >= MMAP_START) || ((uint32_t)size > MMAP_START - addr);
+}
+
+/*
+ * Map a file into the address space of current_running. The mapping
+ * gets a page table of its own, with no pages present, so they are
+ * read from the file by page_fault_handler() when first touched.
+ */
+int fs_mmap(int fd, int offset, int size) {
+	file_map_t *map;
+	inode_t ino;
+	int i, writable;
+
+	/* threads share the kernel page directory */
+	if (current_running->is_thread)
+		return FSE_ERROR;
+	if ((offset < 0) || ((offset % PAGE_SIZE) != 0))
+		return FSE_INVALIDOFFSET;
+	if ((size <= 0) || (size > PTABLE_SPAN))
+		return FSE_ERROR;
+
+	for (i = 0; i < MAX_FILE_MAPS; i++) {
+		if (current_running->maps[i].ino < 0)
+			break;
+	}
+	if (i == MAX_FILE_MAPS)
+		return FSE_NOMOREFDTE;
+
+	/* the file stays open until the process exits */
+	ino = fs_map_get(fd, &writable);
+	if (ino < 0)
+		return ino;
+
+	lock_acquire(&page_map_lock);
+	map = &current_running->maps[i];
+	map->ino = ino;
+	map->offset = offset;
+	map->npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	map->writable = writable;
+	map->table = page_alloc(TRUE, TRUE);
+	dir_ins_table(current_running->page_directory, MAP_ADDR(i), page_addr(map->table), PE_P | PE_RW | PE_US);
+	lock_release(&page_map_lock);
+
+	return MAP_ADDR(i);
+}
+
+/*
+ * Write the changed pages of a file mapping of current_running back
+ * to the file, where fs_read() sees them. Like data written with
+ * fs_write(), they reach the disk with the next fs_sync.
+ */
+int fs_msync(int addr, int size) {
+	page_map_entry_t *page;
+	uint32_t start, end;
+	int i;
+
+	i = map_find(current_running, addr);
+	if (i < 0)
+		return FSE_INVALIDOFFSET;
+	if (size < 0)
+		return FSE_ERROR;
+
+	start = addr & PE_BASE_ADDR_MASK;
+	end = MAP_ADDR(i) + current_running->maps[i].npages * PAGE_SIZE;
+	if ((uint32_t)size < end - addr)
+		end = addr + size;
+
+	lock_acquire(&page_map_lock);
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		page = &page_map[i];
+		if ((page->owner != current_running) || (page->ino < 0) || (page->vaddr < start) || (page->vaddr >= end))
+			continue;
+		if ((*page->entry & (PE_P | PE_D)) == (PE_P | PE_D)) {
+			/* the page is clean once written */
+			*page->entry &= ~PE_D;
+			invalidate_page((uint32_t *)page->vaddr);
+			page_write_file(i);
+		}
+	}
+	lock_release(&page_map_lock);
+
+	return FSE_OK;
+}
+
+/*
+ * Write back the file mappings of current_running, and give their
+ * pages and page tables back. The files are then let go.
+ */
+void unmap_files(void) {
+	file_map_t *map;
+	uint32_t start, end;
+	int i, j;
+
+	for (i = 0; i < MAX_FILE_MAPS; i++) {
+		map = &current_running->maps[i];
+		if (map->ino < 0)
+			continue;
+
+		start = MAP_ADDR(i);
+		end = start + map->npages * PAGE_SIZE;
+		fs_msync(start, end - start);
+
+		lock_acquire(&page_map_lock);
+		for (j = 0; j < PAGEABLE_PAGES; j++) {
+			if ((page_map[j].owner == current_running) && (page_map[j].ino >= 0) && (page_map[j].vaddr >= start) && (page_map[j].vaddr < end))
+				page_free(j);
+		}
+		current_running->page_directory[get_directory_index(start)] = 0;
+		page_free(map->table);
+		lock_release(&page_map_lock);
+
+		fs_map_put(map->ino);
+		map->ino = -1;
+	}
+}
+
+/*
+ * Pin a page of current_running for I/O. A page that is not present
+ * is faulted in by touching it, as the process would, with
+ * page_map_lock let go, and looked up again, since it may be thrown
+ * out before the lock is back. Only user pages in the pageable memory
+ * can be pinned.
+ */
+uint32_t page_pin(uint32_t vaddr, int write) {
+	uint32_t pde, *pte, paddr;
+
+	lock_acquire(&page_map_lock);
+	while (1) {
+		pde = current_running->page_directory[get_directory_index(vaddr)];
+		if ((pde & PE_P) == 0) {
+			lock_release(&page_map_lock);
+			return 0;
+		}
+		pte = &((uint32_t *)(pde & PE_BASE_ADDR_MASK))[get_table_index(vaddr)];
+		if ((*pte & PE_P) != 0)
+			break;
+		/* not present, and not a page the process may fault in */
+		if (((*pte & PE_US) == 0) && (map_find(current_running, vaddr) < 0)) {
+			lock_release(&page_map_lock);
+			return 0;
+		}
+
+		lock_release(&page_map_lock);
+		(void)*(volatile char *)vaddr;
+		lock_acquire(&page_map_lock);
+	}
+
+	paddr = *pte & PE_BASE_ADDR_MASK;
+	if (((*pte & PE_US) == 0) || (write && ((*pte & PE_RW) == 0)) || (paddr < MEM_START) || (paddr >= MAX_PHYSICAL_MEMORY)) {
+		lock_release(&page_map_lock);
+		return 0;
+	}
+	page_map[(paddr - MEM_START) / PAGE_SIZE].io_pins++;
+	lock_release(&page_map_lock);
+
+	return paddr | (vaddr & PAGE_MASK);
+}
+
+/*
+ * Unpin a page pinned by page_pin(). The kernel wrote it through its
+ * physical address, which does not set the dirty bit of the process'
+ * page table entry, so that is done here.
+ */
+void page_unpin(uint32_t paddr, int dirty) {
+	page_map_entry_t *page = &page_map[((paddr & PE_BASE_ADDR_MASK) - MEM_START) / PAGE_SIZE];
+
+	lock_acquire(&page_map_lock);
+	page->io_pins--;
+	/* the page may have been let go by unmap_files() meanwhile */
+	if (dirty && (page->entry != NULL))
+		*page->entry |= PE_D;
+	lock_release(&page_map_lock);
+}
@@ -23,6 +23,9 @@ enum
 	PE_BASE_ADDR_BITS = 12,         /* position of base address */
 	PE_BASE_ADDR_MASK = 0xfffff000, /* extracts the base address */
 
+	/* page fault error code bits (PMSA p.250) */
+	PF_USER = 1 << 2,               /* fault happened in user mode */
+
 	/* Constants to simulate a very small physical memory. */
 	MEM_START = 0x100000, /* 1MB */
 	PAGEABLE_PAGES = 33,
@@ -31,6 +34,12 @@ enum
 	/* number of kernel page tables */
 	N_KERNEL_PTS = 1,
 
+	/*
+	 * Files are mapped from here on, each mapping of a process in
+	 * its own page table span.
+	 */
+	MMAP_START = 0x40000000,
+
 	PAGE_DIRECTORY_BITS = 22,         /* position of page dir index */
 	PAGE_TABLE_BITS = 12,             /* position of page table index */
 	PAGE_DIRECTORY_MASK = 0xffc00000, /* page directory mask */
@@ -50,6 +59,10 @@ typedef struct {
 	uint32_t vaddr;  /* page-aligned virtual address of this page */
 	uint32_t *entry; /* entry that points to this page */
 	bool_t pinned;   /* is this page pinned? */
+	inode_t ino;     /* file this page is mapped from, -1 if none */
+	int offset;      /* offset of the page in that file */
+	int io_pins;     /* times pinned by page_pin() */
+	bool_t writing;  /* being written back to its file? */
 } page_map_entry_t;
 
 /* Prototypes */
@@ -68,4 +81,39 @@ void setup_page_table(pcb_t *p);
  */
 void page_fault_handler(void);
 
+/*
+ * Map size bytes of open file fd, from offset (a multiple of
+ * PAGE_SIZE), into the address space of current_running. Returns the
+ * address of the mapping, or a negative FSE_XXX error. The fs_mmap
+ * system call.
+ */
+int fs_mmap(int fd, int offset, int size);
+
+/*
+ * Write the changed pages of the mapping between addr and addr + size
+ * back to the file. The fs_msync system call.
+ */
+int fs_msync(int addr, int size);
+
+/*
+ * Write back and remove the file mappings of current_running. Called
+ * when a process exits.
+ */
+void unmap_files(void);
+
+/*
+ * TRUE if the size bytes at addr overlap the area where files are
+ * mapped. The file system calls refuse such buffers.
+ */
+int map_overlap(uint32_t addr, int size);
+
+/*
+ * Pin the page holding address vaddr of current_running, so that the
+ * kernel can do I/O on it later through its physical address, which
+ * is returned (0 if vaddr may not be used, or written if write is
+ * TRUE). page_unpin() lets it go, and marks it changed if dirty.
+ */
+uint32_t page_pin(uint32_t vaddr, int write);
+void page_unpin(uint32_t paddr, int dirty);
+
 #endif /* !MEMORY_H */
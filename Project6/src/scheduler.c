@@ -1,5 +1,7 @@
+#include "fs.h"
 #include "interrupt.h"
 #include "kernel.h"
+#include "memory.h"
 #include "scheduler.h"
 #include "thread.h"
 #include "time.h"
@@ -106,6 +108,9 @@ void setup_current_running(void) {
  * not be scheduled in the future
  */
 void exit(void) {
+	/* Let go of the files the job has mapped and open */
+	unmap_files();
+	fs_exit();
 	enter_critical();
 	current_running->status = EXITED;
 	/* Removes job from ready queue, and dispatchs next job to run */
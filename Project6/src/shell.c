@@ -34,6 +34,11 @@ static void ls(char *path);
 static void cat(char *filename);
 static void more(char *filename);
 static void stat(char *filename);
+static int find_inode(char *path);
+static void fsck(void);
+static void df(void);
+static void iostat(void);
+static void iostat_line(char *name, struct io_counts *c);
 
 /* cursor coordinate */
 int cursor = 0;
@@ -273,6 +278,55 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("fsck", argv[0])) {
+			if (argc == 1) {
+				fsck();
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("mkfs", argv[0])) {
+			if (argc == 1) {
+				fs_mkfs();
+				fs_chdir("/");
+				cwd[0] = '/';
+				cwd[1] = '\0';
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if (fs_sync() < 0)
+					shprintf(" : error occured.\n");
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("df", argv[0])) {
+			if (argc == 1) {
+				df();
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("iostat", argv[0])) {
+			if (argc == 1) {
+				iostat();
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
 		else {
 			shprintf("%s : Command not found.\n", argv[0]);
 		}
@@ -419,12 +473,13 @@ static void change_cwd(char *cwd, char *path) {
 }
 
 /*
- * ls - print out a unsorted list of filenames.
+ * ls - print out a unsorted list of filenames. The entries are
+ * fetched a directory block at a time with fs_getdents.
  * TODO: sort files.
  */
 static void ls(char *cwd) {
-	int fd, ev;
-	struct dirent de;
+	int fd, ev, i, cookie = 0;
+	struct dirent de[DIR_BLOCK_ENTRIES];
 
 	if ((fd = fs_open(cwd, MODE_RDONLY)) < 0) {
 		shprintf("ls: Could not open directory\n");
@@ -432,13 +487,15 @@ static void ls(char *cwd) {
 	}
 
 	while (1) {
-		ev = fs_read(fd, (char *)&de, sizeof(struct dirent));
-		if (ev < 0)
+		ev = fs_getdents(fd, (char *)de, sizeof(de), &cookie);
+		if (ev < 0) {
 			shprintf(" : error occured.\n");
+			break;
+		}
 		else if (ev == 0)
 			break;
-		else
-			shprintf("%s %d\n", de.name, de.inode);
+		for (i = 0; i < ev / (int)sizeof(struct dirent); i++)
+			shprintf("%s %d\n", de[i].name, de[i].inode);
 	}
 
 	if ((ev = fs_close(fd)) < 0)
@@ -471,8 +528,8 @@ static void cat(char *filename) {
 
 /* more */
 static void more(char *filename) {
-	int fd, read, ev;
-	char buf[BLOCK_SIZE];
+	int fd, read, ev, window, hits;
+	char buf[BLOCK_SIZE + 1], stat_buf[STAT_SIZE];
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) < 0) {
 		shprintf("more> Could not open file\n");
@@ -489,13 +546,19 @@ static void more(char *filename) {
 		shprintf("%s\n", buf);
 	}
 
+	if (fs_stat(fd, stat_buf) == 0) {
+		bcopy(&stat_buf[14], (char *)&window, sizeof(int));
+		bcopy(&stat_buf[18], (char *)&hits, sizeof(int));
+		shprintf("read-ahead window: %d hits: %d\n", window, hits);
+	}
+
 	if ((ev = fs_close(fd)) < 0)
 		shprintf(" : error occured.\n");
 }
 
 /* Return the status information about a file */
 static void stat(char *filename) {
-	int fd, size, ev;
+	int fd, size, hits, misses, ev;
 	char buf[STAT_SIZE], type, refs;
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) == -1) {
@@ -511,14 +574,116 @@ static void stat(char *filename) {
 	bcopy(&buf[2], (char *)&size, sizeof(int));
 
 	shprintf("filename: %s\n", filename);
+	shprintf("inode: %d\n", find_inode(filename));
 	shprintf("type: %d\n", type);
 	shprintf("references: %d\n", refs);
 	shprintf("size: %d\n", size);
+	bcopy(&buf[6], (char *)&hits, sizeof(int));
+	bcopy(&buf[10], (char *)&misses, sizeof(int));
+	shprintf("dentry cache hits: %d misses: %d\n", hits, misses);
 
 	if ((ev = fs_close(fd)) < 0)
 		shprintf(" : error occured.\n");
 }
 
+/*
+ * Return the inode number of path, from its entry in the directory
+ * holding it, which is read with fs_getdents. Returns -1 if there is
+ * no such entry.
+ */
+static int find_inode(char *path) {
+	struct dirent de[DIR_BLOCK_ENTRIES];
+	char dir[MAX_PATH_LEN], *name = path, *s;
+	int fd, n, i, cookie = 0, ino = -1;
+
+	for (s = path; *s != '\0'; s++) {
+		if (*s == '/')
+			name = s + 1;
+	}
+	if (name == path)
+		strcpy(dir, ".");
+	else if (name == path + 1)
+		strcpy(dir, "/");
+	else
+		strlcpy(dir, path, name - path);
+	if (*name == '\0')
+		name = ".";
+
+	if ((fd = fs_open(dir, MODE_RDONLY)) < 0)
+		return -1;
+	while (ino < 0 && (n = fs_getdents(fd, (char *)de, sizeof(de), &cookie)) > 0) {
+		for (i = 0; i < n / (int)sizeof(struct dirent); i++) {
+			if (same_string(de[i].name, name))
+				ino = de[i].inode;
+		}
+	}
+	fs_close(fd);
+	return ino;
+}
+
+/* Check and repair the file system, and print what was found */
+static void fsck(void) {
+	struct fsck_stat st;
+	int problems;
+
+	problems = fs_fsck(TRUE, &st);
+	if (problems < 0) {
+		shprintf(" : error occured.\n");
+		return;
+	}
+
+	shprintf("inodes: %d blocks: %d\n", st.inodes, st.blocks);
+	shprintf("bad entries: %d bad directory sizes: %d\n", st.bad_entries, st.bad_sizes);
+	shprintf("bad link counts: %d orphans: %d bad block pointers: %d\n", st.bad_links, st.orphans, st.bad_pointers);
+	shprintf("bad inode bitmap bits: %d bad block bitmap bits: %d\n", st.bad_ibmap, st.bad_dbmap);
+	shprintf("bad free counts: %d\n", st.bad_counts);
+	shprintf("%d problems%s, %d Kcycles\n", problems, st.repaired ? " repaired" : "", (int)(st.tsc >> 10));
+}
+
+/* Print the size of the file system and how much of it is free */
+static void df(void) {
+	struct fs_statfs st;
+
+	if (fs_statfs(&st) < 0) {
+		shprintf(" : error occured.\n");
+		return;
+	}
+
+	shprintf("%d blocks of %d bytes, %d free\n", st.blocks, st.block_size, st.free_blocks);
+	shprintf("%d inodes, %d free\n", st.inodes, st.free_inodes);
+	shprintf("%d allocation groups of %d blocks\n", st.groups, st.group_blocks);
+}
+
+/* Print the I/O statistics of the block device */
+static void iostat(void) {
+	struct iostat st;
+
+	io_stat(&st);
+
+	iostat_line("block read", &st.block[0]);
+	iostat_line("block write", &st.block[1]);
+	iostat_line("scsi read", &st.scsi[0]);
+	iostat_line("scsi write", &st.scsi[1]);
+	shprintf("bounced blocks: %d\n", st.bounced);
+}
+
+/*
+ * Print the counters of one layer and direction, and the nonempty
+ * latency buckets as log2(cycles):requests
+ */
+static void iostat_line(char *name, struct io_counts *c) {
+	int i;
+
+	shprintf("%s: %d ops %d sectors %d bytes %d errors %d Kcycles\n", name,
+	         c->ops, c->sectors, c->bytes, c->errors, (int)(c->tsc >> 10));
+	shprintf("  waits: %d (%d Kcycles) latency:", c->waits, (int)(c->wait_tsc >> 10));
+	for (i = 0; i < IOSTAT_BUCKETS; i++) {
+		if (c->hist[i] > 0)
+			shprintf(" %d:%d", i, c->hist[i]);
+	}
+	shprintf("\n");
+}
+
 /* Shell write */
 static int shwrite(void *drop, char c) {
 	int x;
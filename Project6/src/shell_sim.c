@@ -32,6 +32,10 @@ static void ls(char *path);
 static void cat(char *filename);
 static void more(char *filename);
 static void stat(char *filename);
+static int find_inode(char *path);
+static void bcache(void);
+static void fsck(void);
+static void df(void);
 
 const int os_size = 0;
 
@@ -156,6 +160,50 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("bcache", argv[0])) {
+			if (argc == 1) {
+				bcache();
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("fsck", argv[0])) {
+			if (argc == 1) {
+				fsck();
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_sync()) < 0)
+					print_fse(ev);
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("df", argv[0])) {
+			if (argc == 1) {
+				df();
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("mkfs", argv[0])) {
+			if (argc == 1) {
+				fs_mkfs();
+				current_running->cwd = 0;
+				strcpy(cwd, "/");
+			}
+			else {
+				usage(argv[0], "");
+				continue;
+			}
+		}
 		else if (same_string("exit", argv[0])) {
 			if (argc == 1) {
 				block_destruct();
@@ -290,12 +338,13 @@ static void change_cwd(char *cwd, char *path) {
 	*s = '\0';
 }
 
-/* ls - print out a unsorted list of filenames.
+/* ls - print out a unsorted list of filenames. The entries are
+ * fetched a directory block at a time with fs_getdents.
  * TODO: sort files.
  */
 static void ls(char *cwd) {
-	int fd, ev;
-	struct dirent de;
+	int fd, ev, i, cookie = 0;
+	struct dirent de[DIR_BLOCK_ENTRIES];
 
 	if ((fd = fs_open(cwd, MODE_RDONLY)) < 0) {
 		printf("ls: Could not open directory\n");
@@ -304,13 +353,15 @@ static void ls(char *cwd) {
 	}
 
 	while (1) {
-		ev = fs_read(fd, (char *)&de, sizeof(struct dirent));
-		if (ev < 0)
+		ev = fs_getdents(fd, (char *)de, sizeof(de), &cookie);
+		if (ev < 0) {
 			print_fse(ev);
+			break;
+		}
 		else if (ev == 0)
 			break;
-		else
-			printf("\t%s %d\n", de.name, de.inode);
+		for (i = 0; i < ev / (int)sizeof(struct dirent); i++)
+			printf("\t%s %d\n", de[i].name, de[i].inode);
 	}
 
 	if ((ev = fs_close(fd)) < 0)
@@ -346,8 +397,8 @@ static void cat(char *filename) {
 
 /* more */
 static void more(char *filename) {
-	int fd, read, ev;
-	char buf[BLOCK_SIZE];
+	int fd, read, ev, window, hits;
+	char buf[BLOCK_SIZE + 1], stat_buf[STAT_SIZE];
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) < 0) {
 		printf("more> Could not open file %s\n", filename);
@@ -365,13 +416,19 @@ static void more(char *filename) {
 		printf("more> %s\n", buf);
 	}
 
+	if (fs_stat(fd, stat_buf) == 0) {
+		bcopy(&stat_buf[14], (char *)&window, sizeof(int));
+		bcopy(&stat_buf[18], (char *)&hits, sizeof(int));
+		printf("read-ahead window: %d hits: %d\n", window, hits);
+	}
+
 	if ((ev = fs_close(fd)) < 0)
 		print_fse(ev);
 }
 
 /* Return the status information about a file */
 static void stat(char *filename) {
-	int fd, size, ev;
+	int fd, size, hits, misses, ev;
 	char buf[STAT_SIZE], type, refs;
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) == -1) {
@@ -389,11 +446,99 @@ static void stat(char *filename) {
 	printf("stat\n"
 	       "filename: type, refs, size\n");
 	printf("%s: %d %d %d\n", filename, type, refs, size);
+	printf("inode: %d\n", find_inode(filename));
+	bcopy(&buf[6], (char *)&hits, sizeof(int));
+	bcopy(&buf[10], (char *)&misses, sizeof(int));
+	printf("dentry cache hits: %d misses: %d\n", hits, misses);
 
 	if ((ev = fs_close(fd)) < 0)
 		print_fse(ev);
 }
 
+/* Return the inode number of path, from its entry in the directory
+ * holding it, which is read with fs_getdents. Returns -1 if there is
+ * no such entry.
+ */
+static int find_inode(char *path) {
+	struct dirent de[DIR_BLOCK_ENTRIES];
+	char dir[MAX_PATH_LEN], *name = path, *s;
+	int fd, n, i, cookie = 0, ino = -1;
+
+	for (s = path; *s != '\0'; s++) {
+		if (*s == '/')
+			name = s + 1;
+	}
+	if (name == path)
+		strcpy(dir, ".");
+	else if (name == path + 1)
+		strcpy(dir, "/");
+	else
+		strlcpy(dir, path, name - path);
+	if (*name == '\0')
+		name = ".";
+
+	if ((fd = fs_open(dir, MODE_RDONLY)) < 0)
+		return -1;
+	while (ino < 0 && (n = fs_getdents(fd, (char *)de, sizeof(de), &cookie)) > 0) {
+		for (i = 0; i < n / (int)sizeof(struct dirent); i++) {
+			if (same_string(de[i].name, name))
+				ino = de[i].inode;
+		}
+	}
+	fs_close(fd);
+	return ino;
+}
+
+/* Print the buffer cache statistics */
+static void bcache(void) {
+	struct bcache_stat st;
+	int requests;
+
+	block_cache_stat(&st);
+	requests = st.hits + st.misses;
+
+	printf("buffer cache: %d blocks\n", BCACHE_BLOCKS);
+	printf("hits: %d misses: %d hit rate: %d%%\n", st.hits, st.misses, (requests > 0) ? (st.hits * 100) / requests : 0);
+	printf("device reads: %d device writes: %d in %d requests\n", st.dev_reads, st.dev_writes, st.write_ops);
+	printf("evictions: %d dirty: %d delayed: %d\n", st.evictions, st.dirty, st.delayed);
+	printf("journal commits: %d blocks: %d checkpoints: %d\n", st.commits, st.jblocks, st.checkpoints);
+	printf("direct block reads: %d\n", st.direct);
+}
+
+/* Check and repair the file system, and print what was found */
+static void fsck(void) {
+	struct fsck_stat st;
+	int problems;
+
+	problems = fs_fsck(TRUE, &st);
+	if (problems < 0) {
+		print_fse(problems);
+		return;
+	}
+
+	printf("inodes: %d blocks: %d\n", st.inodes, st.blocks);
+	printf("bad entries: %d bad directory sizes: %d\n", st.bad_entries, st.bad_sizes);
+	printf("bad link counts: %d orphans: %d bad block pointers: %d\n", st.bad_links, st.orphans, st.bad_pointers);
+	printf("bad inode bitmap bits: %d bad block bitmap bits: %d\n", st.bad_ibmap, st.bad_dbmap);
+	printf("bad free counts: %d\n", st.bad_counts);
+	printf("%d problems%s, %d Kcycles\n", problems, st.repaired ? " repaired" : "", (int)(st.tsc >> 10));
+}
+
+/* Print the size of the file system and how much of it is free */
+static void df(void) {
+	struct fs_statfs st;
+	int ev;
+
+	if ((ev = fs_statfs(&st)) < 0) {
+		print_fse(ev);
+		return;
+	}
+
+	printf("%d blocks of %d bytes, %d free\n", st.blocks, st.block_size, st.free_blocks);
+	printf("%d inodes, %d free\n", st.inodes, st.free_inodes);
+	printf("%d allocation groups of %d blocks\n", st.groups, st.group_blocks);
+}
+
 /* Print file system error value */
 static void print_fse(int ev) {
 	printf("File system error value: %d\n", ev);
@@ -6,18 +6,66 @@
  *
  * The filesystem layout looks like this:
  *
- * +-------------+-----------------------------+-/
- * | Super block |  Inode & data bitmap block  |
- * +-------------+-----------------------------+-/
+ *                                          <------------- Inode area ------------>
+ * +-------------+--------------------------+---------------+-//-+---------------+-/
+ * | Super block |    Inode bitmap block    | Inode block 1 |    | Inode block n |
+ * +-------------+--------------------------+---------------+-//-+---------------+-/
  *
- * <------ Inode area ----> <-------- Data block area -------->
- * /--------+-//-+---------+--------------+-//-+--------------+
- *  Inode 1 |    | Inode n | Data block 1 |    | Data block n |
- * /--------+-//-+---------+--------------+-//-+--------------+
+ * /-----------------+-//-+-----------------+--------------------+-//-+--------------------+-/
+ *  Journal block 1 |    | Journal block n | Data bitmap block 1 |    | Data bitmap block n |
+ * /-----------------+-//-+-----------------+--------------------+-//-+--------------------+-/
+ *
+ * <-------- Data block area -------->
+ * /--------------+-//-+--------------+
+ *  Data block 1 |    | Data block n |
+ * /--------------+-//-+--------------+
+ *
+ * The super block, the inode bitmap block and the first inode block
+ * (which holds the root inode) are the first MOUNT_BLOCKS blocks of the
+ * file system, so mounting reads them with a single device read.
+ * Everything else is read when it is first used.
+ *
+ * The file system has nblocks blocks, as many as the device had room
+ * for when it was made (see block_dev_blocks()). Block numbers are 32
+ * bits, so this is only limited by what fs_fsck() can check.
+ *
+ * The inode area is inode_blocks blocks starting at block inode_start,
+ * and holds ninodes inodes, a number decided from the size of the file
+ * system when it is made (see fs.h). Inode i is stored in block
+ * inode_start + i / INODES_PER_BLK.
+ * The metadata journal is journal_blocks blocks starting at block
+ * journal_start (see block_cache.c).
+ *
+ * The data block bitmap has one bit for every block of the file
+ * system, metadata included, and takes dbmap_blocks blocks starting at
+ * block dbmap_start. Bit n of bitmap block i is block
+ * i * BLOCK_SIZE * 8 + n. It is too large to keep in memory, so it is
+ * read and changed through the buffer cache like other metadata. Bits
+ * past the last block are set, so they are never allocated.
+ *
+ * The blocks are divided into ngroups allocation groups of
+ * group_blocks blocks each (the last one may be smaller). A group is a
+ * power of two of blocks, GROUP_BLOCKS unless the file system is too
+ * small to have a few groups of that size, or too large to have at most
+ * FS_MAX_GROUPS of them. The superblock keeps the number
+ * of free blocks in each group (group_free), in the whole file system
+ * (free_blks), and the number of free inodes, so free space is known
+ * without scanning the bitmaps, and full groups are skipped without
+ * reading their bitmap. The counts change with the bitmaps, and are
+ * written together with them. A file's blocks are allocated in the
+ * group of its directory, and a new directory goes to the group with
+ * the most free blocks, which keeps related blocks close together and
+ * spreads unrelated ones.
  *
  * The member max_filesize is:
- * BLOCK_SIZE * (NDIRECT + (BLOCK_SIZE / sizeof(blknum_t))) = 1056KB
- * at present.
+ * BLOCK_SIZE * (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT), where
+ * NINDIRECT = BLOCK_SIZE / sizeof(blknum_t), about 8MB with 512 byte
+ * blocks. With larger blocks it is limited to FS_MAX_FILESIZE.
+ *
+ * Blocks are BLOCK_SIZE bytes, as set when the kernel is built (see
+ * block.h), and block_size records it. The superblock fits in the first
+ * sector, so a kernel built with another block size still finds it,
+ * and says why it does not mount it.
  *
  * The root_inode member gives the block number on disk where the
  * inode for the root directory of this filesystem resides.
@@ -25,27 +73,51 @@
 
 #include "fstypes.h"
 
+/* Largest number of allocation groups, as many as the first sector has room for */
+#define FS_MAX_GROUPS 112
+/* Number of blocks in an allocation group, unless there are too few or too many groups */
+#define GROUP_BLOCKS 4096
+
 typedef struct disk_superblock disk_superblock_t;
 struct disk_superblock {
-	short ninodes;       /* number of index nodes in the filesystem */
-	short ndata_blks;    /* number of data blocks */
+	int ninodes;         /* number of index nodes in the filesystem */
+	int inode_blocks;    /* number of blocks in the inode area */
+	blknum_t nblocks;    /* number of blocks in the filesystem, metadata included */
 	blknum_t root_inode; /* block number of inode for the root dir */
-	short max_filesize;  /* the size of the largest file */
-	int signature;			/*Magic number 69*/
+	blknum_t inode_start; /* first block of the inode area */
+	blknum_t bitmap_block; /* block holding the inode bitmap */
+	blknum_t journal_start; /* first block of the journal region */
+	int journal_blocks;  /* number of blocks in the journal region */
+	int dbmap_blocks;    /* number of blocks in the data block bitmap */
+	blknum_t dbmap_start; /* first block of the data block bitmap */
+	int max_filesize;    /* the size of the largest file */
+	int signature;			/*Magic number 71*/
+	short block_size;    /* BLOCK_SIZE of the kernel that made it */
+	short ngroups;       /* number of allocation groups */
+	int group_blocks;    /* blocks in each allocation group */
+	int free_inodes;     /* number of free index nodes */
+	blknum_t free_blks;  /* number of free blocks */
+	int group_free[FS_MAX_GROUPS]; /* number of free blocks in each group */
 };
 
+#define FS_SIGNATURE 71
+/* Block numbers of the fixed part of the layout */
+#define SUPER_BLOCK 0
+#define BITMAP_BLOCK 1
+#define INODE_START 2
+#define MOUNT_BLOCKS 3
+
 #define SUPERBLK_SIZE 1
 /*
  * The superblock as used in memory. The dirty member is true if
- * filesystem metadata needs to be updated (happens when one of the
- * inode bitmaps is changed).
+ * the inode bitmap or the free counts need to be written (the data
+ * block bitmap is changed in the buffer cache right away).
  */
 
 typedef struct mem_superblock mem_superblock_t;
 struct mem_superblock {
 	struct disk_superblock d_super;
 	void *ibmap; /* bitmap for inodes */
-	void *dbmap; /* bitmap for data blocks */
 	char dirty;
 };
 
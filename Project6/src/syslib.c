@@ -129,3 +129,80 @@ int fs_chdir(char *path) {
 int fs_rmdir(char *path) {
 	return invoke_syscall(SYSCALL_FS_RMDIR, (int)path, IGNORE, IGNORE);
 }
+
+int fs_fsck(int repair, struct fsck_stat *st) {
+	return invoke_syscall(SYSCALL_FS_FSCK, repair, (int)st, IGNORE);
+}
+
+int fs_sync(void) {
+	return invoke_syscall(SYSCALL_FS_SYNC, IGNORE, IGNORE, IGNORE);
+}
+
+int fs_statfs(struct fs_statfs *st) {
+	return invoke_syscall(SYSCALL_FS_STATFS, (int)st, IGNORE, IGNORE);
+}
+
+int io_stat(struct iostat *st) {
+	return invoke_syscall(SYSCALL_IOSTAT, (int)st, IGNORE, IGNORE);
+}
+
+/*
+ * A trap passes only three arguments, so the buffer and its size are
+ * passed in a struct fs_iovec.
+ */
+int fs_pread(int fd, char *buffer, int size, int offset) {
+	struct fs_iovec iov = {buffer, size};
+
+	return invoke_syscall(SYSCALL_FS_PREAD, fd, (int)&iov, offset);
+}
+
+int fs_pwrite(int fd, char *buffer, int size, int offset) {
+	struct fs_iovec iov = {buffer, size};
+
+	return invoke_syscall(SYSCALL_FS_PWRITE, fd, (int)&iov, offset);
+}
+
+/* Like fs_pread, the buffer and its size are passed in a struct fs_iovec */
+int fs_getdents(int fd, char *buffer, int size, int *cookie) {
+	struct fs_iovec iov = {buffer, size};
+
+	return invoke_syscall(SYSCALL_FS_GETDENTS, fd, (int)&iov, (int)cookie);
+}
+
+int fs_readv(int fd, struct fs_iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_READV, fd, (int)iov, iovcnt);
+}
+
+int fs_writev(int fd, struct fs_iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_WRITEV, fd, (int)iov, iovcnt);
+}
+
+/*
+ * Returns the address the file is mapped at, or a negative error. The
+ * file is read as its pages are touched, and stays mapped until the
+ * process exits.
+ */
+int fs_mmap(int fd, int offset, int size) {
+	return invoke_syscall(SYSCALL_FS_MMAP, fd, offset, size);
+}
+
+int fs_msync(int addr, int size) {
+	return invoke_syscall(SYSCALL_FS_MSYNC, addr, size, IGNORE);
+}
+
+/*
+ * Queue a read or write of at most a page, and return at once. When it
+ * is done, a message with a struct fs_aio_done as body is sent to
+ * mailbox q, carrying tag. The request is passed in a struct fs_aio.
+ */
+int fs_read_async(int fd, char *buffer, int size, int q, int tag) {
+	struct fs_aio aio = {fd, buffer, size, q, tag};
+
+	return invoke_syscall(SYSCALL_FS_READ_ASYNC, (int)&aio, IGNORE, IGNORE);
+}
+
+int fs_write_async(int fd, char *buffer, int size, int q, int tag) {
+	struct fs_aio aio = {fd, buffer, size, q, tag};
+
+	return invoke_syscall(SYSCALL_FS_WRITE_ASYNC, (int)&aio, IGNORE, IGNORE);
+}
@@ -32,5 +32,18 @@ int fs_lseek(int fd, int offset, int whence);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
 int fs_stat(int fd, char *buffer);
+int fs_fsck(int repair, struct fsck_stat *st);
+int fs_pread(int fd, char *buffer, int size, int offset);
+int fs_pwrite(int fd, char *buffer, int size, int offset);
+int fs_readv(int fd, struct fs_iovec *iov, int iovcnt);
+int fs_writev(int fd, struct fs_iovec *iov, int iovcnt);
+int fs_getdents(int fd, char *buffer, int size, int *cookie);
+int fs_mmap(int fd, int offset, int size);
+int fs_msync(int addr, int size);
+int fs_read_async(int fd, char *buffer, int size, int q, int tag);
+int fs_write_async(int fd, char *buffer, int size, int q, int tag);
+int fs_sync(void);
+int fs_statfs(struct fs_statfs *st);
+int io_stat(struct iostat *st);
 
 #endif /* !SYSLIB_H */
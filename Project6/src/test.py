@@ -1,7 +1,8 @@
 import os, sys, string, time, subprocess
 
-fsck_implemented = False
-flush_implemented = False
+fsck_implemented = True
+flush_implemented = True
+failed = []
 
 def do_fsck() :
     if (fsck_implemented==True) :
@@ -11,18 +12,26 @@ def do_fsck() :
         p.stdin.write('ls\n')
     p.stdin.flush()
 
+# Ends the test with the commands in input, and checks that the strings
+# in output show up, in that order, in what the shell printed
 def check(input, output) :
     p.stdin.write(input)
-    p.stdin.flush()
-    p.stdout.flush()
-    out = p.stdout.read()
+    out = do_exit()
     print out
-    if out != output :
-        print "File content does not match, command", input
-    else:
-        print "ok\n"
-        
+    pos = 0
+    for expected in output :
+        pos = out.find(expected, pos)
+        if pos < 0 :
+            print "Output does not match, expected", repr(expected)
+            failed.append(input)
+            return
+        pos += len(expected)
+    print "ok\n"
+
+
 def do_exit():
+    if (flush_implemented==True) :
+        p.stdin.write('sync\n')
     p.stdin.write('exit\n')
     return p.communicate()[0]
     
@@ -44,9 +53,8 @@ def test1():
     p.stdin.write('ln foo bar\n')
     do_fsck()
     p.stdin.write('ls\n')
-    p.stdin.write('cat bar\n')
-    p.stdin.write('.\n')
-    do_exit()
+    check('cat bar\n.\n', ['0 problems', 'foo: 1 0 0', 'd1: 2 0 ',
+                             '0 problems', '\tfoo ', '\tbar '])
     print "----------Test1 Finished----------\n"
 
 # test2: open/write/close
@@ -55,17 +63,14 @@ def test2() :
     do_fsck()
     p.stdin.write('cat testf\n')
     p.stdin.write('WELL\n')
-    p.stdin.write('DONE\n')
-    p.stdin.write('.\n')
-    do_exit()
+    check('DONE\n.\n', ['0 problems'])
     print "----------Test2 Finished----------\n"    
 
 #open with readonly test
 def test3():
     print "----------Starting Test3----------\n"
     do_fsck()
-    p.stdin.write('more testf\n')
-    do_exit()
+    check('more testf\n', ['0 problems', 'WELL\nDONE'])
     print "----------Test3 Finished----------\n"    
 
 #test4: rm tests
@@ -78,8 +83,7 @@ def test4():
     p.stdin.write('more bar\n')  # ABCD
     p.stdin.write('rm bar\n')
     p.stdin.write('ls\n')
-    p.stdin.write('more bar\n') # cat should fail
-    do_exit()
+    check('more bar\n', ['0 problems', '\tbar ', '\t.. 0\n/d1$']) # cat should fail
     print "----------Test4 Finished----------\n"
 
 
@@ -90,8 +94,8 @@ def test5() :
     p.stdin.write('rmdir non_exitsting\n') # Problem with removing directory
     p.stdin.write('cd non_exitsing\n') # Problem with changing directory
     p.stdin.write('ln non_existing non_existing_too\n') # Problem with ln
-    p.stdin.write('rm non_existing\n') # Problem with rm
-    do_exit()
+    check('rm non_existing\n', ['0 problems', 'error value: -5', 'error value: -10',
+                                 'error value: -5', 'error value: -18']) # Problem with rm
     print "----------Test5 Finished----------\n"
 
 #test 6: create lots of files in one dir
@@ -106,14 +110,14 @@ def test6():
 		p.stdin.write('.\n')
     p.stdin.write('more f1\n')  # ABCDE
     p.stdin.write('stat f3\n')  # 6
-    p.stdin.write('more f20\n')   # ABCDE
-    do_exit()
+    check('more f20\n', ['ABCDE', 'f3: 1 0 6', 'ABCDE'])
     print "----------Test6 Finished----------\n"
 
 
 #test 7: create a lot of directories
 def test7() :
     print "----------Starting Test7----------\n"
+    p.stdin.write('mkfs\n')
     p.stdin.write('mkdir d2\n')
     p.stdin.write('cd d2\n')
     for i in range (1, 50) :
@@ -123,13 +127,87 @@ def test7() :
     p.stdin.write('cd ..\n')
     p.stdin.write('cd ..\n')
     p.stdin.write('cd ..\n')
-    p.stdin.write('stat d47\n') # DIRECTORY
-    do_exit()
+    check('stat d47\n', ['d1: 2 0 ', 'd49: 2 0 ', 'd47: 2 0 ']) # DIRECTORY
     print "----------Test7 Finished----------\n"
 
+#test 8: a file larger than the direct blocks (needs the indirect block)
+def test8() :
+    print "----------Starting Test8----------\n"
+    p.stdin.write('mkfs\n')
+    p.stdin.write('mkdir d3\n')
+    p.stdin.write('cd d3\n')
+    p.stdin.write('cat big\n')
+    for i in range (1, 120) :
+		p.stdin.write('%04d 0123456789012345678901234567890123456789\n' % i)
+    p.stdin.write('.\n')
+    p.stdin.write('stat big\n')
+    check('more big\n', ['big: 1 0 5474',
+                          '0119 0123456789012345678901234567890123456789'])
+    print "----------Test8 Finished----------\n"
+
+#test 9: path lookups through the dentry cache
+def test9() :
+    print "----------Starting Test9----------\n"
+    p.stdin.write('mkfs\n')
+    p.stdin.write('mkdir d4\n')
+    p.stdin.write('cd d4\n')
+    p.stdin.write('mkdir sub\n')
+    p.stdin.write('cd sub\n')
+    p.stdin.write('cat f\n')
+    p.stdin.write('XYZ\n')
+    p.stdin.write('.\n')
+    p.stdin.write('cd ..\n')
+    p.stdin.write('stat sub/f\n')
+    p.stdin.write('stat /d4/sub/f\n') # hits grow, misses do not
+    p.stdin.write('ln sub g\n')
+    p.stdin.write('stat g\n')
+    p.stdin.write('rm g\n')
+    check('ls\n', ['sub/f: 1 0 4', '/d4/sub/f: 1 0 4', 'g: 2 1 ', '\tsub ']) # g is gone
+    print "----------Test9 Finished----------\n"
+
+#test 10: a directory with more entries than fit in one block
+def test10() :
+    print "----------Starting Test10----------\n"
+    p.stdin.write('mkfs\n')
+    p.stdin.write('mkdir d5\n')
+    p.stdin.write('cd d5\n')
+    p.stdin.write('cat f\n')
+    p.stdin.write('X\n')
+    p.stdin.write('.\n')
+    for i in range (0, 500) :
+		p.stdin.write('ln f l%d\n' % i)
+    p.stdin.write('rm l250\n')
+    p.stdin.write('stat l499\n') # refs is one byte, 499 shows as -13
+    check('ls\n', ['l499: 1 -13 2', '\tl499 ']) # 501 entries
+    print "----------Test10 Finished----------\n"
+
+#test 11: more files than fit in one inode block or in the inode cache
+def test11() :
+    print "----------Starting Test11----------\n"
+    p.stdin.write('mkfs\n')
+    p.stdin.write('mkdir d6\n')
+    p.stdin.write('cd d6\n')
+    for i in range (0, 60) :
+		p.stdin.write('cat f%d\n' % i)
+		p.stdin.write('file %d\n' % i)
+		p.stdin.write('.\n')
+    p.stdin.write('more f0\n')
+    p.stdin.write('stat f59\n')
+    check('ls\n', ['file 0', 'f59: 1 0 8', '\tf59 '])
+    print "----------Test11 Finished----------\n"
+
+#test 12: files made by test 11 are still there after mounting
+def test12() :
+    print "----------Starting Test12----------\n"
+    p.stdin.write('cd d6\n')
+    p.stdin.write('more f59\n')
+    check('stat f0\n', ['file 59', 'f0: 1 0 7'])
+    print "----------Test12 Finished----------\n"
+
 def spawn_lnxsh():
     global p
-    p = subprocess.Popen('./p6sh', shell=True, stdin=subprocess.PIPE)
+    p = subprocess.Popen('./p6sh', shell=True, stdin=subprocess.PIPE,
+                         stdout=subprocess.PIPE)
  
 ####### Main Test Program #######
 print "..........Starting\n\n"
@@ -147,6 +225,19 @@ spawn_lnxsh()
 test6()
 spawn_lnxsh()
 test7()
+spawn_lnxsh()
+test8()
+spawn_lnxsh()
+test9()
+spawn_lnxsh()
+test10()
+spawn_lnxsh()
+test11()
+spawn_lnxsh()
+test12()
 print "\nFinished !"
+if failed :
+    print "%d tests failed" % len(failed)
+    sys.exit(1)
 
 
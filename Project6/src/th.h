@@ -10,6 +10,12 @@ void clock_thread(void);
 /* Scans USB hub ports */
 void usb_thread(void);
 
+/* Writes file system changes to disk now and then */
+void flush_thread(void);
+
+/* Carries out asynchronous reads and writes */
+void io_thread(void);
+
 /* Threads to test the condition variables and locks */
 void thread2(void);
 void thread3(void);
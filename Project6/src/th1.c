@@ -2,6 +2,7 @@
  * loader_thread is used to load the shell. clock_thread is a thread
  * which runs indefinitely.
  */
+#include "aio.h"
 #include "fs.h"
 #include "kernel.h"
 #include "mbox.h"
@@ -13,6 +14,7 @@
 #include "util.h"
 
 #define MHZ 2000 /* CPU clock rate */
+#define FLUSH_INTERVAL 5000 /* ms between file system flushes */
 
 /*
  * This thread is started to load the user shell, which is the first
@@ -65,3 +67,27 @@ void usb_thread(void) {
 		usb_hub_scan_ports();
 	}
 }
+
+/*
+ * This thread writes what the file system has changed in memory to
+ * disk every FLUSH_INTERVAL ms, so that little is lost if the machine
+ * goes down. fs_sync() does nothing until the file system is up, and
+ * its commit waits for the operations in progress to end, so it never
+ * splits one.
+ */
+void flush_thread(void) {
+	while (1) {
+		msleep(FLUSH_INTERVAL);
+		fs_sync();
+	}
+}
+
+/*
+ * This thread carries out the reads and writes queued by
+ * fs_read_async and fs_write_async, one at a time.
+ */
+void io_thread(void) {
+	while (1) {
+		aio_serve();
+	}
+}
@@ -1,8 +1,8 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
-#define KERNEL_ALLOC_START 0x030000     /* Mem page top value    */
-#define KERNEL_ALLOC_STOP  0x040000
+#define KERNEL_ALLOC_START 0x080000     /* Above the kernel stacks */
+#define KERNEL_ALLOC_STOP  0x090000
   
 void *kzalloc(int size);
 void *kzalloc_align(int size, int alignment);
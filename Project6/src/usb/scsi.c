@@ -1,3 +1,4 @@
+#include "../block.h"
 #include "../util.h"
 #include "../thread.h"
 #include "scsi.h"
@@ -14,6 +15,9 @@ DEBUG_NAME("SCSI");
 static struct scsi_dev *scsi = NULL;
 static int scsi_dev_lock;
 
+/* READ(10) and WRITE(10) commands, protected by scsi_dev_lock */
+static struct io_counts scsi_stat[2];
+
 static int scsi_read_write(int dir, int block_start,
     int block_count, char *data);
 
@@ -187,10 +191,17 @@ static int scsi_read_write(int dir, int block_start,
     int block_count, char *data) {
   int transfer_len;
   int rc;
+  uint64_t start, locked;
+  int busy;
 
+  /* Note whether another request holds the device, and for how long */
+  start = get_timer();
+  busy = (scsi_dev_lock != UNLOCKED);
   spinlock_acquire(&scsi_dev_lock);
+  locked = get_timer();
 
   if (scsi == NULL) {
+    iostat_add(&scsi_stat[dir], 0, 0, start, busy ? locked - start : 0, FALSE);
     spinlock_release(&scsi_dev_lock);
     return -1;
   }
@@ -215,6 +226,8 @@ static int scsi_read_write(int dir, int block_start,
     rc = scsi->write(scsi->driver, sizeof(cdb10), (char *)&cdb10, 
         transfer_len, data);
 
+  iostat_add(&scsi_stat[dir], block_count, transfer_len, start,
+      busy ? locked - start : 0, rc == SCSI_RC_GOOD);
   spinlock_release(&scsi_dev_lock);
 
   if (rc != SCSI_RC_GOOD) {
@@ -234,3 +247,24 @@ int scsi_write(int block_start, int block_count, char *data) {
   return scsi_read_write(SCSI_WRITE, block_start, block_count, data);
 }
 
+/* Copy the read (st[SCSI_READ]) and write (st[SCSI_WRITE]) counters */
+void scsi_get_stat(struct io_counts *st) {
+  spinlock_acquire(&scsi_dev_lock);
+  bcopy((char *)scsi_stat, (char *)st, sizeof(scsi_stat));
+  spinlock_release(&scsi_dev_lock);
+}
+
+/*
+ * Number of blocks on the device, as found by scsi_read_capacity()
+ * when it was attached, or 0 if there is no device
+ */
+int scsi_get_capacity(void) {
+  int blocks = 0;
+
+  spinlock_acquire(&scsi_dev_lock);
+  if (scsi != NULL)
+    blocks = scsi->total_block_count;
+  spinlock_release(&scsi_dev_lock);
+  return blocks;
+}
+
@@ -38,12 +38,16 @@ struct scsi_ifc {
                int len, char *data);
 };
 
+struct io_counts;
+
 void scsi_static_init(void);
 int scsi_init(struct scsi_ifc *ifc);
 int scsi_read(int block_start, int block_count, char *data);
 int scsi_write(int block_start, int block_count, char *data);
 void scsi_free();
 int scsi_up();
+void scsi_get_stat(struct io_counts *st);
+int scsi_get_capacity(void);
 
 
 /* Command description block 6 byte long structure */
@@ -93,15 +93,19 @@ void scroll(int minx, int miny, int maxx, int maxy) {
 
 /* Simple delay loop to slow things down */
 void delay(int n) {
-	int i, j;
+	volatile int i;
 
 	for (i = 0; i < n; i++)
-		j = i * 11;
+		;
 }
 
 /* Read the pentium time stamp counter */
 unsigned long long int get_timer(void) {
-	return 0;
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((unsigned long long int)hi << 32) | lo;
 }
 
 /* Convert an ASCII string (like "234") to an integer */